@@ -1,9 +1,43 @@
 package org.scriptable;
 
-import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
 import java.util.HashMap;
-import java.util.function.Predicate;
+import java.util.LinkedHashMap;
+import java.util.LinkedHashSet;
+import java.util.Map;
+import java.util.Set;
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.io.OutputStream;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.channels.WritableByteChannel;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.CompletionException;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.ConcurrentLinkedDeque;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.Executor;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Semaphore;
+import java.util.concurrent.ThreadFactory;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.TimeoutException;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.atomic.AtomicReferenceFieldUpdater;
+import java.util.function.BiConsumer;
+import java.util.function.BiFunction;
+import java.util.function.Function;
+import java.util.function.Supplier;
 import java.lang.ref.WeakReference;
+import java.lang.reflect.Method;
+import java.lang.reflect.Modifier;
+import java.lang.management.ManagementFactory;
+import javax.management.InstanceAlreadyExistsException;
+import javax.management.MBeanServer;
+import javax.management.ObjectName;
 
 public class QuickJSConnector {
     // NOTE: since this class must be loaded from tomcat's lib using its root class loader,
@@ -11,28 +45,187 @@ public class QuickJSConnector {
     String filename;
     String mainFunc;
     String ctxKey;
-    private ArrayList<WeakReference<QJSRuntime>> allInstances;
-    // need to maintain per app/script list, since static is shared between apps
-    private static HashMap<String, ArrayList<WeakReference<QJSRuntime>>> allInstancesMap = new HashMap<>();
-    long timestamp;
+    private Set<WeakReference<QJSRuntime>> allInstances;
+    // need to maintain per app/script registries, since static is shared between apps. They are
+    // concurrent so that runtimes of any script are created and released in parallel, under no lock
+    private static ConcurrentHashMap<String, Set<WeakReference<QJSRuntime>>> allInstancesMap =
+            new ConcurrentHashMap<>();
+    private RuntimePool pool; // null unless in pool mode
+    private static ConcurrentHashMap<String, RuntimePool> poolMap = new ConcurrentHashMap<>();
+    // applied to runtimes created later
+    private static ConcurrentHashMap<String, Limits> limitsMap = new ConcurrentHashMap<>();
+    private static ConcurrentHashMap<String, HostTable> hostMap = new ConcurrentHashMap<>();
+    volatile long timestamp;
+    private volatile int timeoutMillis; // default call time budget, 0 if none
+    // returned by the call natives when the main function threw, must be initialized before loading the library
+    static final Object JS_EXCEPTION = new Object();
+    static final Object JS_TIMEOUT = new Object(); // returned when the call ran out of time
     static {
         System.loadLibrary("quickjsc");
     }
 
-    private native static byte[] nativeNewQJSRuntime(String filename, String mainFunc);
-    private native static void nativeFreeQJSRuntime(byte[] ctx);
-    private native int nativeCallQJS(byte[] ctx, Object[] argv);
-    private native Object[] nativeGetQJSException(byte[] ctx);
+    // runtimes are referred to by opaque native handles, 0 is never a valid handle
+    private native static long nativeNewQJSRuntime(String filename, String mainFunc, boolean shared,
+            long memoryLimit, long gcThreshold, long maxStackSize, int allocator, Class<?> hostClass,
+            Object[] hostFunctions);
+    private native static void nativeFreeQJSRuntime(long ctx);
+    private native Object nativeCallQJS(long ctx, Object[] argv, ByteBuffer out, Object sink, boolean async,
+            int timeout);
+    private native Object nativeCallQJSArgs(long ctx, ByteBuffer args, int len, ByteBuffer out, Object sink,
+            boolean async, int timeout);
+    private native int nativeCallQJSBatch(long ctx, Object[][] argvs, Object[] results, Object[] errors, int timeout);
+    private native int nativeCallQJSArgsBatch(long ctx, ByteBuffer args, int len, int count, Object[] results,
+            Object[] errors, int timeout);
+    private native Object[] nativeGetQJSException(long ctx);
+    private native static long[] nativeGetBytecodeCacheStats();
+    private native static void nativeCompleteJava(long ctx, int id, Object[] result, Throwable error);
+    private native static long[] nativeGetScriptStats(String ctxKey);
+    private native static long[] nativeGetMemoryUsage(long[] ctx);
+    private native static long[] nativeGetAllocatorStats();
+    private native static long nativeTrimMemory();
+    private native static void nativeStartIdleTrim(int idleMillis);
+    private native static long[] nativeGetTrimStats();
+    private native static boolean nativeSetLogSink(int sink, String path);
+    private native static void nativeFlushLog();
+    private native static long[] nativeGetLogStats();
+    private native static String[] nativeGetChangedModules(String filename);
+    private native static boolean nativeWarmModules(String filename);
 
     public QuickJSConnector(String filename, String mainFunc, long timestamp) {
+        this(filename, mainFunc, timestamp, 0);
+    }
+
+    /* poolSize > 0 enables pool mode: at most poolSize runtimes per filename/mainFunc are shared by
+       all threads, each borrowed for the duration of callQJS. Otherwise every thread gets its own runtime.
+       The pool is created by the first connector in pool mode for this filename/mainFunc */
+    public QuickJSConnector(String filename, String mainFunc, long timestamp, int poolSize) {
+        this(filename, mainFunc, timestamp, poolSize, null);
+    }
+
+    /* limits, if not null, replace those of this filename/mainFunc for runtimes created from now on */
+    public QuickJSConnector(String filename, String mainFunc, long timestamp, int poolSize, Limits limits) {
+        this(filename, mainFunc, timestamp, poolSize, limits, null);
+    }
+
+    /* hostFunctions, if not null, replace those of this filename/mainFunc for runtimes created from now on.
+       Their methods are looked up in this connector's class, only connectors of that class can call them */
+    public QuickJSConnector(String filename, String mainFunc, long timestamp, int poolSize, Limits limits,
+            HostFunction[] hostFunctions) {
         this.filename = filename;
         this.mainFunc = mainFunc;
         this.ctxKey = makeCtxKey(filename, mainFunc);
         this.timestamp = timestamp;
-        synchronized(QuickJSConnector.class) {
-            if (!allInstancesMap.containsKey(this.ctxKey))
-                allInstancesMap.put(this.ctxKey, new ArrayList<WeakReference<QJSRuntime>>());
-            this.allInstances = allInstancesMap.get(this.ctxKey);
+        HostTable hosts = hostFunctions != null? new HostTable(getClass(), hostFunctions) : null;
+        this.allInstances = allInstancesMap.computeIfAbsent(this.ctxKey,
+                new Function<String, Set<WeakReference<QJSRuntime>>>() {
+                    public Set<WeakReference<QJSRuntime>> apply(String key) {
+                        return ConcurrentHashMap.newKeySet();
+                    }
+                });
+        if (poolSize > 0) {
+            this.pool = poolMap.computeIfAbsent(this.ctxKey, new Function<String, RuntimePool>() {
+                public RuntimePool apply(String key) {
+                    return new RuntimePool(poolSize);
+                }
+            });
+        }
+        if (limits != null)
+            limitsMap.put(this.ctxKey, limits);
+        if (hosts != null)
+            hostMap.put(this.ctxKey, hosts);
+    }
+
+    /* per runtime settings, 0 keeps the QuickJS default. A runtime exceeding memoryLimit
+       fails the call with an out of memory error and is released */
+    public static final class Limits {
+        // keep in sync with ALLOCATOR_* in quickjs-jni.c
+        public static final int MALLOC = 0;
+        public static final int ARENA = 1; // per runtime slab allocator, see getAllocatorStats
+        public static final int ISOLATED = 2; // ARENA backed by the runtime's own mappings only
+
+        public final long memoryLimit; // bytes allocated by the runtime
+        public final long gcThreshold; // bytes allocated before GC runs
+        public final long maxStackSize; // in pool mode, counted from each call's frame on the borrowing thread
+        public final int allocator;
+
+        public Limits(long memoryLimit, long gcThreshold, long maxStackSize) {
+            this(memoryLimit, gcThreshold, maxStackSize, MALLOC);
+        }
+
+        public Limits(long memoryLimit, long gcThreshold, long maxStackSize, int allocator) {
+            this.memoryLimit = memoryLimit;
+            this.gcThreshold = gcThreshold;
+            this.maxStackSize = maxStackSize;
+            this.allocator = allocator;
+        }
+    }
+
+    /* A public method of the connector called from JS as the global function name, with its method
+       ID resolved once per runtime rather than dispatched through callJava(...). Parameters may be
+       boolean, int, long, double, String or Object, the latter converted as callJava arguments. The
+       result may also be void or of any class, converted as callJava results. Exceptions thrown by
+       the method are thrown in JS */
+    public static final class HostFunction {
+        public final String name;
+        public final String method;
+        public final Class<?>[] parameterTypes;
+
+        public HostFunction(String name, String method, Class<?>... parameterTypes) {
+            this.name = name;
+            this.method = method;
+            this.parameterTypes = parameterTypes;
+        }
+    }
+
+    /* host functions resolved in the connector class registering them, entries alternate
+       name, Method and JNI signature */
+    private static final class HostTable {
+        static final int MAX_ARGS = 16; // keep in sync with HOST_FUNC_MAX_ARGS in quickjs-jni.c
+
+        final Class<?> cls;
+        final Object[] entries;
+
+        HostTable(Class<?> cls, HostFunction[] functions) {
+            this.cls = cls;
+            this.entries = new Object[functions.length * 3];
+            int i = 0;
+            for (HostFunction f: functions) {
+                Method m;
+                try {
+                    m = cls.getMethod(f.method, f.parameterTypes);
+                } catch(NoSuchMethodException e) {
+                    throw new IllegalArgumentException("host function " + f.name + ": no public method " +
+                            f.method + Arrays.toString(f.parameterTypes) + " in " + cls.getName());
+                }
+                if (Modifier.isStatic(m.getModifiers()) || f.parameterTypes.length > MAX_ARGS)
+                    throw new IllegalArgumentException("host function " + f.name +
+                            ": method must not be static nor take more than " + MAX_ARGS + " arguments");
+                StringBuilder sig = new StringBuilder("(");
+                for (Class<?> t: f.parameterTypes)
+                    sig.append(signature(f, t, false));
+                sig.append(')').append(signature(f, m.getReturnType(), true));
+                entries[i++] = f.name;
+                entries[i++] = m;
+                entries[i++] = sig.toString();
+            }
+        }
+
+        private static String signature(HostFunction f, Class<?> t, boolean result) {
+            if (t == boolean.class)
+                return "Z";
+            if (t == int.class)
+                return "I";
+            if (t == long.class)
+                return "J";
+            if (t == double.class)
+                return "D";
+            if (t == void.class && result)
+                return "V";
+            if (t == String.class)
+                return "Ljava/lang/String;";
+            if (t == Object.class || (result && !t.isPrimitive()))
+                return "Ljava/lang/Object;";
+            throw new IllegalArgumentException("host function " + f.name + ": unsupported type " + t.getName());
         }
     }
 
@@ -40,21 +233,127 @@ public class QuickJSConnector {
         return filename + "/" + mainFunc;
     }
 
+    /* backs callJava(...) in JS. Arguments and results convert as: numbers Integer/Double, arrays
+       Object[], objects and Maps LinkedHashMap, Sets LinkedHashSet, ArrayBuffers and typed arrays
+       direct ByteBuffers referring to JS memory, valid only during the call. Java Maps become JS
+       objects, Lists and other Collections arrays, direct ByteBuffers ArrayBuffers sharing their
+       memory, byte[] ArrayBuffers with a copy, other objects their toString(). Exceptions are thrown
+       in JS, as is an InternalError for a {"__error__", message} result. Prefer HostFunction for
+       anything called often */
     public Object[] callJava(Object[] argv) {
         Object [] ret = new Object[] { "__error__", "sample error" };
         return ret;
     }
 
-    // QJS runtime must be used by the thread which created it
+    /* typed variants of callJava for hot lookups, nothing is boxed or wrapped in arrays.
+       Called by callJavaString(str), callJavaNumber(str) and callJavaInt(a, b) in JS,
+       override the ones the script uses */
+    public String callJavaString(String arg) {
+        throw new UnsupportedOperationException("callJavaString");
+    }
+
+    public double callJavaNumber(String arg) {
+        throw new UnsupportedOperationException("callJavaNumber");
+    }
+
+    public int callJavaInt(int a, int b) {
+        throw new UnsupportedOperationException("callJavaInt");
+    }
+
+    /* backs callJavaAsync(...) in JS, which resolves to the result or rejects with the exception
+       the future completes with. Override to overlap Java operations, this runs them synchronously */
+    public CompletableFuture<Object[]> callJavaAsync(Object[] argv) {
+        return CompletableFuture.completedFuture(callJava(argv));
+    }
+
+    /* called natively to convert a Map to a JS object, keys and values alternate */
+    private static Object[] mapEntries(Map<?, ?> m) {
+        Object[] ret = new Object[m.size() * 2];
+        int i = 0;
+        for (Map.Entry<?, ?> e: m.entrySet()) {
+            if (i == ret.length)
+                break; // modified concurrently
+            ret[i++] = e.getKey();
+            ret[i++] = e.getValue();
+        }
+        return ret;
+    }
+
+    /* called natively to copy a byte[] or heap ByteBuffer into an ArrayBuffer */
+    private static byte[] remainingBytes(ByteBuffer b) {
+        byte[] ret = new byte[b.remaining()];
+        b.duplicate().get(ret);
+        return ret;
+    }
+
+    /* called natively by callJavaAsync(), a result passed back after the call gave up on it is dropped */
+    private static void startJavaAsync(QuickJSConnector c, Object[] argv, final long ctx, final int id) {
+        CompletableFuture<Object[]> f;
+        try {
+            f = c.callJavaAsync(argv);
+            if (f == null)
+                throw new NullPointerException("callJavaAsync returned null");
+        } catch(Throwable e) {
+            nativeCompleteJava(ctx, id, null, e);
+            return;
+        }
+        f.whenComplete(new BiConsumer<Object[], Throwable>() {
+            public void accept(Object[] result, Throwable error) {
+                if (error instanceof CompletionException && error.getCause() != null)
+                    error = error.getCause();
+                nativeCompleteJava(ctx, id, result, error);
+            }
+        });
+    }
+
+    // QJS runtime must not be used by more than one thread at a time (enforced natively)
     // Also, worker threads in tomcat are shared by all apps
     static ThreadLocal<HashMap<String, QJSRuntime>> perThread = new ThreadLocal<>();
+
+    // compile the changed modules of reloaded scripts and build the runtimes replacing theirs, see QJSRuntime.refresh
+    private static final Executor reloader = Executors.newFixedThreadPool(
+            Math.max(1, Runtime.getRuntime().availableProcessors() / 2), new ThreadFactory() {
+        final AtomicLong count = new AtomicLong();
+
+        public Thread newThread(Runnable r) {
+            Thread t = new Thread(r, "quickjs-reloader-" + count.incrementAndGet());
+            t.setDaemon(true);
+            return t;
+        }
+    });
+
+    /* bytecode cache warmup of a script version, run once whatever the number of its runtimes */
+    private static final class Warmup {
+        final long timestamp;
+        final CompletableFuture<Void> done;
+
+        Warmup(final String filename, long timestamp) {
+            this.timestamp = timestamp;
+            this.done = CompletableFuture.runAsync(new Runnable() {
+                public void run() {
+                    nativeWarmModules(filename); // errors are reported when runtimes are created
+                }
+            }, reloader);
+        }
+    }
+    // latest warmup per ctxKey
+    private static final ConcurrentHashMap<String, Warmup> warmups = new ConcurrentHashMap<>();
+
     private static final class QJSRuntime {
-        byte[] ctx;
+        private static final Object BUILDING = new Object(), RELEASED = new Object();
+        private static final AtomicReferenceFieldUpdater<QJSRuntime, Object> NEXT =
+                AtomicReferenceFieldUpdater.newUpdater(QJSRuntime.class, Object.class, "next");
+
+        volatile long ctx;
         long timestamp;
         String ctxKey;
+        final WeakReference<QJSRuntime> ref = new WeakReference<QJSRuntime>(this); // its allInstances entry
+        // replacement of a reloaded runtime: null, BUILDING, the new QJSRuntime, or RELEASED with this one
+        private volatile Object next;
+        private volatile long failedTimestamp; // last version whose replacement failed to load
 
         @SuppressWarnings("unchecked")
-        private QJSRuntime(byte[] ctx, String ctxKey, long timestamp) {
+        private QJSRuntime(long ctx, String ctxKey, long timestamp) {
             this.ctx = ctx;
             this.ctxKey = ctxKey;
             this.timestamp = timestamp;
@@ -67,80 +366,237 @@ public class QuickJSConnector {
                 perThread.set(rtMap);
             }
             QJSRuntime rt = rtMap.get(c.ctxKey);
-            if (rt != null && (rt.timestamp < c.timestamp)) {
+            if (rt != null && rt.ctx != 0) {
+                QJSRuntime current = refresh(rt, c);
+                if (current != rt)
+                    rtMap.put(c.ctxKey, rt = current);
+            }
+            if (rt == null || rt.ctx == 0) {
+                rt = create(c, false);
+                rtMap.put(c.ctxKey, rt);
+            }
+            return rt;
+        }
+
+        /* rt if it is up to date, otherwise its replacement once that is built in the background, so
+           no call waits for a reloaded script to load. The changed modules are compiled into the
+           bytecode cache once per script version, then each replacement is created on a reloader
+           thread and installed in rt.next. Replacements are shared runtimes, whose stack limit is
+           anchored to the calling thread on each call. rt is only released once its replacement
+           loaded, and kept if the new version fails to, until the script changes again */
+        static QJSRuntime refresh(final QJSRuntime rt, final QuickJSConnector c) {
+            if (rt.timestamp >= c.timestamp)
+                return rt;
+            Object next = rt.next;
+            if (next instanceof QJSRuntime && NEXT.compareAndSet(rt, next, null)) {
+                QJSRuntime replacement = (QJSRuntime)next;
+                if (replacement.ctx == 0)
+                    return rt; // released meanwhile, build another one
                 rt.release(c.allInstances);
-                rt = null;
-            }
-            if (rt == null || rt.ctx == null || rt.ctx.length == 0) synchronized(QuickJSConnector.class) {
-                rt = new QJSRuntime(nativeNewQJSRuntime(c.filename, c.mainFunc), c.ctxKey, c.timestamp);
-                c.allInstances.add(new WeakReference(rt));
-                if (rt.ctx == null || rt.ctx.length == 0) {
-                    rt.ctx = null;
-                    throw new RuntimeException("Failed to create quickjs runtime!");
+                return replacement;
+            }
+            final long timestamp = c.timestamp;
+            if (next != null || rt.failedTimestamp >= timestamp || !NEXT.compareAndSet(rt, null, BUILDING))
+                return rt;
+            warmup(c).whenCompleteAsync(new BiConsumer<Void, Throwable>() {
+                public void accept(Void v, Throwable warmupError) {
+                    QJSRuntime replacement = null;
+                    try {
+                        replacement = create(c, true);
+                    } catch(RuntimeException e) {
+                        System.out.println("reload: keeping the previous version of " + c.ctxKey + ", " +
+                                e.getMessage());
+                        rt.failedTimestamp = timestamp;
+                    }
+                    if (!NEXT.compareAndSet(rt, BUILDING, replacement) && replacement != null)
+                        replacement.release(c.allInstances); // rt was released meanwhile
                 }
-                rtMap.put(c.ctxKey, rt);
-                String compileError = c.getErrorStackTrace(rt);
-                if (compileError != null) {
-                    rt.release(c.allInstances);
-                    throw new RuntimeException("Error while loading " + c.filename + "\n" + compileError);
+            }, reloader);
+            return rt;
+        }
+
+        static CompletableFuture<Void> warmup(final QuickJSConnector c) {
+            final long timestamp = c.timestamp;
+            Warmup w = warmups.get(c.ctxKey);
+            if (w != null && w.timestamp >= timestamp)
+                return w.done;
+            return warmups.compute(c.ctxKey, new BiFunction<String, Warmup, Warmup>() {
+                public Warmup apply(String key, Warmup w) {
+                    return w != null && w.timestamp >= timestamp? w : new Warmup(c.filename, timestamp);
                 }
+            }).done;
+        }
+
+        /* shared runtimes may be run by different threads over their lifetime (pool mode).
+           Takes no lock, runtimes of the same or different scripts are created in parallel */
+        static QJSRuntime create(QuickJSConnector c, boolean shared) {
+            Limits l = limitsMap.get(c.ctxKey);
+            HostTable h = hostMap.get(c.ctxKey);
+            Class<?> hostClass = h != null? h.cls : null;
+            Object[] hostFunctions = h != null? h.entries : null;
+            long ctx = l == null? nativeNewQJSRuntime(c.filename, c.mainFunc, shared, 0, 0, 0, Limits.MALLOC,
+                            hostClass, hostFunctions)
+                    : nativeNewQJSRuntime(c.filename, c.mainFunc, shared, l.memoryLimit, l.gcThreshold,
+                            l.maxStackSize, l.allocator, hostClass, hostFunctions);
+            QJSRuntime rt = new QJSRuntime(ctx, c.ctxKey, c.timestamp);
+            if (rt.ctx == 0)
+                throw new RuntimeException("Failed to create quickjs runtime!");
+            c.allInstances.add(rt.ref);
+            String compileError = c.getErrorStackTrace(rt);
+            if (compileError != null) {
+                rt.release(c.allInstances);
+                throw new RuntimeException("Error while loading " + c.filename + "\n" + compileError);
             }
             return rt;
         }
 
-        void release(ArrayList<WeakReference<QJSRuntime>> allInstances) {
-            if (ctx != null && ctx.length > 0) synchronized(QuickJSConnector.class) {
+        /* Whichever of release, releaseAll and finalize gets here first frees the native runtime. Freeing
+           a handle twice or while another thread is calling it is safe, see free_handle in quickjs-jni.c */
+        private void free() {
+            long handle = ctx;
+            if (handle != 0) {
+                ctx = 0;
+                nativeFreeQJSRuntime(handle);
+            }
+            Object replacement = NEXT.getAndSet(this, RELEASED);
+            if (replacement instanceof QJSRuntime)
+                ((QJSRuntime)replacement).discard();
+        }
+
+        /* release a replacement that won't be used, from any thread */
+        private void discard() {
+            Set<WeakReference<QJSRuntime>> allInstances = allInstancesMap.get(ctxKey);
+            if (allInstances != null)
+                allInstances.remove(ref);
+            free();
+        }
+
+        void release(Set<WeakReference<QJSRuntime>> allInstances) {
+            if (ctx != 0) {
                 HashMap<String, QJSRuntime> rtMap = perThread.get();
-                if (rtMap != null)
+                if (rtMap != null && rtMap.get(ctxKey) == this)
                     rtMap.remove(ctxKey);
-                nativeFreeQJSRuntime(ctx);
-                ctx = null;
-                QJSRuntime rt = this;
-                allInstances.removeIf(new Predicate<WeakReference<QJSRuntime>>() {
-                    @Override public boolean test(WeakReference<QJSRuntime> wr) {
-                        return wr.get() == rt;
-                    }
-                });
+                allInstances.remove(ref);
+                free();
             }
         }
 
-        static void releaseAll(ArrayList<WeakReference<QJSRuntime>> allInstances) {
-            synchronized(QuickJSConnector.class) {
-                for (WeakReference<QJSRuntime> wr: allInstances) {
-                    QJSRuntime rt = wr.get();
-                    if (rt != null && rt.ctx != null && rt.ctx.length > 0) {
-                        nativeFreeQJSRuntime(rt.ctx);
-                        rt.ctx = null;
-                    }
-                    else
-                        System.out.println("releaseAll: null ctx still in the allInstances array");
-                }
-                allInstances.clear();
+        /* runtimes still being created while this runs are not released */
+        static void releaseAll(Set<WeakReference<QJSRuntime>> allInstances) {
+            for (WeakReference<QJSRuntime> wr: allInstances) {
+                if (!allInstances.remove(wr))
+                    continue; // released by another thread meanwhile
+                QJSRuntime rt = wr.get();
+                if (rt != null && rt.ctx != 0)
+                    rt.free();
+                else
+                    System.out.println("releaseAll: null ctx still in the allInstances set");
             }
+            long reclaimed = nativeTrimMemory();
+            if (reclaimed > 0)
+                System.out.println("releaseAll: reclaimed " + reclaimed + " bytes");
         }
 
         @Override protected void finalize() { // normally these should be released by release/releaseAll
-            synchronized(QuickJSConnector.class) {
-                if (ctx != null && ctx.length > 0) {
-                    nativeFreeQJSRuntime(ctx);
-                    ctx = null;
-                    QJSRuntime rt = this;
-                    ArrayList<WeakReference<QJSRuntime>> allInstances = allInstancesMap.get(ctxKey);
-                    if (allInstances != null) {
-                        allInstances.removeIf(new Predicate<WeakReference<QJSRuntime>>() {
-                            @Override public boolean test(WeakReference<QJSRuntime> wr) {
-                                return wr.get() == rt;
-                            }
-                        });
-                    }
+            if (ctx != 0) {
+                Set<WeakReference<QJSRuntime>> allInstances = allInstancesMap.get(ctxKey);
+                if (allInstances != null)
+                    allInstances.remove(ref);
+                free();
+            }
+        }
+    }
+
+    /* Bounded set of runtimes shared by all threads. Checkout/checkin take no locks unless the pool
+       is exhausted, in which case the caller waits for a runtime to be returned */
+    private static final class RuntimePool {
+        final int size;
+        final Semaphore permits;
+        final ConcurrentLinkedDeque<QJSRuntime> idle = new ConcurrentLinkedDeque<>();
+        final AtomicLong checkouts = new AtomicLong();
+        final AtomicLong waits = new AtomicLong();
+        final AtomicLong waitNanos = new AtomicLong();
+        final AtomicLong maxWaitNanos = new AtomicLong();
+        final AtomicLong created = new AtomicLong();
+
+        RuntimePool(int size) {
+            this.size = size;
+            this.permits = new Semaphore(size);
+        }
+
+        QJSRuntime checkout(QuickJSConnector c) throws InterruptedException {
+            if (!permits.tryAcquire()) {
+                long start = System.nanoTime();
+                permits.acquire();
+                long waited = System.nanoTime() - start;
+                waits.incrementAndGet();
+                waitNanos.addAndGet(waited);
+                long max;
+                while (waited > (max = maxWaitNanos.get()) && !maxWaitNanos.compareAndSet(max, waited));
+            }
+            checkouts.incrementAndGet();
+            try {
+                QJSRuntime rt;
+                // most recently returned first, its memory is more likely to be cache-hot
+                while ((rt = idle.pollFirst()) != null) {
+                    if (rt.ctx != 0)
+                        return QJSRuntime.refresh(rt, c);
                 }
+                rt = QJSRuntime.create(c, true);
+                created.incrementAndGet();
+                return rt;
+            } catch(RuntimeException e) {
+                permits.release();
+                throw e;
             }
         }
+
+        void checkin(QJSRuntime rt) {
+            if (rt.ctx != 0)
+                idle.offerFirst(rt);
+            permits.release();
+        }
+    }
+
+    public static final class PoolStats {
+        public final int size;
+        public final int inUse;
+        public final int idle;
+        public final long created;
+        public final long checkouts;
+        public final long waits; // checkouts that found the pool exhausted
+        public final long waitNanos;
+        public final long maxWaitNanos;
+
+        private PoolStats(RuntimePool pool) {
+            size = pool.size;
+            inUse = pool.size - pool.permits.availablePermits();
+            idle = pool.idle.size();
+            created = pool.created.get();
+            checkouts = pool.checkouts.get();
+            waits = pool.waits.get();
+            waitNanos = pool.waitNanos.get();
+            maxWaitNanos = pool.maxWaitNanos.get();
+        }
+
+        @Override public String toString() {
+            return String.format("runtime pool: %d/%d in use, %d idle, %d created, %d checkouts, %d waits, " +
+                    "%.3f ms avg wait, %.3f ms max wait", inUse, size, idle, created, checkouts, waits,
+                    waits == 0? 0.0 : waitNanos / 1e6 / waits, maxWaitNanos / 1e6);
+        }
+    }
+
+    /* null if this connector is not in pool mode */
+    public PoolStats getPoolStats() {
+        return pool == null? null : new PoolStats(pool);
     }
 
     public String getErrorStackTrace(QJSRuntime rt) {
+        return formatStackTrace(nativeGetQJSException(rt.ctx));
+    }
+
+    private static String formatStackTrace(Object[] st) {
         String error = null;
-        Object[] st = nativeGetQJSException(rt.ctx);
         if (st != null && st.length > 0) {
             StringBuilder sb = new StringBuilder();
             for (int i = 0; i < st.length; i++) {
@@ -152,48 +608,1109 @@ public class QuickJSConnector {
         return error;
     }
 
-    /* return null if OK, or error stack trace otherwise */
+    /* default time budget of calls on this connector, 0 for no limit. A call that runs out of time
+       is interrupted and throws java.util.concurrent.TimeoutException, its runtime is kept */
+    public void setCallTimeout(int millis) {
+        timeoutMillis = millis;
+    }
+
+    /* return main function's result if it is an int, 0 otherwise */
     public int callQJS(Object[] argv) throws Exception {
+        return intResult(call(argv, null, null, null, false, timeoutMillis));
+    }
+
+    /* same as callQJS(Object[]) with arguments already encoded, avoids per argument JNI calls */
+    public int callQJS(ArgBuffer args) throws Exception {
+        return intResult(call(null, args, null, null, false, timeoutMillis));
+    }
+
+    /* same as above, with a time budget for this call */
+    public int callQJS(Object[] argv, int timeoutMillis) throws Exception {
+        return intResult(call(argv, null, null, null, false, timeoutMillis));
+    }
+
+    public int callQJS(ArgBuffer args, int timeoutMillis) throws Exception {
+        return intResult(call(null, args, null, null, false, timeoutMillis));
+    }
+
+    /* return main function's result: Integer, Double, String, Object[] for arrays, Map for other
+       objects (see callJava), ByteBuffer for ArrayBuffer/typed arrays, or null. ByteBuffers refer to
+       runtime memory valid until the next call on this thread (copies in pool and async mode).
+       Direct ByteBuffer arguments are shared with JS as ArrayBuffers, not copied */
+    public Object callQJSValue(Object[] argv) throws Exception {
+        return call(argv, null, null, null, false, timeoutMillis);
+    }
+
+    public Object callQJSValue(ArgBuffer args) throws Exception {
+        return call(null, args, null, null, false, timeoutMillis);
+    }
+
+    /* same as callQJSValue, with the global response object writing to the given stream. Output of
+       response.write() is buffered natively and passed on in chunks of up to 64K, and whatever is
+       left is written before the call returns. response.flush() also flushes the stream */
+    public Object callQJSValue(Object[] argv, OutputStream response) throws Exception {
+        return call(argv, null, null, response, false, timeoutMillis);
+    }
+
+    public Object callQJSValue(ArgBuffer args, OutputStream response) throws Exception {
+        return call(null, args, null, response, false, timeoutMillis);
+    }
+
+    /* same as above, chunks are written to the channel straight from native memory */
+    public Object callQJSValue(Object[] argv, WritableByteChannel response) throws Exception {
+        return call(argv, null, null, response, false, timeoutMillis);
+    }
+
+    public Object callQJSValue(ArgBuffer args, WritableByteChannel response) throws Exception {
+        return call(null, args, null, response, false, timeoutMillis);
+    }
+
+    /* return main function's result as bytes (UTF-8 unless it is an ArrayBuffer/typed array, objects
+       as JSON). out must be a direct buffer, it is returned with its limit set if the result fits. Otherwise
+       the returned buffer refers to memory owned by the runtime and is only valid until the next
+       call on this thread (a copy in pool mode). Arrays and null are returned as by callQJSValue */
+    public Object callQJSInto(Object[] argv, ByteBuffer out) throws Exception {
+        return call(argv, null, checkOut(out), null, false, timeoutMillis);
+    }
+
+    public Object callQJSInto(ArgBuffer args, ByteBuffer out) throws Exception {
+        return call(null, args, checkOut(out), null, false, timeoutMillis);
+    }
+
+    /* run main function on executor and await the promise it returns, if any. Meanwhile, the runtime
+       runs promise jobs, setTimeout() timers and callJavaAsync() completions on the executor thread.
+       The future completes with the settled value, converted as by callQJSValue. callJavaAsync()
+       operations still running then are waited for until the time budget runs out, or for a second
+       without one, and abandoned after that */
+    public CompletableFuture<Object> callQJSAsync(final Object[] argv, Executor executor) {
+        final CompletableFuture<Object> ret = new CompletableFuture<>();
+        executor.execute(new Runnable() {
+            public void run() {
+                try {
+                    ret.complete(call(argv, null, null, null, true, timeoutMillis));
+                } catch(Throwable e) {
+                    ret.completeExceptionally(e);
+                }
+            }
+        });
+        return ret;
+    }
+
+    /* run main function once per argument list in a single native call, saving the per call
+       overhead of jobs making many small calls. Element i of the returned array is what
+       callQJSValue(argvs[i]) would return, or the Exception it would throw (TimeoutException if
+       it ran out of time). Failed items don't stop the batch, and unlike callQJS the runtime is
+       kept after a JS exception. ByteBuffer results stay valid until the next call on this thread */
+    public Object[] callQJSBatch(Object[][] argvs) throws Exception {
+        return callBatch(argvs, null);
+    }
+
+    /* same as above with the argument lists encoded one after the other, see ArgBuffer.next */
+    public Object[] callQJSBatch(ArgBuffer args) throws Exception {
+        return callBatch(null, args);
+    }
+
+    private Object[] callBatch(Object[][] argvs, ArgBuffer args) throws Exception {
+        int n = argvs != null? argvs.length : args.count;
+        int timeout = timeoutMillis;
+        Object[] results = new Object[n];
+        Object[] errors = new Object[n];
         String error = null;
-        int ret = 0;
+        QJSRuntime rt = null;
         try {
-            QJSRuntime rt = QJSRuntime.getInstance(this);
-            ret = nativeCallQJS(rt.ctx, argv);
-            if (ret < 0) {
+            rt = pool != null? pool.checkout(this) : QJSRuntime.getInstance(this);
+            int failed = argvs != null? nativeCallQJSBatch(rt.ctx, argvs, results, errors, timeout)
+                    : nativeCallQJSArgsBatch(rt.ctx, args.buf, args.buf.position(), n, results, errors, timeout);
+            for (int i = 0; i < n && failed > 0; i++) {
+                if (errors[i] == null)
+                    continue;
+                String st = errors[i] instanceof Object[]? formatStackTrace((Object[])errors[i]) : null;
+                results[i] = errors[i] == JS_TIMEOUT?
+                        new TimeoutException(ctxKey + " timed out after " + timeout + " ms")
+                        : new Exception(st != null? st : ctxKey + " failed");
+                failed--;
+            }
+            if (pool != null) {
+                for (int i = 0; i < n; i++)
+                    results[i] = detach(results[i], null);
+            }
+        } catch(Exception e) {
+            if (e instanceof InterruptedException)
+                Thread.currentThread().interrupt();
+            error = e.getMessage() != null? e.getMessage() : e.toString();
+        } finally {
+            if (pool != null && rt != null)
+                pool.checkin(rt);
+        }
+        if (error != null)
+            throw new Exception(error);
+        return results;
+    }
+
+    private static ByteBuffer checkOut(ByteBuffer out) {
+        if (!out.isDirect())
+            throw new IllegalArgumentException("output buffer must be direct");
+        out.clear();
+        return out;
+    }
+
+    private static int intResult(Object ret) {
+        return ret instanceof Integer? (Integer)ret : 0;
+    }
+
+    private Object call(Object[] argv, ArgBuffer args, ByteBuffer out, Object sink, boolean async,
+            int timeout) throws Exception {
+        String error = null;
+        boolean timedOut = false;
+        Object ret = null;
+        QJSRuntime rt = null;
+        try {
+            rt = pool != null? pool.checkout(this) : QJSRuntime.getInstance(this);
+            ret = args != null? nativeCallQJSArgs(rt.ctx, args.buf, args.buf.position(), out, sink, async, timeout)
+                    : nativeCallQJS(rt.ctx, argv, out, sink, async, timeout);
+            if (ret == JS_TIMEOUT) {
+                ret = null;
+                timedOut = true;
+                error = ctxKey + " timed out after " + timeout + " ms";
+            }
+            else if (ret == JS_EXCEPTION) {
+                ret = null;
                 error = getErrorStackTrace(rt);
                 rt.release(allInstances);
             }
+            else if (pool != null || async) {
+                // the runtime goes to other threads after checkin, or the result does, so don't expose its memory
+                ret = detach(ret, out);
+            }
         } catch(Exception e) {
-            error = e.getMessage();
+            if (e instanceof InterruptedException)
+                Thread.currentThread().interrupt();
+            error = e.getMessage() != null? e.getMessage() : e.toString();
+        } finally {
+            if (pool != null && rt != null)
+                pool.checkin(rt);
         }
         if (error != null)
-            throw new Exception(error);
+            throw timedOut? new TimeoutException(error) : new Exception(error);
         return ret;
     }
 
+    /* copy the ByteBuffers in a result that refer to runtime memory */
+    @SuppressWarnings("unchecked")
+    private static Object detach(Object o, ByteBuffer out) {
+        if (o instanceof ByteBuffer) {
+            ByteBuffer view = (ByteBuffer)o;
+            if (view == out || !view.isDirect())
+                return o;
+            ByteBuffer copy = ByteBuffer.allocate(view.remaining());
+            copy.put(view);
+            copy.flip();
+            return copy;
+        }
+        else if (o instanceof Object[]) {
+            Object[] a = (Object[])o;
+            for (int i = 0; i < a.length; i++)
+                a[i] = detach(a[i], null);
+        }
+        else if (o instanceof Map) {
+            for (Map.Entry<Object, Object> e: ((Map<Object, Object>)o).entrySet())
+                e.setValue(detach(e.getValue(), null));
+        }
+        else if (o instanceof Set) {
+            Set<Object> set = new LinkedHashSet<>();
+            for (Object e: (Set<Object>)o)
+                set.add(detach(e, null));
+            return set;
+        }
+        return o;
+    }
+
+    private static ThreadLocal<byte[]> responseChunk = new ThreadLocal<>();
+
+    /* called natively by response.write()/flush(), chunk refers to native memory valid only during the call */
+    private static void writeResponse(Object sink, ByteBuffer chunk, boolean flush) throws IOException {
+        if (sink instanceof WritableByteChannel) {
+            WritableByteChannel ch = (WritableByteChannel)sink;
+            while (chunk.hasRemaining())
+                ch.write(chunk);
+            return;
+        }
+        OutputStream os = (OutputStream)sink;
+        byte[] b = responseChunk.get();
+        if (b == null)
+            responseChunk.set(b = new byte[64 * 1024]);
+        while (chunk.hasRemaining()) {
+            int n = Math.min(chunk.remaining(), b.length);
+            chunk.get(b, 0, n);
+            os.write(b, 0, n);
+        }
+        if (flush)
+            os.flush();
+    }
+
+    /*
+     * Main function arguments in a compact tagged binary form, decoded natively in one pass.
+     * Start each argument list with args(argc), then put exactly argc values; arrays are
+     * putArray(length) followed by length values. The buffer is reused and grows as needed.
+     * For callQJSBatch, start each further argument list with next(argc).
+     */
+    public static final class ArgBuffer {
+        // keep in sync with ARG_* in quickjs-jni.c
+        static final byte NULL = 0;
+        static final byte FALSE = 1;
+        static final byte TRUE = 2;
+        static final byte INT = 3;
+        static final byte DOUBLE = 4;
+        static final byte STRING = 5;
+        static final byte ARRAY = 6;
+        static final byte BYTES = 7;
+
+        ByteBuffer buf;
+        int count; // argument lists in buf
+        private static final ThreadLocal<ArgBuffer> threadBuffer = new ThreadLocal<>();
+
+        public ArgBuffer(int capacity) {
+            buf = ByteBuffer.allocateDirect(Math.max(capacity, 64)).order(ByteOrder.nativeOrder());
+        }
+
+        /* reusable buffer of the current thread */
+        public static ArgBuffer get() {
+            ArgBuffer ab = threadBuffer.get();
+            if (ab == null) {
+                ab = new ArgBuffer(4096);
+                threadBuffer.set(ab);
+            }
+            return ab;
+        }
+
+        private void ensure(int n) {
+            if (buf.remaining() < n) {
+                ByteBuffer nb = ByteBuffer.allocateDirect(Math.max(buf.capacity() * 2, buf.position() + n))
+                    .order(ByteOrder.nativeOrder());
+                buf.flip();
+                nb.put(buf);
+                buf = nb;
+            }
+        }
+
+        public ArgBuffer args(int argc) {
+            buf.clear();
+            buf.putInt(argc);
+            count = 1;
+            return this;
+        }
+
+        /* start another argument list after the current one, for callQJSBatch */
+        public ArgBuffer next(int argc) {
+            ensure(4);
+            buf.putInt(argc);
+            count++;
+            return this;
+        }
+
+        public ArgBuffer putNull() {
+            ensure(1);
+            buf.put(NULL);
+            return this;
+        }
+
+        public ArgBuffer put(boolean v) {
+            ensure(1);
+            buf.put(v? TRUE : FALSE);
+            return this;
+        }
+
+        public ArgBuffer put(int v) {
+            ensure(5);
+            buf.put(INT).putInt(v);
+            return this;
+        }
+
+        public ArgBuffer put(double v) {
+            ensure(9);
+            buf.put(DOUBLE).putDouble(v);
+            return this;
+        }
+
+        /* UTF-8 encoded in place, without an intermediate byte[] */
+        public ArgBuffer put(String v) {
+            if (v == null)
+                return putNull();
+            int len = v.length();
+            ensure(5 + len * 3);
+            buf.put(STRING);
+            int lenPos = buf.position();
+            buf.position(lenPos + 4);
+            for (int i = 0; i < len; i++) {
+                char c = v.charAt(i);
+                if (c < 0x80)
+                    buf.put((byte)c);
+                else if (c < 0x800) {
+                    buf.put((byte)(0xc0 | (c >> 6)));
+                    buf.put((byte)(0x80 | (c & 0x3f)));
+                }
+                else if (Character.isHighSurrogate(c) && i + 1 < len && Character.isLowSurrogate(v.charAt(i + 1))) {
+                    int cp = Character.toCodePoint(c, v.charAt(++i));
+                    buf.put((byte)(0xf0 | (cp >> 18)));
+                    buf.put((byte)(0x80 | ((cp >> 12) & 0x3f)));
+                    buf.put((byte)(0x80 | ((cp >> 6) & 0x3f)));
+                    buf.put((byte)(0x80 | (cp & 0x3f)));
+                }
+                else {
+                    buf.put((byte)(0xe0 | (c >> 12)));
+                    buf.put((byte)(0x80 | ((c >> 6) & 0x3f)));
+                    buf.put((byte)(0x80 | (c & 0x3f)));
+                }
+            }
+            buf.putInt(lenPos, buf.position() - lenPos - 4);
+            return this;
+        }
+
+        /* passed to JS as an ArrayBuffer */
+        public ArgBuffer put(byte[] v) {
+            if (v == null)
+                return putNull();
+            ensure(5 + v.length);
+            buf.put(BYTES).putInt(v.length).put(v);
+            return this;
+        }
+
+        /* remaining bytes of v, copied. Pass direct buffers to callQJS(Object[]) to share them instead */
+        public ArgBuffer put(ByteBuffer v) {
+            if (v == null)
+                return putNull();
+            ensure(5 + v.remaining());
+            buf.put(BYTES).putInt(v.remaining()).put(v.duplicate());
+            return this;
+        }
+
+        public ArgBuffer putArray(int length) {
+            ensure(5);
+            buf.put(ARRAY).putInt(length);
+            return this;
+        }
+
+        /* same conversions as callQJS(Object[]) */
+        public ArgBuffer put(Object v) {
+            if (v == null)
+                putNull();
+            else if (v instanceof String)
+                put((String)v);
+            else if (v instanceof Integer || v instanceof Short || v instanceof Byte)
+                put(((Number)v).intValue());
+            else if (v instanceof Number)
+                put(((Number)v).doubleValue());
+            else if (v instanceof Boolean)
+                put(((Boolean)v).booleanValue());
+            else if (v instanceof byte[])
+                put((byte[])v);
+            else if (v instanceof ByteBuffer)
+                put((ByteBuffer)v);
+            else if (v instanceof Object[]) {
+                Object[] a = (Object[])v;
+                putArray(a.length);
+                for (Object o: a)
+                    put(o);
+            }
+            else
+                put(v.toString());
+            return this;
+        }
+
+        public ArgBuffer putAll(Object[] argv) {
+            args(argv.length);
+            for (Object o: argv)
+                put(o);
+            return this;
+        }
+    }
+
+    /* Process-wide compiled module cache, shared by all runtimes/apps */
+    public static final class BytecodeCacheStats {
+        public final long hits;
+        public final long misses;
+        public final long entries;
+        public final long bytes;
+        public final long savedNanos; // compile time avoided by cache hits
+        public final long snapshotHits; // snapshot() values read from a stored image
+        public final long snapshotMisses; // snapshot() producers run
+
+        private BytecodeCacheStats(long[] st) {
+            hits = st[0];
+            misses = st[1];
+            entries = st[2];
+            bytes = st[3];
+            savedNanos = st[4];
+            snapshotHits = st[5];
+            snapshotMisses = st[6];
+        }
+
+        public double hitRate() {
+            return hits + misses == 0? 0 : (double)hits / (hits + misses);
+        }
+
+        @Override public String toString() {
+            return String.format("bytecode cache: %d hits, %d misses (%.1f%%), %d entries, %d bytes, %d ms saved, " +
+                    "snapshots: %d hits, %d misses", hits, misses, hitRate() * 100, entries, bytes,
+                    savedNanos / 1000000, snapshotHits, snapshotMisses);
+        }
+    }
+
+    public static BytecodeCacheStats getBytecodeCacheStats() {
+        return new BytecodeCacheStats(nativeGetBytecodeCacheStats());
+    }
+
+    /* latency histogram with power of two buckets: bucket 0 counts durations under 1us,
+       bucket i durations under 2^(i+10) ns */
+    public static final class Histogram {
+        static final int BUCKETS = 28;
+        public final long count;
+        public final long sumNanos;
+        public final long[] buckets;
+
+        private Histogram(long[] st, int offset) {
+            count = st[offset];
+            sumNanos = st[offset + 1];
+            buckets = Arrays.copyOfRange(st, offset + 2, offset + 2 + BUCKETS);
+        }
+
+        public static long bucketLimitNanos(int bucket) {
+            return 1L << (bucket + 10);
+        }
+
+        public double meanMicros() {
+            return count == 0? 0 : sumNanos / 1000.0 / count;
+        }
+
+        /* upper bound of the bucket holding the given percentile, in microseconds */
+        public double percentileMicros(double percentile) {
+            long rank = (long)Math.ceil(count * percentile / 100), seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen >= rank && seen > 0)
+                    return bucketLimitNanos(i) / 1000.0;
+            }
+            return 0;
+        }
+
+        @Override public String toString() {
+            return String.format("%d, mean %.1f us, p50 %.0f us, p99 %.0f us",
+                    count, meanMicros(), percentileMicros(50), percentileMicros(99));
+        }
+    }
+
+    /* metrics of all runtimes of a script, kept natively for the life of the process */
+    public static final class ScriptStats {
+        public final long calls;
+        public final long timeouts;
+        public final long exceptions;
+        public final Histogram callLatency; // whole native call
+        public final Histogram jsLatency; // main function, including awaiting its promise
+        public final Histogram argsLatency; // Java arguments to JS values
+        public final Histogram resultLatency; // JS result to Java object
+        public final Histogram callJavaLatency; // callJava() round-trips
+        public final Histogram runtimeCreation;
+        public final Histogram runtimeDestruction;
+
+        private ScriptStats(long[] st) {
+            calls = st[0];
+            timeouts = st[1];
+            exceptions = st[2];
+            int n = Histogram.BUCKETS + 2;
+            callLatency = new Histogram(st, 3);
+            jsLatency = new Histogram(st, 3 + n);
+            argsLatency = new Histogram(st, 3 + 2*n);
+            resultLatency = new Histogram(st, 3 + 3*n);
+            callJavaLatency = new Histogram(st, 3 + 4*n);
+            runtimeCreation = new Histogram(st, 3 + 5*n);
+            runtimeDestruction = new Histogram(st, 3 + 6*n);
+        }
+
+        @Override public String toString() {
+            return String.format("%d calls, %d exceptions, %d timeouts\n call: %s\n js: %s\n args: %s\n" +
+                    " result: %s\n callJava: %s\n runtime creation: %s\n runtime destruction: %s",
+                    calls, exceptions, timeouts, callLatency, jsLatency, argsLatency, resultLatency,
+                    callJavaLatency, runtimeCreation, runtimeDestruction);
+        }
+    }
+
+    /* null if no runtime was created for this filename/mainFunc yet */
+    public ScriptStats getScriptStats() {
+        return getScriptStats(ctxKey);
+    }
+
+    private static ScriptStats getScriptStats(String ctxKey) {
+        long[] st = nativeGetScriptStats(ctxKey);
+        return st == null? null : new ScriptStats(st);
+    }
+
+    /* JMX view of ScriptStats, latencies in microseconds */
+    public interface ScriptStatsMXBean {
+        long getCalls();
+        long getExceptions();
+        long getTimeouts();
+        long getCallJavaCount();
+        long getRuntimeCreations();
+        long getRuntimeDestructions();
+        double getCallMeanMicros();
+        double getCallP99Micros();
+        double getJsMeanMicros();
+        double getArgsMeanMicros();
+        double getResultMeanMicros();
+        double getCallJavaMeanMicros();
+        double getRuntimeCreationMeanMicros();
+    }
+
+    private static final class ScriptStatsBean implements ScriptStatsMXBean {
+        private final String ctxKey;
+
+        ScriptStatsBean(String ctxKey) {
+            this.ctxKey = ctxKey;
+        }
+
+        private ScriptStats stats() {
+            ScriptStats st = getScriptStats(ctxKey);
+            return st != null? st : new ScriptStats(new long[3 + 7 * (Histogram.BUCKETS + 2)]);
+        }
+
+        public long getCalls() { return stats().calls; }
+        public long getExceptions() { return stats().exceptions; }
+        public long getTimeouts() { return stats().timeouts; }
+        public long getCallJavaCount() { return stats().callJavaLatency.count; }
+        public long getRuntimeCreations() { return stats().runtimeCreation.count; }
+        public long getRuntimeDestructions() { return stats().runtimeDestruction.count; }
+        public double getCallMeanMicros() { return stats().callLatency.meanMicros(); }
+        public double getCallP99Micros() { return stats().callLatency.percentileMicros(99); }
+        public double getJsMeanMicros() { return stats().jsLatency.meanMicros(); }
+        public double getArgsMeanMicros() { return stats().argsLatency.meanMicros(); }
+        public double getResultMeanMicros() { return stats().resultLatency.meanMicros(); }
+        public double getCallJavaMeanMicros() { return stats().callJavaLatency.meanMicros(); }
+        public double getRuntimeCreationMeanMicros() { return stats().runtimeCreation.meanMicros(); }
+    }
+
+    /* register this script's metrics with the platform MBean server, if not registered yet */
+    public void registerMBean() throws Exception {
+        ObjectName name = new ObjectName("org.scriptable:type=QuickJS,script=" + ObjectName.quote(ctxKey));
+        MBeanServer server = ManagementFactory.getPlatformMBeanServer();
+        if (!server.isRegistered(name)) {
+            try {
+                server.registerMBean(new ScriptStatsBean(ctxKey), name);
+            } catch(InstanceAlreadyExistsException e) {
+                // registered by another connector meanwhile
+            }
+        }
+    }
+
+    /* JS_ComputeMemoryUsage figures summed over a set of runtimes. Runtimes running a call
+       at the time are skipped, runtimes is the number actually measured */
+    public static final class MemoryUsage {
+        public final long runtimes;
+        public final long mallocSize, mallocCount;
+        public final long memoryUsedSize, memoryUsedCount;
+        public final long atomCount, atomSize;
+        public final long strCount, strSize;
+        public final long objCount, objSize;
+        public final long propCount, propSize;
+        public final long shapeCount, shapeSize;
+        public final long jsFuncCount, jsFuncSize, jsFuncCodeSize;
+        public final long arrayCount;
+        public final long binaryObjectCount, binaryObjectSize;
+
+        private MemoryUsage(long[] u) {
+            int i = 0;
+            runtimes = u[i++];
+            mallocSize = u[i++];
+            mallocCount = u[i++];
+            memoryUsedSize = u[i++];
+            memoryUsedCount = u[i++];
+            atomCount = u[i++];
+            atomSize = u[i++];
+            strCount = u[i++];
+            strSize = u[i++];
+            objCount = u[i++];
+            objSize = u[i++];
+            propCount = u[i++];
+            propSize = u[i++];
+            shapeCount = u[i++];
+            shapeSize = u[i++];
+            jsFuncCount = u[i++];
+            jsFuncSize = u[i++];
+            jsFuncCodeSize = u[i++];
+            arrayCount = u[i++];
+            binaryObjectCount = u[i++];
+            binaryObjectSize = u[i++];
+        }
+
+        @Override public String toString() {
+            return String.format("%d runtimes: malloc %d bytes in %d blocks, %d objects, %d strings, %d atoms",
+                    runtimes, mallocSize, mallocCount, objCount, strCount, atomCount);
+        }
+    }
+
+    /* memory used by all runtimes of this filename/mainFunc */
+    public MemoryUsage getMemoryUsage() {
+        long[] ctx = new long[allInstances.size()];
+        int n = 0;
+        for (WeakReference<QJSRuntime> wr: allInstances) {
+            QJSRuntime rt = wr.get();
+            long handle = rt != null? rt.ctx : 0;
+            if (handle != 0) {
+                if (n == ctx.length) // runtimes were added since the size was read
+                    ctx = Arrays.copyOf(ctx, n * 2 + 1);
+                ctx[n++] = handle;
+            }
+        }
+        return new MemoryUsage(nativeGetMemoryUsage(Arrays.copyOf(ctx, n)));
+    }
+
+    /* memory used by the runtime of the current thread (not in pool mode), null if it has none */
+    public MemoryUsage getThreadMemoryUsage() {
+        HashMap<String, QJSRuntime> rtMap = perThread.get();
+        QJSRuntime rt = rtMap == null? null : rtMap.get(ctxKey);
+        return rt == null || rt.ctx == 0? null : new MemoryUsage(nativeGetMemoryUsage(new long[] { rt.ctx }));
+    }
+
+    /* totals of all runtimes created with Limits.ARENA. Small allocations (up to 256 bytes) come
+       from 64K slabs, which are only freed with their runtime; larger ones from malloc */
+    public static final class AllocatorStats {
+        public final long arenas;
+        public final long slabs;
+        public final long slabBytes;
+        public final long smallBytes; // in use, the rest of slabBytes is free or not carved yet
+        public final long largeBytes;
+        public final long smallAllocs; // since startup
+        public final long largeAllocs;
+        public final long mappedBytes; // by ISOLATED runtimes, unmapped when they are freed
+
+        private AllocatorStats(long[] st) {
+            arenas = st[0];
+            slabs = st[1];
+            slabBytes = st[2];
+            smallBytes = st[3];
+            largeBytes = st[4];
+            smallAllocs = st[5];
+            largeAllocs = st[6];
+            mappedBytes = st[7];
+        }
+
+        @Override public String toString() {
+            return String.format("arena allocator: %d arenas, %d slabs, %d/%d slab bytes used, %d large bytes, "
+                    + "%d small/%d large allocs, %d bytes mapped", arenas, slabs, smallBytes, slabBytes, largeBytes,
+                    smallAllocs, largeAllocs, mappedBytes);
+        }
+    }
+
+    public static AllocatorStats getAllocatorStats() {
+        return new AllocatorStats(nativeGetAllocatorStats());
+    }
+
+    /* return freed native memory to the OS, this is done after releaseAllRuntimes too.
+       Returns the resident set size reduction in bytes */
+    public static long trimNativeMemory() {
+        return nativeTrimMemory();
+    }
+
+    /* trim native memory whenever no script was called for idleMillis. Applies to the whole process,
+       calling it again changes the interval */
+    public static void startIdleTrim(int idleMillis) {
+        nativeStartIdleTrim(idleMillis);
+    }
+
+    public static final class TrimStats {
+        public final long trims;
+        public final long reclaimedBytes;
+
+        private TrimStats(long[] st) {
+            trims = st[0];
+            reclaimedBytes = st[1];
+        }
+
+        @Override public String toString() {
+            return String.format("%d trims, %d bytes reclaimed", trims, reclaimedBytes);
+        }
+    }
+
+    public static TrimStats getTrimStats() {
+        return new TrimStats(nativeGetTrimStats());
+    }
+
+    /* receives console.log/info/warn/error output in batches, on the native log thread */
+    public interface LogHandler {
+        int INFO = 0, WARN = 1, ERROR = 2;
+        void log(int level, long timeMillis, int threadId, String script, String message);
+    }
+
+    private static volatile LogHandler logHandler;
+
+    /* console output goes to stdout by default */
+    public static void logToStdout() {
+        nativeSetLogSink(0, null);
+        logHandler = null;
+    }
+
+    public static void logToFile(String path) throws IOException {
+        if (!nativeSetLogSink(1, path))
+            throw new IOException("cannot open " + path);
+        logHandler = null;
+    }
+
+    public static void setLogHandler(LogHandler handler) {
+        logHandler = handler;
+        nativeSetLogSink(handler != null? 2 : 0, null);
+    }
+
+    /* write out console output still buffered, it is otherwise written within about 10 ms */
+    public static void flushLog() {
+        nativeFlushLog();
+    }
+
+    /* called natively by the log thread */
+    private static void logBatch(int count, int[] levels, long[] times, int[] threads, String[] scripts,
+            String[] messages) {
+        LogHandler handler = logHandler;
+        for (int i = 0; i < count; i++) {
+            if (handler == null)
+                System.out.println(messages[i]);
+            else try {
+                handler.log(levels[i], times[i], threads[i], scripts[i], messages[i]);
+            } catch(Exception e) {
+                System.err.println("log handler: " + e);
+            }
+        }
+    }
+
+    public static final class LogStats {
+        public final long records; // written out
+        public final long dropped; // lost because a thread's buffer was full
+        public final long threads; // threads with a log buffer
+
+        private LogStats(long[] st) {
+            records = st[0];
+            dropped = st[1];
+            threads = st[2];
+        }
+
+        @Override public String toString() {
+            return String.format("log: %d records, %d dropped, %d threads", records, dropped, threads);
+        }
+    }
+
+    public static LogStats getLogStats() {
+        return new LogStats(nativeGetLogStats());
+    }
+
+    /* modules of this script changed on disk since its last runtime was created, null if
+       no runtime was created yet */
+    public String[] getChangedModules() {
+        return nativeGetChangedModules(filename);
+    }
+
+    /* move to a new timestamp if any module changed, runtimes are then replaced in the background */
+    public boolean reloadIfChanged() {
+        String[] changed = getChangedModules();
+        if (changed == null || changed.length == 0)
+            return false;
+        timestamp = Math.max(timestamp + 1, System.currentTimeMillis());
+        return true;
+    }
+
     public void releaseAllRuntimes() {
         releaseAllRuntimes(filename, mainFunc);
     }
 
     public static void releaseAllRuntimes(String filename, String mainFunc) {
-        synchronized(QuickJSConnector.class) {
-            ArrayList<WeakReference<QJSRuntime>> allInstances = allInstancesMap.get(makeCtxKey(filename, mainFunc));
-            if (allInstances != null)
-                QJSRuntime.releaseAll(allInstances);
+        Set<WeakReference<QJSRuntime>> allInstances = allInstancesMap.get(makeCtxKey(filename, mainFunc));
+        if (allInstances != null)
+            QJSRuntime.releaseAll(allInstances);
+    }
+
+    /* connector of the test*.js scripts run by main, with the Java side of the calls they make */
+    private static final class TestConnector extends QuickJSConnector {
+        TestConnector(String filename, int poolSize, Limits limits, HostFunction[] hostFunctions) {
+            super(filename, "handleRequest", 0, poolSize, limits, hostFunctions);
         }
+
+        public int add(int a, int b) {
+            return a + b;
+        }
+
+        public String greet(String name) {
+            return "hello " + name;
+        }
+
+        public void fail(String message) {
+            throw new IllegalStateException(message);
+        }
+
+        @Override public CompletableFuture<Object[]> callJavaAsync(final Object[] argv) {
+            if (argv[0].equals("never"))
+                return new CompletableFuture<>();
+            return CompletableFuture.supplyAsync(new Supplier<Object[]>() {
+                public Object[] get() {
+                    if (argv[0].equals("fail"))
+                        throw new IllegalStateException("boom");
+                    return new Object[] { argv[0] + " " + argv[1] + "!" };
+                }
+            });
+        }
+    }
+
+    private static void check(String test, boolean ok, Object result) {
+        if (!ok)
+            throw new IllegalStateException(test + " failed, got " +
+                    (result instanceof Object[]? Arrays.toString((Object[])result) : result));
+    }
+
+    /* failed items don't stop a batch, and the runtime stays after a JS exception unlike with callQJSValue */
+    private static void testBatch(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testBatch.js", poolSize, limits, null);
+        Object[] r = c.callQJSBatch(new Object[][] { { 1 }, { -1 }, { 2 } });
+        check("testBatch.js", r.length == 3 && Integer.valueOf(101).equals(r[0]) && r[1] instanceof Exception &&
+                ((Exception)r[1]).getMessage().contains("negative -1") && Integer.valueOf(202).equals(r[2]), r);
+        r = c.callQJSBatch(new Object[][] { { 3 } });
+        check("testBatch.js", Integer.valueOf(303).equals(r[0]), r);
+        try {
+            c.callQJSValue(new Object[] { -1 });
+            check("testBatch.js", false, "no exception");
+        } catch(Exception e) {
+            check("testBatch.js", e.getMessage().contains("negative -1"), e.getMessage());
+        }
+        Object v = c.callQJSValue(new Object[] { 4 });
+        check("testBatch.js", Integer.valueOf(104).equals(v), v);
+        c.releaseAllRuntimes();
+        System.out.println("testBatch.js: ok");
+    }
+
+    /* the first runtime produces the snapshot, the next one reads it back */
+    private static void testSnapshot(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testSnapshot.js", poolSize, limits, null);
+        BytecodeCacheStats before = getBytecodeCacheStats();
+        Object v = c.callQJSValue(new Object[] { 12 });
+        check("testSnapshot.js", "squares:144".equals(v), v);
+        c.releaseAllRuntimes();
+        v = c.callQJSValue(new Object[] { 999 });
+        check("testSnapshot.js", "squares:998001".equals(v), v);
+        BytecodeCacheStats after = getBytecodeCacheStats();
+        check("testSnapshot.js", after.snapshotMisses > before.snapshotMisses &&
+                after.snapshotHits > before.snapshotHits, after);
+        c.releaseAllRuntimes();
+        System.out.println("testSnapshot.js: ok");
+    }
+
+    /* host functions take and return primitives and strings, and their exceptions are thrown in JS */
+    private static void testHost(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testHost.js", poolSize, limits, new HostFunction[] {
+                new HostFunction("add", "add", int.class, int.class),
+                new HostFunction("greet", "greet", String.class),
+                new HostFunction("fail", "fail", String.class) });
+        Object v = c.callQJSValue(new Object[] { 2, 3, "Саша" });
+        Object[] r = v instanceof Object[]? (Object[])v : new Object[0];
+        check("testHost.js", r.length == 3 && r[0] instanceof Number && ((Number)r[0]).intValue() == 5 &&
+                "hello Саша".equals(r[1]) && String.valueOf(r[2]).contains("boom"), v);
+        c.releaseAllRuntimes();
+        System.out.println("testHost.js: ok");
+    }
+
+    /* the main function's promise settles after callJavaAsync() results, rejections and timers */
+    private static void testAsync(int poolSize, Limits limits) throws Exception {
+        ExecutorService executor = Executors.newSingleThreadExecutor();
+        try {
+            QuickJSConnector c = new TestConnector("./testAsync.js", poolSize, limits, null);
+            Object v = c.callQJSAsync(new Object[] { "Саша" }, executor).get(10, TimeUnit.SECONDS);
+            check("testAsync.js", v instanceof String && ((String)v).startsWith("async Саша! ") &&
+                    ((String)v).contains("boom"), v);
+            // an operation that never completes is abandoned once the promise settled, the runtime stays usable
+            v = c.callQJSAsync(new Object[] { "never" }, executor).get(10, TimeUnit.SECONDS);
+            check("testAsync.js", "abandoned".equals(v), v);
+            v = c.callQJSAsync(new Object[] { "Саша" }, executor).get(10, TimeUnit.SECONDS);
+            check("testAsync.js", v instanceof String && ((String)v).startsWith("async Саша! "), v);
+            c.releaseAllRuntimes();
+        } finally {
+            executor.shutdown();
+        }
+        System.out.println("testAsync.js: ok");
+    }
+
+    /* response.write() output larger than a chunk reaches the stream whole and in order */
+    private static void testResponse(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testResponse.js", poolSize, limits, null);
+        ByteArrayOutputStream out = new ByteArrayOutputStream();
+        Object v = c.callQJSValue(new Object[] { 10000 }, out);
+        StringBuilder expected = new StringBuilder();
+        for (int i = 0; i < 10000; i++)
+            expected.append("line ").append(i).append('\n');
+        expected.append("Саша\n");
+        check("testResponse.js", Integer.valueOf(10000).equals(v) &&
+                expected.toString().equals(out.toString("UTF-8")), v + ", " + out.size() + " bytes");
+        c.releaseAllRuntimes();
+        System.out.println("testResponse.js: ok");
+    }
+
+    /* a call running out of its budget throws TimeoutException and keeps its runtime, sync or async */
+    private static void testTimeout(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testTimeout.js", poolSize, limits, null);
+        Object v = c.callQJSValue(new Object[] { "count" });
+        check("testTimeout.js", Integer.valueOf(1).equals(v), v);
+        long timeouts = c.getScriptStats().timeouts;
+        try {
+            c.callQJS(new Object[] { "loop" }, 100);
+            check("testTimeout.js", false, "no timeout");
+        } catch(TimeoutException e) {
+        }
+        v = c.callQJSValue(new Object[] { "count" });
+        check("testTimeout.js", Integer.valueOf(2).equals(v), v); // a new runtime would start over
+        check("testTimeout.js", c.getScriptStats().timeouts == timeouts + 1, c.getScriptStats());
+
+        // awaiting a callJavaAsync() operation that never completes
+        ExecutorService executor = Executors.newSingleThreadExecutor();
+        try {
+            c.setCallTimeout(100);
+            try {
+                c.callQJSAsync(new Object[] { "never" }, executor).get(10, TimeUnit.SECONDS);
+                check("testTimeout.js", false, "no timeout");
+            } catch(ExecutionException e) {
+                check("testTimeout.js", e.getCause() instanceof TimeoutException, e.getCause());
+            }
+            c.setCallTimeout(0);
+            v = c.callQJSAsync(new Object[] { "count" }, executor).get(10, TimeUnit.SECONDS);
+            check("testTimeout.js", Integer.valueOf(3).equals(v), v);
+        } finally {
+            executor.shutdown();
+        }
+        check("testTimeout.js", c.getScriptStats().timeouts == timeouts + 2, c.getScriptStats());
+        c.releaseAllRuntimes();
+        System.out.println("testTimeout.js: ok");
+    }
+
+    /* strings with supplementary characters and lone surrogates, shorter and longer than
+       STRING_STACK_CHARS in quickjs-jni.c, make it to JS and back unchanged */
+    private static void testString(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testString.js", poolSize, limits, null);
+        StringBuilder sb = new StringBuilder();
+        while (sb.length() < 1000)
+            sb.append("a\uD83D\uDE00Саша\uD800x\uDC00"); // 😀 and lone high and low surrogates
+        for (int len: new int[] { 2, 9, 255, 256, 257, 1000 }) {
+            String s = sb.substring(0, len);
+            String expected = s + "|" + s.length() + "|" + s.codePointCount(0, s.length());
+            Object v = c.callQJSValue(new Object[] { s });
+            check("testString.js", expected.equals(v), v);
+            v = c.callQJSValue(ArgBuffer.get().args(1).put(s));
+            check("testString.js", expected.equals(v), v);
+        }
+        c.releaseAllRuntimes();
+        System.out.println("testString.js: ok");
+    }
+
+    /* objects and Maps come back as LinkedHashMaps, Sets as LinkedHashSets, Java Maps reach JS as objects
+       and Collections as arrays, and a cyclic object is cut off after 100 levels */
+    private static void testConvert(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testConvert.js", poolSize, limits, null);
+        Map<String, Object> obj = new LinkedHashMap<>();
+        obj.put("name", "Саша");
+        obj.put("n", 3);
+        obj.put("x", 2.5);
+        obj.put("nested", new LinkedHashMap<String, Object>(Collections.singletonMap("k", "v")));
+        Object v = c.callQJSValue(new Object[] { obj, Arrays.asList("a", 1),
+                new LinkedHashSet<Object>(Arrays.asList("b", 2)) });
+        check("testConvert.js", v instanceof LinkedHashMap, v);
+        Map<?, ?> r = (Map<?, ?>)v;
+
+        Object plain = r.get("plain");
+        check("testConvert.js", plain instanceof LinkedHashMap && ((Map<?, ?>)plain).get("a").equals(1) &&
+                ((Map<?, ?>)plain).get("b").equals("x"), plain);
+        Object nested = ((Map<?, ?>)plain).get("nested");
+        check("testConvert.js", nested instanceof Map && Arrays.equals((Object[])((Map<?, ?>)nested).get("c"),
+                new Object[] { 1, 2 }), nested);
+
+        Map<String, Object> map = new LinkedHashMap<>();
+        map.put("k", 1);
+        map.put("n", Collections.singletonMap("x", 2));
+        check("testConvert.js", r.get("map") instanceof LinkedHashMap && map.equals(r.get("map")), r.get("map"));
+        check("testConvert.js", r.get("set") instanceof LinkedHashSet &&
+                new LinkedHashSet<Object>(Arrays.asList("a", "b")).equals(r.get("set")), r.get("set"));
+
+        check("testConvert.js", obj.equals(r.get("echo")) && "name,n,x,nested".equals(r.get("keys")), r);
+        Object[] lists = (Object[])r.get("list");
+        check("testConvert.js", lists != null && Arrays.equals((Object[])lists[0], new Object[] { "a", 1 }) &&
+                Arrays.equals((Object[])lists[1], new Object[] { "b", 2 }), lists);
+
+        int levels = 0;
+        for (Object o = r.get("cyclic"); o instanceof Map; o = ((Map<?, ?>)o).get("self"))
+            levels++;
+        check("testConvert.js", levels >= 99 && levels <= 101, levels + " levels");
+        c.releaseAllRuntimes();
+        System.out.println("testConvert.js: ok");
+    }
+
+    /* a direct ByteBuffer argument is shared with JS, byte[] arguments are copied, and ArrayBuffer
+       results refer to runtime memory unless the runtime is pooled */
+    private static void testBuffer(int poolSize, Limits limits) throws Exception {
+        QuickJSConnector c = new TestConnector("./testBuffer.js", poolSize, limits, null);
+        ByteBuffer shared = ByteBuffer.allocateDirect(16);
+        for (int i = 0; i < 16; i++)
+            shared.put(i, (byte)i);
+        Object v = c.callQJSValue(new Object[] { "share", shared, new byte[] { 0, 1, -1, 127, -128 } });
+        check("testBuffer.js", "true:0,1,255,127,128".equals(v), v);
+        for (int i = 0; i < 16; i++)
+            check("testBuffer.js", shared.get(i) == i + 1, "byte " + i + " = " + shared.get(i));
+
+        byte[] expected = { 1, 2, 3, 4 };
+        QuickJSConnector perThread = new TestConnector("./testBuffer.js", 0, limits, null);
+        QuickJSConnector pooled = new TestConnector("./testBuffer.js", Math.max(poolSize, 1), limits, null);
+        for (QuickJSConnector pc: new QuickJSConnector[] { perThread, pooled }) {
+            v = pc.callQJSValue(new Object[] { "result" });
+            check("testBuffer.js", v instanceof ByteBuffer && ((ByteBuffer)v).isDirect() == (pc == perThread) &&
+                    ((ByteBuffer)v).remaining() == 4, v);
+            byte[] b = new byte[4];
+            ((ByteBuffer)v).duplicate().get(b);
+            check("testBuffer.js", Arrays.equals(b, expected), Arrays.toString(b));
+        }
+        c.releaseAllRuntimes();
+        System.out.println("testBuffer.js: ok");
+    }
+
+    /* run the test*.js scripts other than the benchmark, throw if any of them doesn't behave as documented */
+    private static void runTests(int poolSize, Limits limits) throws Exception {
+        testBatch(poolSize, limits);
+        testSnapshot(poolSize, limits);
+        testHost(poolSize, limits);
+        testAsync(poolSize, limits);
+        testResponse(poolSize, limits);
+        testTimeout(poolSize, limits);
+        testString(poolSize, limits);
+        testConvert(poolSize, limits);
+        testBuffer(poolSize, limits);
     }
 
-    public static void main(String[] args) {
-        QuickJSConnector c = new QuickJSConnector("./test.js", "handleRequest", 0);
+    public static void main(String[] args) throws Exception {
+        int poolSize = args.length > 0? Integer.parseInt(args[0]) : 0;
+        String allocator = args.length > 1? args[1] : "malloc";
+        boolean arena = allocator.equals("arena") || allocator.equals("isolated");
+        Limits limits = arena? new Limits(0, 0, 0, allocator.equals("arena")? Limits.ARENA : Limits.ISOLATED) : null;
+        runTests(poolSize, limits);
+        QuickJSConnector c = new QuickJSConnector("./test.js", "handleRequest", 0, poolSize, limits);
 
-        for (int i = 0; i < 1000000; i++) {
+        int n = 1000000;
+        long start = System.nanoTime();
+        for (int i = 0; i < n; i++) {
             try {
                 c.callQJS(new Object[] { "GET", "/test", "param1", "Саша" });
             } catch(Exception e) {
                 System.err.print(e.getMessage());
             }
         }
+        System.out.println(String.format("%d calls, %.0f ns/call", n, (double)(System.nanoTime() - start) / n));
+        if (c.getPoolStats() != null)
+            System.out.println(c.getPoolStats());
+        System.out.println(c.ctxKey + ": " + c.getScriptStats());
+        System.out.println(c.getMemoryUsage());
+        if (arena)
+            System.out.println(getAllocatorStats());
         c.releaseAllRuntimes();
+        System.out.println(getTrimStats());
+        System.out.println(getBytecodeCacheStats());
+        flushLog();
+        System.out.println(getLogStats());
     }
 }
 
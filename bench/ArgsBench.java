@@ -0,0 +1,73 @@
+package org.scriptable.bench;
+
+import java.nio.ByteBuffer;
+import java.util.LinkedHashMap;
+import java.util.Map;
+import java.util.concurrent.TimeUnit;
+import org.openjdk.jmh.annotations.*;
+import org.scriptable.QuickJSConnector;
+
+/* argument marshalling by arity and type, as Object[] and encoded in an ArgBuffer */
+@BenchmarkMode(Mode.AverageTime)
+@OutputTimeUnit(TimeUnit.NANOSECONDS)
+@Warmup(iterations = 3, time = 2)
+@Measurement(iterations = 5, time = 2)
+@Fork(1)
+@State(Scope.Thread)
+public class ArgsBench {
+    @Param({"1", "4", "16"})
+    public int arity;
+
+    @Param({"int", "double", "string", "array", "map", "bytes"})
+    public String type;
+
+    private QuickJSConnector c;
+    private Object[] argv;
+    private final QuickJSConnector.ArgBuffer args = new QuickJSConnector.ArgBuffer(4096);
+
+    @Setup(Level.Trial)
+    public void setup() throws Exception {
+        c = new QuickJSConnector(Scripts.module("args.js", "function() {}", 0), "main", 0);
+        argv = new Object[arity];
+        for (int i = 0; i < arity; i++)
+            argv[i] = value(i);
+    }
+
+    private Object value(int i) {
+        switch (type) {
+        case "int":
+            return i;
+        case "double":
+            return i + 0.5;
+        case "string":
+            return "value" + i;
+        case "array":
+            return new Object[] { i, "value" + i, i + 0.5 };
+        case "map":
+            Map<String, Object> m = new LinkedHashMap<>();
+            m.put("id", i);
+            m.put("name", "value" + i);
+            return m;
+        default:
+            ByteBuffer b = ByteBuffer.allocateDirect(256);
+            b.putInt(0, i);
+            return b;
+        }
+    }
+
+    @TearDown(Level.Trial)
+    public void tearDown() {
+        c.releaseAllRuntimes();
+    }
+
+    @Benchmark
+    public int objectArgs() throws Exception {
+        return c.callQJS(argv);
+    }
+
+    /* maps are passed as their toString() and ByteBuffers copied */
+    @Benchmark
+    public int argBuffer() throws Exception {
+        return c.callQJS(args.putAll(argv));
+    }
+}
@@ -0,0 +1,100 @@
+package org.scriptable.bench;
+
+import java.util.concurrent.TimeUnit;
+import org.openjdk.jmh.annotations.*;
+import org.scriptable.QuickJSConnector;
+
+/* single thread latency of calls doing nothing but the operation measured */
+@BenchmarkMode(Mode.AverageTime)
+@OutputTimeUnit(TimeUnit.NANOSECONDS)
+@Warmup(iterations = 3, time = 2)
+@Measurement(iterations = 5, time = 2)
+@Fork(1)
+@State(Scope.Thread)
+public class CallBench {
+    public static class BenchConnector extends QuickJSConnector {
+        private final Object[] javaResult = new Object[] { 1 };
+
+        public BenchConnector(String filename, HostFunction[] hostFunctions) {
+            super(filename, "main", 0, 0, null, hostFunctions);
+        }
+
+        @Override public Object[] callJava(Object[] argv) {
+            return javaResult;
+        }
+
+        @Override public int callJavaInt(int a, int b) {
+            return a + b;
+        }
+
+        public int add(int a, int b) {
+            return a + b;
+        }
+    }
+
+    private QuickJSConnector empty;
+    private QuickJSConnector callJava;
+    private QuickJSConnector callJavaInt;
+    private QuickJSConnector hostFunction;
+    private QuickJSConnector exception;
+    private final Object[] argv = new Object[0];
+    private final Object[][] batch = new Object[][] { argv };
+
+    @Setup(Level.Trial)
+    public void setup() throws Exception {
+        empty = new QuickJSConnector(Scripts.module("empty.js", "function() {}", 0), "main", 0);
+        callJava = new BenchConnector(Scripts.module("callJava.js", "function() { return callJava(1)[0]; }", 0),
+                null);
+        callJavaInt = new BenchConnector(Scripts.module("callJavaInt.js", "function() { return callJavaInt(1, 2); }",
+                0), null);
+        hostFunction = new BenchConnector(Scripts.module("hostFunction.js", "function() { return add(1, 2); }", 0),
+                new QuickJSConnector.HostFunction[] {
+                    new QuickJSConnector.HostFunction("add", "add", int.class, int.class) });
+        exception = new QuickJSConnector(Scripts.module("exception.js", "function() { throw new Error('x'); }", 0),
+                "main", 0);
+    }
+
+    @TearDown(Level.Trial)
+    public void tearDown() {
+        for (QuickJSConnector c: new QuickJSConnector[] { empty, callJava, callJavaInt, hostFunction, exception })
+            c.releaseAllRuntimes();
+    }
+
+    @Benchmark
+    public int emptyCall() throws Exception {
+        return empty.callQJS(argv);
+    }
+
+    /* JS to Java and back through callJava(...) */
+    @Benchmark
+    public int callJava() throws Exception {
+        return callJava.callQJS(argv);
+    }
+
+    @Benchmark
+    public int callJavaInt() throws Exception {
+        return callJavaInt.callQJS(argv);
+    }
+
+    @Benchmark
+    public int hostFunction() throws Exception {
+        return hostFunction.callQJS(argv);
+    }
+
+    /* JS exception with its stack trace, the runtime is released and created again by the next call */
+    @Benchmark
+    public String exception() {
+        try {
+            exception.callQJS(argv);
+            return null;
+        } catch(Exception e) {
+            return e.getMessage();
+        }
+    }
+
+    /* the same without releasing the runtime, which batches don't do */
+    @Benchmark
+    public Object exceptionKeptRuntime() throws Exception {
+        return exception.callQJSBatch(batch)[0];
+    }
+}
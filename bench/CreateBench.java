@@ -0,0 +1,42 @@
+package org.scriptable.bench;
+
+import java.util.concurrent.TimeUnit;
+import org.openjdk.jmh.annotations.*;
+import org.scriptable.QuickJSConnector;
+
+/* runtime creation against script size: each invocation creates a runtime, loads the script
+   and makes an empty call. The bytecode cache is warm after the first iteration, as in production */
+@BenchmarkMode(Mode.AverageTime)
+@OutputTimeUnit(TimeUnit.MICROSECONDS)
+@Warmup(iterations = 3, time = 2)
+@Measurement(iterations = 5, time = 2)
+@Fork(1)
+@State(Scope.Thread)
+public class CreateBench {
+    @Param({"1024", "65536", "1048576"})
+    public int scriptBytes;
+
+    private QuickJSConnector c;
+    private final Object[] argv = new Object[0];
+
+    @Setup(Level.Trial)
+    public void setup() throws Exception {
+        c = new QuickJSConnector(Scripts.module("create" + scriptBytes + ".js", "function() {}", scriptBytes),
+                "main", 0);
+    }
+
+    @Setup(Level.Invocation)
+    public void release() {
+        c.releaseAllRuntimes();
+    }
+
+    @TearDown(Level.Trial)
+    public void tearDown() {
+        c.releaseAllRuntimes();
+    }
+
+    @Benchmark
+    public int create() throws Exception {
+        return c.callQJS(argv);
+    }
+}
@@ -0,0 +1,46 @@
+package org.scriptable.bench;
+
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicInteger;
+import org.openjdk.jmh.annotations.*;
+import org.scriptable.QuickJSConnector;
+
+/* runtimes created per ms by all threads at once, as after a deploy. Each thread has its own copy
+   of the script, so releasing its runtimes leaves those of the other threads alone. Run with -t
+   for the thread count, make bench runs 1 to 64 threads: creation is parallel if this scales */
+@BenchmarkMode(Mode.Throughput)
+@OutputTimeUnit(TimeUnit.MILLISECONDS)
+@Warmup(iterations = 3, time = 2)
+@Measurement(iterations = 5, time = 2)
+@Fork(1)
+@State(Scope.Thread)
+public class CreateThroughputBench {
+    private static final AtomicInteger threads = new AtomicInteger();
+
+    @Param({"65536"})
+    public int scriptBytes;
+
+    private QuickJSConnector c;
+    private final Object[] argv = new Object[0];
+
+    @Setup(Level.Trial)
+    public void setup() throws Exception {
+        String name = "create-" + threads.getAndIncrement() + "-" + scriptBytes + ".js";
+        c = new QuickJSConnector(Scripts.module(name, "function() {}", scriptBytes), "main", 0);
+    }
+
+    @Setup(Level.Invocation)
+    public void release() {
+        c.releaseAllRuntimes();
+    }
+
+    @TearDown(Level.Trial)
+    public void tearDown() {
+        c.releaseAllRuntimes();
+    }
+
+    @Benchmark
+    public int create() throws Exception {
+        return c.callQJS(argv);
+    }
+}
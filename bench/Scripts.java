@@ -0,0 +1,35 @@
+package org.scriptable.bench;
+
+import java.io.File;
+import java.io.IOException;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+
+/* benchmark scripts, written to a temporary directory on first use */
+final class Scripts {
+    private static Path dir;
+
+    private Scripts() {
+    }
+
+    static synchronized String write(String name, String source) throws IOException {
+        if (dir == null) {
+            dir = Files.createTempDirectory("quickjs-bench");
+            dir.toFile().deleteOnExit();
+        }
+        File f = dir.resolve(name).toFile();
+        Files.write(f.toPath(), source.getBytes(StandardCharsets.UTF_8));
+        f.deleteOnExit();
+        return f.getPath();
+    }
+
+    /* module defining globalThis.main as body, padded with functions to about size bytes */
+    static String module(String name, String body, int size) throws IOException {
+        StringBuilder sb = new StringBuilder();
+        sb.append("globalThis.main = ").append(body).append(";\n");
+        for (int i = 0; sb.length() < size; i++)
+            sb.append("export function f").append(i).append("(a, b) { return a * ").append(i).append(" + b; }\n");
+        return write(name, sb.toString());
+    }
+}
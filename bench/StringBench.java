@@ -0,0 +1,59 @@
+package org.scriptable.bench;
+
+import java.util.concurrent.TimeUnit;
+import org.openjdk.jmh.annotations.*;
+import org.scriptable.QuickJSConnector;
+
+/* string arguments and results by length, ASCII or mostly Cyrillic */
+@BenchmarkMode(Mode.AverageTime)
+@OutputTimeUnit(TimeUnit.NANOSECONDS)
+@Warmup(iterations = 3, time = 2)
+@Measurement(iterations = 5, time = 2)
+@Fork(1)
+@State(Scope.Thread)
+public class StringBench {
+    @Param({"16", "256", "4096", "65536"})
+    public int length;
+
+    @Param({"ascii", "cyrillic"})
+    public String text;
+
+    private QuickJSConnector identity;
+    private QuickJSConnector ignore;
+    private Object[] argv;
+    private final QuickJSConnector.ArgBuffer args = new QuickJSConnector.ArgBuffer(4096);
+
+    @Setup(Level.Trial)
+    public void setup() throws Exception {
+        identity = new QuickJSConnector(Scripts.module("identity.js", "s => s", 0), "main", 0);
+        ignore = new QuickJSConnector(Scripts.module("ignore.js", "s => 0", 0), "main", 0);
+        String unit = text.equals("ascii")? "<p>Hello</p> " : "<p>Привет</p> ";
+        StringBuilder sb = new StringBuilder();
+        while (sb.length() < length)
+            sb.append(unit);
+        sb.setLength(length);
+        argv = new Object[] { sb.toString() };
+    }
+
+    @TearDown(Level.Trial)
+    public void tearDown() {
+        identity.releaseAllRuntimes();
+        ignore.releaseAllRuntimes();
+    }
+
+    @Benchmark
+    public int stringArg() throws Exception {
+        return ignore.callQJS(argv);
+    }
+
+    @Benchmark
+    public int stringArgBuffer() throws Exception {
+        return ignore.callQJS(args.putAll(argv));
+    }
+
+    /* the string back as result, conversion both ways */
+    @Benchmark
+    public Object stringRoundTrip() throws Exception {
+        return identity.callQJSValue(argv);
+    }
+}
@@ -0,0 +1,42 @@
+package org.scriptable.bench;
+
+import java.util.concurrent.TimeUnit;
+import org.openjdk.jmh.annotations.*;
+import org.scriptable.QuickJSConnector;
+
+/* calls per ms of all threads sharing one connector, with a runtime per thread or a pool.
+   Run with -t for the thread count, make bench runs 1 to 64 threads */
+@BenchmarkMode(Mode.Throughput)
+@OutputTimeUnit(TimeUnit.MILLISECONDS)
+@Warmup(iterations = 3, time = 2)
+@Measurement(iterations = 5, time = 2)
+@Fork(1)
+@State(Scope.Benchmark)
+public class ThroughputBench {
+    @Param({"0", "8"})
+    public int poolSize;
+
+    private QuickJSConnector c;
+
+    @Setup(Level.Trial)
+    public void setup() throws Exception {
+        c = new QuickJSConnector(Scripts.module("throughput.js",
+                "function(method, path, ...params) { return path.length + params.length; }", 0),
+                "main", 0, poolSize);
+    }
+
+    @TearDown(Level.Trial)
+    public void tearDown() {
+        c.releaseAllRuntimes();
+    }
+
+    @State(Scope.Thread)
+    public static class Request {
+        final Object[] argv = new Object[] { "GET", "/test", "param1", "Саша" };
+    }
+
+    @Benchmark
+    public int call(Request r) throws Exception {
+        return c.callQJS(r.argv);
+    }
+}
@@ -10,34 +10,162 @@ extern "C" {
 /*
  * Class:     org_scriptable_QuickJSConnector
  * Method:    nativeNewQJSRuntime
- * Signature: (Ljava/lang/String;Ljava/lang/String;)[B
+ * Signature: (Ljava/lang/String;Ljava/lang/String;ZJJJILjava/lang/Class;[Ljava/lang/Object;)J
  */
-JNIEXPORT jbyteArray JNICALL Java_org_scriptable_QuickJSConnector_nativeNewQJSRuntime
-  (JNIEnv *, jclass, jstring, jstring);
+JNIEXPORT jlong JNICALL Java_org_scriptable_QuickJSConnector_nativeNewQJSRuntime
+  (JNIEnv *, jclass, jstring, jstring, jboolean, jlong, jlong, jlong, jint, jclass, jobjectArray);
 
 /*
  * Class:     org_scriptable_QuickJSConnector
  * Method:    nativeFreeQJSRuntime
- * Signature: ([B)V
+ * Signature: (J)V
  */
 JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeFreeQJSRuntime
-  (JNIEnv *, jclass, jbyteArray);
+  (JNIEnv *, jclass, jlong);
 
 /*
  * Class:     org_scriptable_QuickJSConnector
  * Method:    nativeCallQJS
- * Signature: ([B[Ljava/lang/Object;)I
+ * Signature: (J[Ljava/lang/Object;Ljava/nio/ByteBuffer;Ljava/lang/Object;ZI)Ljava/lang/Object;
  */
-JNIEXPORT jint JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJS
-  (JNIEnv *, jobject, jbyteArray, jobjectArray);
+JNIEXPORT jobject JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJS
+  (JNIEnv *, jobject, jlong, jobjectArray, jobject, jobject, jboolean, jint);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeCallQJSArgs
+ * Signature: (JLjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;Ljava/lang/Object;ZI)Ljava/lang/Object;
+ */
+JNIEXPORT jobject JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJSArgs
+  (JNIEnv *, jobject, jlong, jobject, jint, jobject, jobject, jboolean, jint);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeCallQJSBatch
+ * Signature: (J[[Ljava/lang/Object;[Ljava/lang/Object;[Ljava/lang/Object;I)I
+ */
+JNIEXPORT jint JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJSBatch
+  (JNIEnv *, jobject, jlong, jobjectArray, jobjectArray, jobjectArray, jint);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeCallQJSArgsBatch
+ * Signature: (JLjava/nio/ByteBuffer;II[Ljava/lang/Object;[Ljava/lang/Object;I)I
+ */
+JNIEXPORT jint JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJSArgsBatch
+  (JNIEnv *, jobject, jlong, jobject, jint, jint, jobjectArray, jobjectArray, jint);
 
 /*
  * Class:     org_scriptable_QuickJSConnector
  * Method:    nativeGetQJSException
- * Signature: ([B)[Ljava/lang/Object;
+ * Signature: (J)[Ljava/lang/Object;
  */
 JNIEXPORT jobjectArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetQJSException
-  (JNIEnv *, jobject, jbyteArray);
+  (JNIEnv *, jobject, jlong);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetBytecodeCacheStats
+ * Signature: ()[J
+ */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetBytecodeCacheStats
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeCompleteJava
+ * Signature: (JI[Ljava/lang/Object;Ljava/lang/Throwable;)V
+ */
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeCompleteJava
+  (JNIEnv *, jclass, jlong, jint, jobjectArray, jthrowable);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetScriptStats
+ * Signature: (Ljava/lang/String;)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetScriptStats
+  (JNIEnv *, jclass, jstring);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetMemoryUsage
+ * Signature: ([J)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetMemoryUsage
+  (JNIEnv *, jclass, jlongArray);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetAllocatorStats
+ * Signature: ()[J
+ */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetAllocatorStats
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeTrimMemory
+ * Signature: ()J
+ */
+JNIEXPORT jlong JNICALL Java_org_scriptable_QuickJSConnector_nativeTrimMemory
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeStartIdleTrim
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeStartIdleTrim
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetTrimStats
+ * Signature: ()[J
+ */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetTrimStats
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeSetLogSink
+ * Signature: (ILjava/lang/String;)Z
+ */
+JNIEXPORT jboolean JNICALL Java_org_scriptable_QuickJSConnector_nativeSetLogSink
+  (JNIEnv *, jclass, jint, jstring);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeFlushLog
+ * Signature: ()V
+ */
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeFlushLog
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetLogStats
+ * Signature: ()[J
+ */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetLogStats
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeGetChangedModules
+ * Signature: (Ljava/lang/String;)[Ljava/lang/String;
+ */
+JNIEXPORT jobjectArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetChangedModules
+  (JNIEnv *, jclass, jstring);
+
+/*
+ * Class:     org_scriptable_QuickJSConnector
+ * Method:    nativeWarmModules
+ * Signature: (Ljava/lang/String;)Z
+ */
+JNIEXPORT jboolean JNICALL Java_org_scriptable_QuickJSConnector_nativeWarmModules
+  (JNIEnv *, jclass, jstring);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,403 @@
+/*
+ * qjsload: calls a script's main function the way QuickJSConnector does, without a JVM, so that
+ * the JS engine can be profiled (perf, flame graphs) apart from JNI and Java costs.
+ * Each thread creates its own runtime, loads the script through the bytecode cache like
+ * nativeNewQJSRuntime, then calls the main function. callJava() and friends answer from a JSON
+ * file of canned replies instead of calling Java. Host functions, callJavaAsync() and timers are
+ * not available.
+ *
+ * usage: qjsload [-n calls] [-t threads] [-f mainFunc] [-r replies.json] [-q] script.js [args...]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "quickjs-rt.h"
+
+/* Per thread state, only read by main() once the thread is joined */
+typedef struct Worker {
+    pthread_t tid;
+    int64_t *latencies; // ns, one per call
+    int64_t call_count;
+    int64_t call_start, call_end; // get_time_ns() time
+    int64_t create_ns;
+    JSMemoryUsage mem; // after the calls
+    int64_t exceptions;
+    char *first_error; // malloc'ed
+    int failed; // runtime could not be created or the script failed to load
+} Worker;
+
+/* callJava() replies of a context, keyed by the first argument, "*" for any other */
+typedef struct LoadContext {
+    JSValue replies;
+    int quiet;
+} LoadContext;
+
+static int64_t calls = 1000;
+static int thread_count = 1;
+static const char *main_func_name = "handleRequest";
+static const char *replies_file;
+static char *replies_json; // read once, parsed by each context
+static size_t replies_len;
+static int quiet;
+static const char *script;
+static char **script_args;
+static int script_argc;
+
+#define CALL_JAVA_ANY 0 // magic of the callJava stubs
+#define CALL_JAVA_STRING 1
+#define CALL_JAVA_NUMBER 2
+#define CALL_JAVA_INT 3
+
+static JSValue js_print_stub(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+    LoadContext *lc = JS_GetContextOpaque(ctx);
+    if (lc->quiet)
+        return JS_UNDEFINED;
+    for (int i = 0; i < argc; i++) {
+        const char *str = JS_ToCString(ctx, argv[i]);
+        if (!str)
+            return JS_EXCEPTION;
+        fprintf(stdout, i? " %s" : "%s", str);
+        JS_FreeCString(ctx, str);
+    }
+    fputc('\n', stdout);
+    return JS_UNDEFINED;
+}
+
+/* callJava(key, ...): the reply for key, or for "*" if there is none */
+static JSValue js_call_java_stub(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv,
+                        int magic)
+{
+    LoadContext *lc = JS_GetContextOpaque(ctx);
+    JSValue reply = JS_UNDEFINED;
+    if (JS_IsObject(lc->replies)) {
+        const char *key = argc > 0? JS_ToCString(ctx, argv[0]) : NULL;
+        if (key) {
+            reply = JS_GetPropertyStr(ctx, lc->replies, key);
+            JS_FreeCString(ctx, key);
+        }
+        if (JS_IsUndefined(reply))
+            reply = JS_GetPropertyStr(ctx, lc->replies, "*");
+        if (JS_IsException(reply))
+            return reply;
+    }
+    switch (magic) {
+    case CALL_JAVA_STRING: {
+        if (JS_IsUndefined(reply) || JS_IsNull(reply))
+            return JS_NULL;
+        if (JS_IsString(reply))
+            return reply;
+        JSValue str = JS_JSONStringify(ctx, reply, JS_UNDEFINED, JS_UNDEFINED);
+        JS_FreeValue(ctx, reply);
+        return str;
+    }
+    case CALL_JAVA_NUMBER: {
+        double d = 0;
+        int ret = JS_IsUndefined(reply)? 0 : JS_ToFloat64(ctx, &d, reply);
+        JS_FreeValue(ctx, reply);
+        return ret < 0? JS_EXCEPTION : JS_NewFloat64(ctx, d);
+    }
+    case CALL_JAVA_INT: {
+        int32_t i = 0;
+        int ret = JS_IsUndefined(reply)? 0 : JS_ToInt32(ctx, &i, reply);
+        JS_FreeValue(ctx, reply);
+        return ret < 0? JS_EXCEPTION : JS_NewInt32(ctx, i);
+    }
+    default:
+        return reply;
+    }
+}
+
+/* response.write()/flush(): output is discarded */
+static JSValue js_discard(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+    return JS_UNDEFINED;
+}
+
+/* Current exception as a malloc'ed "message\nstack" string */
+static char *exception_string(JSContext *ctx)
+{
+    JSValue exc = JS_GetException(ctx);
+    const char *msg = JS_ToCString(ctx, exc);
+    const char *stack = NULL;
+    if (JS_IsError(ctx, exc)) {
+        JSValue val = JS_GetPropertyStr(ctx, exc, "stack");
+        if (!JS_IsUndefined(val))
+            stack = JS_ToCString(ctx, val);
+        JS_FreeValue(ctx, val);
+    }
+    size_t len = (msg? strlen(msg) : 0) + (stack? strlen(stack) : 0) + 2;
+    char *ret = malloc(len);
+    if (ret)
+        snprintf(ret, len, "%s\n%s", msg? msg : "", stack? stack : "");
+    JS_FreeCString(ctx, msg);
+    JS_FreeCString(ctx, stack);
+    JS_FreeValue(ctx, exc);
+    return ret;
+}
+
+static void define_globals(JSContext *ctx)
+{
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSValue console = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, console, "log", JS_NewCFunction(ctx, js_print_stub, "log", 1), 0);
+    JS_DefinePropertyValueStr(ctx, console, "info", JS_NewCFunction(ctx, js_print_stub, "info", 1), 0);
+    JS_DefinePropertyValueStr(ctx, console, "warn", JS_NewCFunction(ctx, js_print_stub, "warn", 1), 0);
+    JS_DefinePropertyValueStr(ctx, console, "error", JS_NewCFunction(ctx, js_print_stub, "error", 1), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "console", console, 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJava",
+                      JS_NewCFunctionMagic(ctx, js_call_java_stub, "callJava", 1,
+                      JS_CFUNC_generic_magic, CALL_JAVA_ANY), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaString",
+                      JS_NewCFunctionMagic(ctx, js_call_java_stub, "callJavaString", 1,
+                      JS_CFUNC_generic_magic, CALL_JAVA_STRING), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaNumber",
+                      JS_NewCFunctionMagic(ctx, js_call_java_stub, "callJavaNumber", 1,
+                      JS_CFUNC_generic_magic, CALL_JAVA_NUMBER), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaInt",
+                      JS_NewCFunctionMagic(ctx, js_call_java_stub, "callJavaInt", 2,
+                      JS_CFUNC_generic_magic, CALL_JAVA_INT), 0);
+    JSValue response = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, response, "write", JS_NewCFunction(ctx, js_discard, "write", 1), 0);
+    JS_DefinePropertyValueStr(ctx, response, "flush", JS_NewCFunction(ctx, js_discard, "flush", 0), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "response", response, 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "snapshot",
+                      JS_NewCFunction(ctx, js_snapshot, "snapshot", 2), 0);
+    JS_FreeValue(ctx, global_obj);
+
+    /* system modules */
+    js_init_module_std(ctx, "std");
+    js_init_module_os(ctx, "os");
+}
+
+/* Script arguments: JSON values, or strings if they don't parse */
+static JSValue *parse_args(JSContext *ctx)
+{
+    JSValue *args = malloc(sizeof(JSValue) * (script_argc + 1));
+    if (!args)
+        return NULL;
+    for (int i = 0; i < script_argc; i++) {
+        args[i] = JS_ParseJSON(ctx, script_args[i], strlen(script_args[i]), "<arg>");
+        if (JS_IsException(args[i])) {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            args[i] = JS_NewString(ctx, script_args[i]);
+        }
+    }
+    return args;
+}
+
+static void record_error(Worker *w, JSContext *ctx)
+{
+    char *error = exception_string(ctx);
+    if (!w->first_error)
+        w->first_error = error;
+    else
+        free(error);
+}
+
+static void *run_worker(void *opaque)
+{
+    Worker *w = opaque;
+    int64_t start = get_time_ns();
+    JSRuntime *rt = JS_NewRuntime();
+    JSContext *ctx = rt? JS_NewContext(rt) : NULL;
+    LoadContext lc = { JS_UNDEFINED, quiet };
+    JSValue main_func = JS_UNDEFINED;
+    JSValue *args = NULL;
+    if (unlikely(!ctx)) {
+        w->first_error = strdup("cannot allocate JS runtime");
+        w->failed = 1;
+        goto done;
+    }
+    JS_SetCanBlock(rt, 1);
+    JS_SetModuleLoaderFunc(rt, NULL, js_cached_module_loader, NULL);
+    JS_SetContextOpaque(ctx, &lc);
+    define_globals(ctx);
+    if (replies_json) {
+        lc.replies = JS_ParseJSON(ctx, replies_json, replies_len, replies_file);
+        if (JS_IsException(lc.replies)) {
+            record_error(w, ctx);
+            w->failed = 1;
+            goto done;
+        }
+    }
+    if (load_root_module(ctx, script) < 0) {
+        record_error(w, ctx);
+        w->failed = 1;
+        goto done;
+    }
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    main_func = JS_GetPropertyStr(ctx, global_obj, main_func_name);
+    JS_FreeValue(ctx, global_obj);
+    if (!JS_IsFunction(ctx, main_func)) {
+        JS_ThrowInternalError(ctx, "globalThis.%s function undefined", main_func_name);
+        record_error(w, ctx);
+        w->failed = 1;
+        goto done;
+    }
+    if (!(args = parse_args(ctx))) {
+        w->failed = 1;
+        goto done;
+    }
+    w->create_ns = get_time_ns() - start;
+
+    w->call_start = get_time_ns();
+    for (int64_t i = 0; i < calls; i++) {
+        int64_t call_start = get_time_ns();
+        JSValue ret = JS_Call(ctx, main_func, JS_UNDEFINED, script_argc, args);
+        if (JS_IsException(ret)) {
+            w->exceptions++;
+            record_error(w, ctx);
+        }
+        JS_FreeValue(ctx, ret);
+        /* settle promises the call created, like the connector does for async main functions */
+        JSContext *job_ctx;
+        int err;
+        while ((err = JS_ExecutePendingJob(rt, &job_ctx)) != 0) {
+            if (err < 0) {
+                w->exceptions++;
+                record_error(w, job_ctx);
+            }
+        }
+        w->latencies[w->call_count++] = get_time_ns() - call_start;
+    }
+    w->call_end = get_time_ns();
+    JS_ComputeMemoryUsage(rt, &w->mem);
+
+done:
+    if (args) {
+        for (int i = 0; i < script_argc; i++)
+            JS_FreeValue(ctx, args[i]);
+        free(args);
+    }
+    if (ctx) {
+        JS_FreeValue(ctx, main_func);
+        JS_FreeValue(ctx, lc.replies);
+        JS_FreeContext(ctx);
+    }
+    if (rt)
+        JS_FreeRuntime(rt);
+    return NULL;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y? -1 : x > y;
+}
+
+static void help(void)
+{
+    fprintf(stdout, "usage: qjsload [-n calls] [-t threads] [-f mainFunc] [-r replies.json] [-q] "
+            "script.js [args...]\n"
+            "-n  main function calls per thread (default 1000)\n"
+            "-t  threads, each with its own runtime (default 1)\n"
+            "-f  main function (default handleRequest)\n"
+            "-r  JSON object of callJava() replies keyed by the first argument, \"*\" for any\n"
+            "-q  discard console output\n"
+            "args are passed to the main function as JSON values, or as strings if not JSON\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "+n:t:f:r:qh")) != -1) {
+        switch (c) {
+        case 'n': calls = strtoll(optarg, NULL, 10); break;
+        case 't': thread_count = atoi(optarg); break;
+        case 'f': main_func_name = optarg; break;
+        case 'r': replies_file = optarg; break;
+        case 'q': quiet = 1; break;
+        default: help();
+        }
+    }
+    if (optind >= argc || calls <= 0 || thread_count <= 0)
+        help();
+    script = argv[optind];
+    script_args = argv + optind + 1;
+    script_argc = argc - optind - 1;
+    if (replies_file && !(replies_json = (char *)js_load_file(NULL, &replies_len, replies_file))) {
+        fprintf(stdout, "Error: cannot read %s\n", replies_file);
+        return 1;
+    }
+
+    Worker *workers = calloc(thread_count, sizeof(Worker));
+    if (!workers)
+        return 1;
+    for (int i = 0; i < thread_count; i++) {
+        if (!(workers[i].latencies = malloc(sizeof(int64_t) * calls))) {
+            fprintf(stdout, "Error: cannot allocate latencies\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i].tid, NULL, run_worker, &workers[i])) {
+            fprintf(stdout, "Error: cannot create thread %d\n", i);
+            return 1;
+        }
+    }
+
+    int64_t total = 0, exceptions = 0, create_ns = 0, first_start = INT64_MAX, last_end = 0;
+    int64_t malloc_size = 0, malloc_count = 0, memory_used = 0;
+    int ok = 0;
+    const char *first_error = NULL;
+    for (int i = 0; i < thread_count; i++) {
+        Worker *w = &workers[i];
+        pthread_join(w->tid, NULL);
+        if (!first_error)
+            first_error = w->first_error;
+        if (w->failed)
+            continue;
+        ok++;
+        total += w->call_count;
+        exceptions += w->exceptions;
+        create_ns += w->create_ns;
+        malloc_size += w->mem.malloc_size;
+        malloc_count += w->mem.malloc_count;
+        memory_used += w->mem.memory_used_size;
+        if (w->call_start < first_start)
+            first_start = w->call_start;
+        if (w->call_end > last_end)
+            last_end = w->call_end;
+    }
+    if (!ok) {
+        fprintf(stdout, "Error: %s\n", first_error? first_error : "no runtime could be created");
+        return 1;
+    }
+
+    int64_t *all = malloc(sizeof(int64_t) * total);
+    if (!all)
+        return 1;
+    int64_t n = 0;
+    for (int i = 0; i < thread_count; i++) {
+        if (!workers[i].failed) {
+            memcpy(all + n, workers[i].latencies, sizeof(int64_t) * workers[i].call_count);
+            n += workers[i].call_count;
+        }
+    }
+    qsort(all, n, sizeof(int64_t), cmp_int64);
+    double elapsed = (double)(last_end - first_start) / 1e9;
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+
+    fprintf(stdout, "%s %s(): %d runtimes, %lld calls in %.3f s, %.0f calls/s\n", script,
+            main_func_name, ok, (long long)total, elapsed, elapsed > 0? total / elapsed : 0);
+    fprintf(stdout, "latency us:");
+    for (int i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+        fprintf(stdout, " p%g %.1f", percentiles[i],
+                all[(int64_t)(percentiles[i] / 100 * (n - 1))] / 1e3);
+    fprintf(stdout, " max %.1f\n", all[n - 1] / 1e3);
+    fprintf(stdout, "runtime creation: %.3f ms avg\n", (double)create_ns / ok / 1e6);
+    fprintf(stdout, "memory per runtime: %lld bytes malloc'ed in %lld blocks, %lld bytes used\n",
+            (long long)(malloc_size / ok), (long long)(malloc_count / ok), (long long)(memory_used / ok));
+    int64_t bc[BC_CACHE_STAT_COUNT];
+    get_bytecode_cache_stats(bc);
+    fprintf(stdout, "bytecode cache: %lld hits, %lld misses\n", (long long)bc[0], (long long)bc[1]);
+    if (exceptions)
+        fprintf(stdout, "exceptions: %lld, first: %s\n", (long long)exceptions, first_error);
+    if (ok < thread_count)
+        fprintf(stdout, "%d runtimes failed: %s\n", thread_count - ok, first_error);
+    return exceptions || ok < thread_count? 2 : 0;
+}
@@ -4,41 +4,265 @@
 #include <sys/wait.h>
 #include <malloc.h>
 #include "quickjs-libc.h"
+#include "quickjs-rt.h"
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
-
-#if defined(__GNUC__) || defined(__clang__)
-#define likely(x)          __builtin_expect(!!(x), 1)
-#define unlikely(x)        __builtin_expect(!!(x), 0)
-#define force_inline       inline __attribute__((always_inline))
-#else
-#define likely(x)     (x)
-#define unlikely(x)   (x)
-#define force_inline  inline
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
-static int eval_buf(JSContext *ctx, const void *buf, int buf_len,
-                    const char *filename, int eval_flags);
-static int eval_module(JSContext *ctx, const char *filename);
+#define LOG_INFO 0 // console.log/info level, see QuickJSConnector.LogHandler
+#define LOG_WARN 1
+#define LOG_ERROR 2
 static JSValue js_print(JSContext *ctx, JSValueConst this_val,
-                        int argc, JSValueConst *argv);
+                        int argc, JSValueConst *argv, int level);
+static void init_log();
 static JSValue js_call_java(JSContext *ctx, JSValueConst this_val,
                         int argc, JSValueConst *argv);
+static JSValue js_call_java_string(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_call_java_number(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_call_java_int(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_response_write(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_response_flush(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_call_java_async(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_set_timeout(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+static JSValue js_clear_timeout(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv);
+
+/* setTimeout() timer, only run by async calls */
+typedef struct AsyncTimer {
+    struct AsyncTimer *next;
+    int id;
+    int64_t deadline; // get_time_ns() time
+    JSValue func;
+} AsyncTimer;
+
+/* callJavaAsync() promise waiting for its Java operation to complete */
+typedef struct AsyncOp {
+    struct AsyncOp *next;
+    int id;
+    JSValue resolving_funcs[2];
+} AsyncOp;
+
+/* Java operation result, posted by whatever thread completed it */
+typedef struct AsyncCompletion {
+    struct AsyncCompletion *next;
+    int id;
+    jobjectArray result; // global refs
+    jthrowable error;
+} AsyncCompletion;
+
+/* Per script (filename/mainFunc, same as Java's ctxKey) counters, shared by its runtimes */
+/* Latency histogram, bucket 0 counts durations under 1us, bucket i durations in
+   [2^(i+9), 2^(i+10)) ns, the last bucket everything longer */
+#define LATENCY_MIN_BITS 10
+#define LATENCY_BUCKETS 28
+#define LATENCY_FIELD_COUNT (LATENCY_BUCKETS + 2)
+typedef struct LatencyHistogram {
+    int64_t count;
+    int64_t sum_ns;
+    int64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/* Metrics of all runtimes of a script, all fields updated atomically */
+typedef struct ScriptStats {
+    struct ScriptStats *next;
+    char *key;
+    int64_t calls;
+    int64_t timeouts;
+    int64_t exceptions;
+    LatencyHistogram call_ns; // whole native call
+    LatencyHistogram js_ns; // main function, including awaiting its promise
+    LatencyHistogram args_ns; // Java arguments to JS values
+    LatencyHistogram result_ns; // JS result to Java object
+    LatencyHistogram java_ns; // callJava() round-trips
+    LatencyHistogram create_ns; // runtime creation
+    LatencyHistogram destroy_ns; // runtime destruction
+} ScriptStats;
+#define SCRIPT_STATS_HISTOGRAMS 7
+
+struct Arena;
+
+/* Java method bound to a JS function, see QuickJSConnector.HostFunction */
+#define HOST_FUNC_MAX_ARGS 16
+typedef struct HostFunc {
+    jmethodID method;
+    char ret_type; // JNI type char, S for String and L for other objects
+    int argc;
+    char arg_types[HOST_FUNC_MAX_ARGS];
+} HostFunc;
+
+static HostFunc *define_host_funcs(JSContext *ctx, JNIEnv *env, jobjectArray table);
+static JavaVM *java_vm;
 
 typedef struct QJSHandle {
     JSContext *ctx;
+    struct Arena *arena; // NULL unless created with ALLOCATOR_ARENA
     JSValue main_func;
+    ScriptStats *stats; // never NULL, creation fails without it, so calls and callJava() use it unchecked
+    int64_t deadline; // of the current call, 0 if none
+    int timed_out;
+    JSValue array_buffer_ctor;
+    JSValue typed_array_ctor;
+    JSValue map_ctor;
+    JSValue set_ctor;
+    HostFunc *host_funcs; // indexed by the functions' data
+    jclass host_class; // global ref, class of the connectors allowed to call host functions
+    /* keep memory exposed to Java by the last call's result valid until the next call */
+    JSValue last_result;
+    const char *last_cstr;
+    /* response.write() output not yet handed to Java, allocated on first use */
+    uint8_t *resp_buf;
+    size_t resp_len;
+    /* async call state, timers and ops are only touched by the thread running the call */
+    AsyncTimer *timers;
+    AsyncOp *async_ops;
+    int async_pending;
+    int next_async_id;
+    pthread_mutex_t async_mutex;
+    pthread_cond_t async_cond; // signaled when completions are posted
+    AsyncCompletion *completions; // guarded by async_mutex
+    /* shared runtimes: about where QuickJS took its stack base on the creating thread, 0 otherwise */
+    uintptr_t stack_top;
+    size_t stack_size;
 } QJSHandle;
 
+#define RESPONSE_CHUNK_SIZE (64 * 1024)
+#define ASYNC_GRACE_NS 1000000000LL // how long a settled call without a budget waits for its operations
+
+static pthread_mutex_t async_post_mutex = PTHREAD_MUTEX_INITIALIZER; // see async calls below
+#define DEFAULT_STACK_SIZE (256 * 1024) // QuickJS's JS_DEFAULT_STACK_SIZE
+
+/*
+ * Coarse monotonic clock for the interrupt handler, which QuickJS calls every few thousand
+ * operations: a ticker thread started on first use updates it every COARSE_CLOCK_TICK_NS.
+ */
+#define COARSE_CLOCK_TICK_NS 1000000
+static int64_t coarse_time_ns; // updated atomically
+static int coarse_clock_running;
+static pthread_once_t coarse_clock_once = PTHREAD_ONCE_INIT;
+
+static void *coarse_clock_ticker(void *arg)
+{
+    struct timespec tick = { 0, COARSE_CLOCK_TICK_NS };
+    for (;;) {
+        nanosleep(&tick, NULL);
+        __atomic_store_n(&coarse_time_ns, get_time_ns(), __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void start_coarse_clock(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    __atomic_store_n(&coarse_time_ns, get_time_ns(), __ATOMIC_RELAXED);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, coarse_clock_ticker, NULL))
+        fprintf(stdout, "quickjs: cannot start clock thread, using clock_gettime for deadlines\n");
+    else
+        __atomic_store_n(&coarse_clock_running, 1, __ATOMIC_RELEASE);
+    pthread_attr_destroy(&attr);
+}
+
+static force_inline int64_t get_coarse_time_ns()
+{
+    if (likely(__atomic_load_n(&coarse_clock_running, __ATOMIC_ACQUIRE)))
+        return __atomic_load_n(&coarse_time_ns, __ATOMIC_RELAXED);
+    return get_time_ns();
+}
+
+/* Raises an uncatchable "interrupted" error once the current call's deadline has passed */
+static int js_interrupt_handler(JSRuntime *rt, void *opaque)
+{
+    QJSHandle *qjs = (QJSHandle *)opaque;
+    if (likely(!qjs->deadline) || get_coarse_time_ns() < qjs->deadline)
+        return 0;
+    qjs->timed_out = 1;
+    return 1;
+}
+
+/*
+ * Script stats registry. Entries are only ever pushed on the bucket lists and never freed,
+ * so lookups walk the lists without a lock and new entries are published with a CAS
+ */
+#define SCRIPT_STATS_BUCKETS 64
+static ScriptStats *script_stats[SCRIPT_STATS_BUCKETS];
+
+/* Find stats for filename/mainFunc, creating them if create is set */
+static ScriptStats *get_script_stats(const char *key, int create)
+{
+    ScriptStats **head = &script_stats[hash_string(key) % SCRIPT_STATS_BUCKETS];
+    ScriptStats *first = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    ScriptStats *n = NULL;
+    for (;;) {
+        for (ScriptStats *e = first; e; e = e->next) {
+            if (!strcmp(e->key, key)) {
+                if (n) { // another thread added it first
+                    free(n->key);
+                    free(n);
+                }
+                return e;
+            }
+        }
+        if (!create)
+            return NULL;
+        if (!n) {
+            if (!(n = calloc(1, sizeof(ScriptStats))))
+                return NULL;
+            if (!(n->key = strdup(key))) {
+                free(n);
+                return NULL;
+            }
+        }
+        n->next = first;
+        if (__atomic_compare_exchange_n(head, &first, n, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            return n;
+        // first now holds the new list head, look again
+    }
+}
+
+static force_inline void record_latency(LatencyHistogram *h, int64_t ns)
+{
+    int b = 0;
+    if (ns >= (1 << LATENCY_MIN_BITS)) {
+        b = 64 - __builtin_clzll((uint64_t)ns) - LATENCY_MIN_BITS;
+        if (b >= LATENCY_BUCKETS)
+            b = LATENCY_BUCKETS - 1;
+    } else if (ns < 0) {
+        ns = 0;
+    }
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+}
+
 static pthread_mutex_t js_atomics_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int js_instance_count = 0;
 static int inc_instance_count()
 {
     pthread_mutex_lock(&js_atomics_mutex);
     int ret = ++js_instance_count;
-    if (!(ret&7))
-        fprintf(stdout, "quickjs: runtime alloc count %d\n", ret);
+    if (!(ret&7)) {
+        int64_t bc[BC_CACHE_STAT_COUNT];
+        get_bytecode_cache_stats(bc);
+        fprintf(stdout, "quickjs: runtime alloc count %d, bytecode cache hits %lld/%lld\n", ret,
+                (long long)bc[0], (long long)(bc[0] + bc[1]));
+    }
     pthread_mutex_unlock(&js_atomics_mutex);
     return ret;
 }
@@ -52,13 +276,653 @@ static int dec_instance_count()
     return ret;
 }
 
+/*
+ * Returning freed memory to the OS. Freed runtimes leave free pages scattered over glibc's per
+ * thread arenas, which malloc_trim releases (isolated runtimes unmap theirs when freed).
+ * Trimming happens after bulk frees, and optionally from a thread that trims once whenever no
+ * call was made for an idle interval.
+ */
+static int64_t trim_count, trim_reclaimed; // updated atomically
+static int idle_trim_millis; // 0 until the idle trim thread is started
+static pthread_mutex_t idle_trim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t get_rss_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (int64_t)resident * getpagesize();
+}
+
+/* Trim malloc arenas, return RSS reduction in bytes */
+static int64_t trim_memory()
+{
+    int64_t rss = get_rss_bytes();
+    malloc_trim(0);
+    int64_t reclaimed = rss - get_rss_bytes();
+    if (reclaimed < 0)
+        reclaimed = 0;
+    __atomic_add_fetch(&trim_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trim_reclaimed, reclaimed, __ATOMIC_RELAXED);
+    return reclaimed;
+}
+
+static int64_t get_total_calls()
+{
+    int64_t calls = 0;
+    for (int i = 0; i < SCRIPT_STATS_BUCKETS; i++) {
+        for (ScriptStats *e = __atomic_load_n(&script_stats[i], __ATOMIC_ACQUIRE); e; e = e->next)
+            calls += __atomic_load_n(&e->calls, __ATOMIC_RELAXED);
+    }
+    return calls;
+}
+
+static void *idle_trim_thread(void *arg)
+{
+    int64_t last_calls = -1;
+    int trimmed = 0;
+    for (;;) {
+        int millis = __atomic_load_n(&idle_trim_millis, __ATOMIC_RELAXED);
+        struct timespec ts = { millis / 1000, (millis % 1000) * 1000000 };
+        nanosleep(&ts, NULL);
+        int64_t calls = get_total_calls();
+        if (calls != last_calls)
+            trimmed = 0;
+        else if (!trimmed) {
+            int64_t reclaimed = trim_memory();
+            if (reclaimed)
+                fprintf(stdout, "quickjs: idle trim reclaimed %lld bytes\n", (long long)reclaimed);
+            trimmed = 1;
+        }
+        last_calls = calls;
+    }
+    return NULL;
+}
+
+JNIEXPORT jlong JNICALL Java_org_scriptable_QuickJSConnector_nativeTrimMemory(
+        JNIEnv *env, jclass cls)
+{
+    return trim_memory();
+}
+
+/* Start trimming whenever no call was made for idleMillis, or change the interval */
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeStartIdleTrim(
+        JNIEnv *env, jclass cls, jint idleMillis)
+{
+    if (idleMillis <= 0)
+        return;
+    pthread_mutex_lock(&idle_trim_mutex);
+    int started = idle_trim_millis > 0;
+    __atomic_store_n(&idle_trim_millis, idleMillis, __ATOMIC_RELAXED);
+    if (!started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, idle_trim_thread, NULL)) {
+            fprintf(stdout, "quickjs: cannot start idle trim thread\n");
+            idle_trim_millis = 0;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&idle_trim_mutex);
+}
+
+/* {trims, bytes reclaimed by them} */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetTrimStats(
+        JNIEnv *env, jclass cls)
+{
+    jlong stats[] = {
+        __atomic_load_n(&trim_count, __ATOMIC_RELAXED),
+        __atomic_load_n(&trim_reclaimed, __ATOMIC_RELAXED) };
+    jlongArray ret = (*env)->NewLongArray(env, sizeof(stats)/sizeof(stats[0]));
+    if (ret)
+        (*env)->SetLongArrayRegion(env, ret, 0, sizeof(stats)/sizeof(stats[0]), stats);
+    return ret;
+}
+
+/*
+ * Runtimes are handed to Java as an opaque jlong: slot index + 1 in the low 32 bits and the
+ * slot generation in the high 32 bits. The slot state word holds the generation and busy/dead
+ * flags, so a handle used after its runtime was freed (finalize/releaseAll races) is detected,
+ * and a runtime freed while another thread is running it is destroyed by that thread when
+ * its call completes. Slots are allocated in chunks that are never freed, so lookup is lock free.
+ * HANDLE_INSPECT marks a runtime briefly held busy by a telemetry query rather than a call,
+ * which callers wait out instead of failing.
+ */
+#define HANDLE_BUSY 1
+#define HANDLE_DEAD 2
+#define HANDLE_INSPECT 4
+#define HANDLE_FLAG_BITS 3
+#define HANDLE_GEN(state) ((uint32_t)((state) >> HANDLE_FLAG_BITS))
+#define HANDLE_CHUNK_BITS 8
+#define HANDLE_CHUNK_SIZE (1 << HANDLE_CHUNK_BITS)
+#define HANDLE_MAX_CHUNKS 4096
+
+typedef struct HandleSlot {
+    uint64_t state; // generation << HANDLE_FLAG_BITS | HANDLE_INSPECT | HANDLE_DEAD | HANDLE_BUSY
+    QJSHandle *qjs;
+    int next_free;
+} HandleSlot;
+
+static pthread_mutex_t handle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static HandleSlot *handle_chunks[HANDLE_MAX_CHUNKS];
+static int handle_slot_count = 0; // guarded by handle_mutex
+static int handle_free_list = -1; // guarded by handle_mutex
+
+static HandleSlot *get_handle_slot(jlong handle)
+{
+    uint32_t idx = (uint32_t)handle - 1;
+    if (unlikely(idx >= HANDLE_MAX_CHUNKS * HANDLE_CHUNK_SIZE))
+        return NULL;
+    HandleSlot *chunk = __atomic_load_n(&handle_chunks[idx >> HANDLE_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    return likely(chunk != NULL)? &chunk[idx & (HANDLE_CHUNK_SIZE - 1)] : NULL;
+}
+
+static jlong new_handle(QJSHandle *qjs)
+{
+    int idx;
+    pthread_mutex_lock(&handle_mutex);
+    if (handle_free_list >= 0) {
+        idx = handle_free_list;
+        handle_free_list = handle_chunks[idx >> HANDLE_CHUNK_BITS][idx & (HANDLE_CHUNK_SIZE - 1)].next_free;
+    }
+    else {
+        idx = handle_slot_count;
+        if (!(idx & (HANDLE_CHUNK_SIZE - 1))) {
+            HandleSlot *chunk = NULL;
+            if (idx < HANDLE_MAX_CHUNKS * HANDLE_CHUNK_SIZE)
+                chunk = calloc(HANDLE_CHUNK_SIZE, sizeof(HandleSlot));
+            if (!chunk) {
+                pthread_mutex_unlock(&handle_mutex);
+                return 0;
+            }
+            __atomic_store_n(&handle_chunks[idx >> HANDLE_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+        }
+        handle_slot_count++;
+    }
+    HandleSlot *slot = &handle_chunks[idx >> HANDLE_CHUNK_BITS][idx & (HANDLE_CHUNK_SIZE - 1)];
+    slot->qjs = qjs;
+    uint32_t gen = HANDLE_GEN(slot->state);
+    __atomic_store_n(&slot->state, (uint64_t)gen << HANDLE_FLAG_BITS, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handle_mutex);
+    return ((jlong)gen << 32) | (uint32_t)(idx + 1);
+}
+
+/* Invalidate the slot for good and put it back on the free list, return its runtime */
+static QJSHandle *retire_handle_slot(HandleSlot *slot, jlong handle)
+{
+    QJSHandle *qjs = slot->qjs;
+    pthread_mutex_lock(&handle_mutex);
+    slot->qjs = NULL;
+    __atomic_store_n(&slot->state, (uint64_t)(uint32_t)((handle >> 32) + 1) << HANDLE_FLAG_BITS,
+            __ATOMIC_RELEASE);
+    slot->next_free = handle_free_list;
+    handle_free_list = (uint32_t)handle - 1;
+    pthread_mutex_unlock(&handle_mutex);
+    return qjs;
+}
+
+/* Mark the runtime as being used by the current thread (inspected if inspect is set).
+   Returns NULL if the handle is stale or the runtime is in use (*busy set) */
+static QJSHandle *acquire_handle_flags(jlong handle, int *busy, int inspect)
+{
+    HandleSlot *slot = get_handle_slot(handle);
+    *busy = 0;
+    if (unlikely(!slot))
+        return NULL;
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (unlikely(HANDLE_GEN(state) != (uint32_t)(handle >> 32) || (state & HANDLE_DEAD)))
+            return NULL;
+        if (unlikely(state & HANDLE_BUSY)) {
+            if (!(state & HANDLE_INSPECT) || inspect) {
+                *busy = 1;
+                return NULL;
+            }
+            sched_yield(); // being inspected, won't take long
+            state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        }
+        else if (__atomic_compare_exchange_n(&slot->state, &state,
+                    state | HANDLE_BUSY | (inspect? HANDLE_INSPECT : 0), 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return slot->qjs;
+    }
+}
+
+static force_inline QJSHandle *acquire_handle(jlong handle, int *busy)
+{
+    return acquire_handle_flags(handle, busy, 0);
+}
+
+static void free_qjs_handle(QJSHandle *qjs);
+static void drop_async_completions(JNIEnv *env, QJSHandle *qjs);
+
+static void release_handle(jlong handle)
+{
+    HandleSlot *slot = get_handle_slot(handle);
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+    do {
+        if (state & HANDLE_DEAD) { // freed by another thread while we were using it
+            free_qjs_handle(retire_handle_slot(slot, handle));
+            dec_instance_count();
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&slot->state, &state, state & ~(HANDLE_BUSY | HANDLE_INSPECT), 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Return the runtime to be destroyed by the caller, or NULL if the handle is stale
+   or the runtime is in use, in which case it is destroyed by release_handle */
+static QJSHandle *free_handle(jlong handle)
+{
+    HandleSlot *slot = get_handle_slot(handle);
+    if (!slot)
+        return NULL;
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (HANDLE_GEN(state) != (uint32_t)(handle >> 32) || (state & HANDLE_DEAD))
+            return NULL;
+        if (state & HANDLE_BUSY) {
+            if (__atomic_compare_exchange_n(&slot->state, &state, state | HANDLE_DEAD, 1,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return NULL;
+        }
+        else if (__atomic_compare_exchange_n(&slot->state, &state, state | HANDLE_DEAD | HANDLE_BUSY, 1,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return retire_handle_slot(slot, handle);
+    }
+}
+
+/*
+ * Per runtime slab allocator, used with JS_NewRuntime2 when requested. Allocations of up to
+ * ARENA_MAX_SMALL bytes are carved from ARENA_SLAB_SIZE aligned slabs in 16 byte size classes
+ * and recycled through per class free lists, larger ones go to malloc. Slab bases are kept in an
+ * open addressing hash set, which tells small allocations from malloc'ed ones on free. A runtime
+ * is only used by one thread at a time, so the arena takes no locks; slabs are only returned
+ * when the runtime is freed, as whole regions instead of scattered small chunks.
+ *
+ * Isolated arenas don't share anything with malloc: slabs are mmap'ed, allocations of up to
+ * ARENA_MAX_MEDIUM bytes are served from slabs too in power of two classes, and larger ones are
+ * mmap'ed individually, so freeing the runtime unmaps all of its memory.
+ */
+#define ALLOCATOR_MALLOC 0 // see QuickJSConnector.Limits
+#define ALLOCATOR_ARENA 1
+#define ALLOCATOR_ISOLATED 2
+#define ARENA_SLAB_SIZE (64 * 1024)
+#define ARENA_SLAB_HEADER 16 // keeps objects 16 byte aligned
+#define ARENA_CLASS_SHIFT 4
+#define ARENA_MAX_SMALL 256
+#define ARENA_SMALL_CLASSES (ARENA_MAX_SMALL >> ARENA_CLASS_SHIFT)
+#define ARENA_MEDIUM_MIN_BITS 9 // 512
+#define ARENA_MEDIUM_MAX_BITS 14
+#define ARENA_MAX_MEDIUM (1 << ARENA_MEDIUM_MAX_BITS)
+#define ARENA_CLASSES (ARENA_SMALL_CLASSES + ARENA_MEDIUM_MAX_BITS - ARENA_MEDIUM_MIN_BITS + 1)
+#define ARENA_MAP_HEADER 16 // holds the mapping length of individually mmap'ed allocations
+
+typedef struct ArenaSlab {
+    uint32_t obj_size;
+} ArenaSlab;
+
+typedef struct Arena {
+    struct Arena *next, *prev; // all arenas, guarded by arena_mutex
+    int isolated;
+    size_t max_slab_alloc; // larger allocations don't come from slabs
+    void *free_list[ARENA_CLASSES];
+    uint8_t *bump[ARENA_CLASSES], *bump_end[ARENA_CLASSES]; // unused part of the newest slab
+    uintptr_t *slabs; // hash set of slab bases
+    size_t slab_count, slab_cap;
+    /* stats, written by the owning thread only, read by nativeGetAllocatorStats */
+    int64_t small_allocs, large_allocs;
+    int64_t small_bytes, large_bytes; // in use
+    int64_t mapped_bytes; // isolated arenas: slabs and large allocations
+} Arena;
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Arena arena_list = { &arena_list, &arena_list };
+static int64_t arena_count; // guarded by arena_mutex, as are the totals of freed arenas below
+static int64_t arena_freed_small_allocs, arena_freed_large_allocs;
+
+#define ARENA_STAT_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+static force_inline size_t arena_slab_hash(Arena *a, uintptr_t base)
+{
+    return (size_t)(((uint64_t)base >> 16) * 0x9e3779b97f4a7c15ULL >> 32) & (a->slab_cap - 1);
+}
+
+static force_inline int arena_is_slab(Arena *a, uintptr_t base)
+{
+    if (unlikely(!a->slab_cap))
+        return 0;
+    for (size_t i = arena_slab_hash(a, base);; i = (i + 1) & (a->slab_cap - 1)) {
+        if (a->slabs[i] == base)
+            return 1;
+        if (!a->slabs[i])
+            return 0;
+    }
+}
+
+static int arena_add_slab(Arena *a, uintptr_t base)
+{
+    if ((a->slab_count + 1) * 2 > a->slab_cap) {
+        size_t old_cap = a->slab_cap;
+        uintptr_t *old = a->slabs;
+        size_t cap = old_cap? old_cap * 2 : 64;
+        uintptr_t *slabs = calloc(cap, sizeof(uintptr_t));
+        if (!slabs)
+            return -1;
+        a->slabs = slabs;
+        a->slab_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i]) {
+                size_t j = arena_slab_hash(a, old[i]);
+                while (slabs[j])
+                    j = (j + 1) & (cap - 1);
+                slabs[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t i = arena_slab_hash(a, base);
+    while (a->slabs[i])
+        i = (i + 1) & (a->slab_cap - 1);
+    a->slabs[i] = base;
+    ARENA_STAT_ADD(a->slab_count, 1);
+    return 0;
+}
+
+static force_inline size_t arena_class(size_t size)
+{
+    if (likely(size <= ARENA_MAX_SMALL))
+        return (size - 1) >> ARENA_CLASS_SHIFT;
+    int bits = 64 - __builtin_clzll(size - 1); // round up to a power of two
+    return ARENA_SMALL_CLASSES + (bits < ARENA_MEDIUM_MIN_BITS? 0 : bits - ARENA_MEDIUM_MIN_BITS);
+}
+
+static force_inline size_t arena_class_size(size_t cls)
+{
+    if (likely(cls < ARENA_SMALL_CLASSES))
+        return (cls + 1) << ARENA_CLASS_SHIFT;
+    return (size_t)1 << (cls - ARENA_SMALL_CLASSES + ARENA_MEDIUM_MIN_BITS);
+}
+
+/* mmap len bytes aligned to align (a power of two no less than the page size) */
+static void *arena_map(size_t len, size_t align)
+{
+    size_t map_len = len + align - getpagesize();
+    uint8_t *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    uint8_t *aligned = (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    if (p + map_len > aligned + len)
+        munmap(aligned + len, p + map_len - (aligned + len));
+    return aligned;
+}
+
+static void *arena_new_slab(Arena *a)
+{
+    void *slab;
+    if (a->isolated) {
+        if (!(slab = arena_map(ARENA_SLAB_SIZE, ARENA_SLAB_SIZE)))
+            return NULL;
+        ARENA_STAT_ADD(a->mapped_bytes, ARENA_SLAB_SIZE);
+    }
+    else if (posix_memalign(&slab, ARENA_SLAB_SIZE, ARENA_SLAB_SIZE))
+        return NULL;
+    return slab;
+}
+
+static void arena_free_slab(Arena *a, void *slab)
+{
+    if (a->isolated)
+        munmap(slab, ARENA_SLAB_SIZE);
+    else
+        free(slab);
+}
+
+/* Allocations beyond max_slab_alloc: malloc, or their own mapping in isolated arenas */
+static void *arena_alloc_large(Arena *a, size_t size, size_t *usable)
+{
+    if (!a->isolated) {
+        void *p = malloc(size);
+        *usable = p? malloc_usable_size(p) : 0;
+        return p;
+    }
+    size_t page = getpagesize();
+    size_t len = (size + ARENA_MAP_HEADER + page - 1) & ~(page - 1);
+    uint8_t *p = arena_map(len, page);
+    if (!p)
+        return NULL;
+    *(size_t *)p = len;
+    ARENA_STAT_ADD(a->mapped_bytes, len);
+    *usable = len - ARENA_MAP_HEADER;
+    return p + ARENA_MAP_HEADER;
+}
+
+static size_t arena_large_size(Arena *a, void *ptr)
+{
+    return a->isolated? *(size_t *)((uint8_t *)ptr - ARENA_MAP_HEADER) - ARENA_MAP_HEADER : malloc_usable_size(ptr);
+}
+
+static void arena_free_large(Arena *a, void *ptr)
+{
+    if (!a->isolated) {
+        free(ptr);
+        return;
+    }
+    uint8_t *p = (uint8_t *)ptr - ARENA_MAP_HEADER;
+    size_t len = *(size_t *)p;
+    ARENA_STAT_ADD(a->mapped_bytes, -(int64_t)len);
+    munmap(p, len);
+}
+
+static void *arena_alloc_small(Arena *a, size_t cls)
+{
+    void *p = a->free_list[cls];
+    if (likely(p != NULL)) {
+        a->free_list[cls] = *(void **)p;
+        return p;
+    }
+    size_t obj_size = arena_class_size(cls);
+    if (unlikely(a->bump[cls] + obj_size > a->bump_end[cls])) {
+        void *slab = arena_new_slab(a);
+        if (!slab)
+            return NULL;
+        if (arena_add_slab(a, (uintptr_t)slab) < 0) {
+            arena_free_slab(a, slab);
+            return NULL;
+        }
+        ((ArenaSlab *)slab)->obj_size = obj_size;
+        a->bump[cls] = (uint8_t *)slab + ARENA_SLAB_HEADER;
+        a->bump_end[cls] = (uint8_t *)slab + ARENA_SLAB_SIZE;
+    }
+    p = a->bump[cls];
+    a->bump[cls] += obj_size;
+    return p;
+}
+
+/* Size of an arena allocation, 0 if ptr was not allocated from a slab */
+static force_inline size_t arena_small_size(Arena *a, const void *ptr)
+{
+    uintptr_t base = (uintptr_t)ptr & ~(uintptr_t)(ARENA_SLAB_SIZE - 1);
+    return arena_is_slab(a, base)? ((ArenaSlab *)base)->obj_size : 0;
+}
+
+static void *arena_js_malloc(JSMallocState *s, size_t size)
+{
+    Arena *a = s->opaque;
+    if (unlikely(s->malloc_size + size > s->malloc_limit))
+        return NULL;
+    void *p;
+    size_t usable;
+    if (likely(size && size <= a->max_slab_alloc)) {
+        size_t cls = arena_class(size);
+        if (!(p = arena_alloc_small(a, cls)))
+            return NULL;
+        usable = arena_class_size(cls);
+        ARENA_STAT_ADD(a->small_allocs, 1);
+        ARENA_STAT_ADD(a->small_bytes, usable);
+    } else {
+        if (!(p = arena_alloc_large(a, size, &usable)))
+            return NULL;
+        ARENA_STAT_ADD(a->large_allocs, 1);
+        ARENA_STAT_ADD(a->large_bytes, usable);
+    }
+    s->malloc_count++;
+    s->malloc_size += usable;
+    return p;
+}
+
+static void arena_js_free(JSMallocState *s, void *ptr)
+{
+    Arena *a = s->opaque;
+    if (!ptr)
+        return;
+    size_t size = arena_small_size(a, ptr);
+    if (likely(size)) {
+        size_t cls = arena_class(size);
+        *(void **)ptr = a->free_list[cls];
+        a->free_list[cls] = ptr;
+        ARENA_STAT_ADD(a->small_bytes, -(int64_t)size);
+    } else {
+        size = arena_large_size(a, ptr);
+        ARENA_STAT_ADD(a->large_bytes, -(int64_t)size);
+        arena_free_large(a, ptr);
+    }
+    s->malloc_count--;
+    s->malloc_size -= size;
+}
+
+static void *arena_js_realloc(JSMallocState *s, void *ptr, size_t size)
+{
+    Arena *a = s->opaque;
+    if (!ptr)
+        return size? arena_js_malloc(s, size) : NULL;
+    if (!size) {
+        arena_js_free(s, ptr);
+        return NULL;
+    }
+    size_t old_size = arena_small_size(a, ptr);
+    if (!old_size && !a->isolated) { // stays with malloc, even if it shrinks
+        old_size = malloc_usable_size(ptr);
+        if (unlikely(s->malloc_size - old_size + size > s->malloc_limit))
+            return NULL;
+        void *p = realloc(ptr, size);
+        if (!p)
+            return NULL;
+        size_t new_size = malloc_usable_size(p);
+        ARENA_STAT_ADD(a->large_bytes, (int64_t)new_size - (int64_t)old_size);
+        s->malloc_size += new_size - old_size;
+        return p;
+    }
+    if (!old_size)
+        old_size = arena_large_size(a, ptr);
+    else if (size <= a->max_slab_alloc && arena_class(size) == arena_class(old_size))
+        return ptr;
+    if (size <= old_size && size > a->max_slab_alloc && old_size - size < (size_t)getpagesize())
+        return ptr; // large allocation shrinking by less than a page
+    void *p = arena_js_malloc(s, size);
+    if (!p)
+        return NULL;
+    memcpy(p, ptr, size < old_size? size : old_size);
+    arena_js_free(s, ptr);
+    return p;
+}
+
+/* Not known without the arena, QuickJS takes 0 as no slack */
+static size_t arena_js_malloc_usable_size(const void *ptr)
+{
+    return 0;
+}
+
+static const JSMallocFunctions arena_malloc_functions = {
+    arena_js_malloc,
+    arena_js_free,
+    arena_js_realloc,
+    arena_js_malloc_usable_size,
+};
+
+static Arena *new_arena(int isolated)
+{
+    Arena *a = calloc(1, sizeof(Arena));
+    if (!a)
+        return NULL;
+    a->isolated = isolated;
+    a->max_slab_alloc = isolated? ARENA_MAX_MEDIUM : ARENA_MAX_SMALL;
+    pthread_mutex_lock(&arena_mutex);
+    a->next = arena_list.next;
+    a->prev = &arena_list;
+    arena_list.next->prev = a;
+    arena_list.next = a;
+    arena_count++;
+    pthread_mutex_unlock(&arena_mutex);
+    return a;
+}
+
+/* Free all slabs of an arena whose runtime is gone */
+static void free_arena(Arena *a)
+{
+    pthread_mutex_lock(&arena_mutex);
+    a->prev->next = a->next;
+    a->next->prev = a->prev;
+    arena_count--;
+    arena_freed_small_allocs += a->small_allocs;
+    arena_freed_large_allocs += a->large_allocs;
+    pthread_mutex_unlock(&arena_mutex);
+    for (size_t i = 0; i < a->slab_cap; i++) {
+        if (a->slabs[i])
+            arena_free_slab(a, (void *)a->slabs[i]);
+    }
+    free(a->slabs);
+    free(a);
+}
+
+/* {arenas, slabs, slab bytes, small bytes in use, large bytes in use, small allocs, large allocs,
+   mapped bytes}, allocation counts include freed arenas */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetAllocatorStats(
+        JNIEnv *env, jclass cls)
+{
+    jlong stats[8] = { 0 };
+    pthread_mutex_lock(&arena_mutex);
+    stats[0] = arena_count;
+    stats[5] = arena_freed_small_allocs;
+    stats[6] = arena_freed_large_allocs;
+    for (Arena *a = arena_list.next; a != &arena_list; a = a->next) {
+        stats[1] += __atomic_load_n(&a->slab_count, __ATOMIC_RELAXED);
+        stats[3] += __atomic_load_n(&a->small_bytes, __ATOMIC_RELAXED);
+        stats[4] += __atomic_load_n(&a->large_bytes, __ATOMIC_RELAXED);
+        stats[5] += __atomic_load_n(&a->small_allocs, __ATOMIC_RELAXED);
+        stats[6] += __atomic_load_n(&a->large_allocs, __ATOMIC_RELAXED);
+        stats[7] += __atomic_load_n(&a->mapped_bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&arena_mutex);
+    stats[2] = stats[1] * ARENA_SLAB_SIZE;
+    jlongArray ret = (*env)->NewLongArray(env, sizeof(stats)/sizeof(stats[0]));
+    if (ret)
+        (*env)->SetLongArrayRegion(env, ret, 0, sizeof(stats)/sizeof(stats[0]), stats);
+    return ret;
+}
+
 /* Init JS runtime and load root module */
-JNIEXPORT jbyteArray JNICALL Java_org_scriptable_QuickJSConnector_nativeNewQJSRuntime(
-        JNIEnv *env, jclass cls, jstring filename, jstring mainFunc)
+JNIEXPORT jlong JNICALL Java_org_scriptable_QuickJSConnector_nativeNewQJSRuntime(
+        JNIEnv *env, jclass cls, jstring filename, jstring mainFunc, jboolean shared,
+        jlong memoryLimit, jlong gcThreshold, jlong maxStackSize, jint allocator, jclass hostClass,
+        jobjectArray hostFunctions)
 {
-    JSRuntime *rt = JS_NewRuntime();
+    int64_t start = get_time_ns();
+    uintptr_t stack_top = (uintptr_t)__builtin_frame_address(0); // QuickJS's base is a little below
+    init_log();
+    Arena *arena = allocator == ALLOCATOR_ARENA || allocator == ALLOCATOR_ISOLATED?
+        new_arena(allocator == ALLOCATOR_ISOLATED) : NULL;
+    JSRuntime *rt = arena? JS_NewRuntime2(&arena_malloc_functions, arena) : JS_NewRuntime();
     JSContext *ctx = NULL;
-    jbyteArray ret = NULL;
+    QJSHandle *qjs = NULL;
+    jlong ret = 0;
     if (unlikely(!rt)) {
         fprintf(stdout, "Error: cannot allocate JS runtime\n");
         goto release_runtime;
@@ -70,16 +934,52 @@ JNIEXPORT jbyteArray JNICALL Java_org_scriptable_QuickJSConnector_nativeNewQJSRu
     }
 
     JS_SetCanBlock(rt, 1);
-    JS_SetModuleLoaderFunc(rt, NULL, js_module_loader, NULL); // loader for ES6 modules
+    if (memoryLimit > 0)
+        JS_SetMemoryLimit(rt, (size_t)memoryLimit);
+    if (gcThreshold > 0)
+        JS_SetGCThreshold(rt, (size_t)gcThreshold);
+    /* the stack overflow check is relative to the stack of the creating thread, that of a shared
+       runtime is moved to the calling thread's stack by each call, see anchor_stack_limit */
+    size_t stack_size = maxStackSize > 0? (size_t)maxStackSize : DEFAULT_STACK_SIZE;
+    if (shared || maxStackSize > 0)
+        JS_SetMaxStackSize(ctx, stack_size);
+    JS_SetModuleLoaderFunc(rt, NULL, js_cached_module_loader, NULL); // loader for ES6 modules
 
     /* init console.log here rather than call js_std_add_helpers (thread safety concerns) */
     JSValue global_obj = JS_GetGlobalObject(ctx);
     JSValue console = JS_NewObject(ctx);
     JS_DefinePropertyValueStr(ctx, console, "log",
-                      JS_NewCFunction(ctx, js_print, "log", 1), 0);
+                      JS_NewCFunctionMagic(ctx, js_print, "log", 1, JS_CFUNC_generic_magic, LOG_INFO), 0);
+    JS_DefinePropertyValueStr(ctx, console, "info",
+                      JS_NewCFunctionMagic(ctx, js_print, "info", 1, JS_CFUNC_generic_magic, LOG_INFO), 0);
+    JS_DefinePropertyValueStr(ctx, console, "warn",
+                      JS_NewCFunctionMagic(ctx, js_print, "warn", 1, JS_CFUNC_generic_magic, LOG_WARN), 0);
+    JS_DefinePropertyValueStr(ctx, console, "error",
+                      JS_NewCFunctionMagic(ctx, js_print, "error", 1, JS_CFUNC_generic_magic, LOG_ERROR), 0);
     JS_DefinePropertyValueStr(ctx, global_obj, "console", console, 0);
     JS_DefinePropertyValueStr(ctx, global_obj, "callJava",
                       JS_NewCFunction(ctx, js_call_java, "callJava", 1/* at least one param */), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaString",
+                      JS_NewCFunction(ctx, js_call_java_string, "callJavaString", 1), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaNumber",
+                      JS_NewCFunction(ctx, js_call_java_number, "callJavaNumber", 1), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaInt",
+                      JS_NewCFunction(ctx, js_call_java_int, "callJavaInt", 2), 0);
+    JSValue response = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, response, "write",
+                      JS_NewCFunction(ctx, js_response_write, "write", 1), 0);
+    JS_DefinePropertyValueStr(ctx, response, "flush",
+                      JS_NewCFunction(ctx, js_response_flush, "flush", 0), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "response", response, 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "callJavaAsync",
+                      JS_NewCFunction(ctx, js_call_java_async, "callJavaAsync", 1), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "setTimeout",
+                      JS_NewCFunction(ctx, js_set_timeout, "setTimeout", 2), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "clearTimeout",
+                      JS_NewCFunction(ctx, js_clear_timeout, "clearTimeout", 1), 0);
+    JS_DefinePropertyValueStr(ctx, global_obj, "snapshot",
+                      JS_NewCFunction(ctx, js_snapshot, "snapshot", 2), 0);
+    HostFunc *host_funcs = define_host_funcs(ctx, env, hostFunctions);
 
     /* system modules */
     js_init_module_std(ctx, "std");
@@ -87,341 +987,2494 @@ JNIEXPORT jbyteArray JNICALL Java_org_scriptable_QuickJSConnector_nativeNewQJSRu
 
     const char *_filename = (*env)->GetStringUTFChars(env, filename, NULL);
     const char *_main_func = (*env)->GetStringUTFChars(env, mainFunc, NULL);
-    int eret = eval_module(ctx, _filename);
+    char *stats_key = alloca(strlen(_filename) + strlen(_main_func) + 2);
+    sprintf(stats_key, "%s/%s", _filename, _main_func); // see QuickJSConnector.makeCtxKey
+    ScriptStats *stats = get_script_stats(stats_key, 1);
+    if (unlikely(!stats)) { // calls record their latencies in it without checking
+        fprintf(stdout, "Error: cannot allocate script stats\n");
+        (*env)->ReleaseStringUTFChars(env, mainFunc, _main_func);
+        (*env)->ReleaseStringUTFChars(env, filename, _filename);
+        JS_FreeValue(ctx, global_obj);
+        free(host_funcs);
+        goto release_runtime;
+    }
+    int eret = load_root_module(ctx, _filename);
     JSValue main_func = eret < 0? JS_UNDEFINED : JS_GetPropertyStr(ctx, global_obj, _main_func);
     if (!eret && !JS_IsFunction(ctx, main_func))
         JS_ThrowInternalError(ctx, "globalThis.%s function undefined", _main_func);
-    QJSHandle qjsCtx = { ctx, main_func };
-    ret = (*env)->NewByteArray(env, sizeof(QJSHandle));
-    (*env)->SetByteArrayRegion(env, ret, 0, sizeof(QJSHandle), (jbyte *)&qjsCtx);
-
     (*env)->ReleaseStringUTFChars(env, mainFunc, _main_func);
     (*env)->ReleaseStringUTFChars(env, filename, _filename);
     JS_FreeValue(ctx, global_obj);
+
+    qjs = malloc(sizeof(QJSHandle));
+    if (unlikely(!qjs)) {
+        JS_FreeValue(ctx, main_func);
+        free(host_funcs);
+        goto release_runtime;
+    }
+    qjs->ctx = ctx;
+    qjs->arena = arena;
+    qjs->main_func = main_func;
+    qjs->stats = stats;
+    qjs->deadline = 0;
+    qjs->timed_out = 0;
+    JS_SetInterruptHandler(rt, js_interrupt_handler, qjs);
+    global_obj = JS_GetGlobalObject(ctx);
+    qjs->array_buffer_ctor = JS_GetPropertyStr(ctx, global_obj, "ArrayBuffer");
+    qjs->map_ctor = JS_GetPropertyStr(ctx, global_obj, "Map");
+    qjs->set_ctor = JS_GetPropertyStr(ctx, global_obj, "Set");
+    qjs->host_funcs = host_funcs;
+    qjs->host_class = host_funcs? (jclass)(*env)->NewGlobalRef(env, hostClass) : NULL;
+    JSValue uint8_array_ctor = JS_GetPropertyStr(ctx, global_obj, "Uint8Array");
+    qjs->typed_array_ctor = JS_DupValue(ctx, JS_GetPrototype(ctx, uint8_array_ctor));
+    JS_FreeValue(ctx, uint8_array_ctor);
+    JS_FreeValue(ctx, global_obj);
+    qjs->last_result = JS_UNDEFINED;
+    qjs->last_cstr = NULL;
+    qjs->resp_buf = NULL;
+    qjs->resp_len = 0;
+    qjs->timers = NULL;
+    qjs->async_ops = NULL;
+    qjs->async_pending = 0;
+    qjs->next_async_id = 0;
+    qjs->completions = NULL;
+    qjs->stack_top = shared? stack_top : 0;
+    qjs->stack_size = stack_size;
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC); // same clock as get_time_ns()
+    pthread_cond_init(&qjs->async_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&qjs->async_mutex, NULL);
+    ret = new_handle(qjs);
+    if (unlikely(!ret)) {
+        fprintf(stdout, "Error: too many JS runtimes\n");
+        free_qjs_handle(qjs);
+        return 0;
+    }
     inc_instance_count();
-    fflush(stdout); // stdout not buffered
+    record_latency(&stats->create_ns, get_time_ns() - start);
     return ret;
 release_runtime:
     if (ctx)
         JS_FreeContext(ctx);
     if (rt)
         JS_FreeRuntime(rt);
-    return (*env)->NewByteArray(env, 0); // return zero-length array to indicate error
+    if (arena)
+        free_arena(arena);
+    return 0; // zero handle indicates error
 }
 
-JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeFreeQJSRuntime(
-        JNIEnv *env, jclass cls, jbyteArray jctx)
+static void free_last_result(QJSHandle *qjs)
 {
-    if (unlikely(!(*env)->GetArrayLength(env, jctx)))
-        return;
-    QJSHandle *qjs = (QJSHandle *)(*env)->GetByteArrayElements(env, jctx, NULL);
+    if (qjs->last_cstr) {
+        JS_FreeCString(qjs->ctx, qjs->last_cstr);
+        qjs->last_cstr = NULL;
+    }
+    JS_FreeValue(qjs->ctx, qjs->last_result);
+    qjs->last_result = JS_UNDEFINED;
+}
+
+static void free_qjs_handle(QJSHandle *qjs)
+{
+    int64_t start = get_time_ns();
+    ScriptStats *stats = qjs->stats;
     JSRuntime *rt = JS_GetRuntime(qjs->ctx);
+    free_last_result(qjs);
+    JS_FreeValue(qjs->ctx, qjs->array_buffer_ctor);
+    JS_FreeValue(qjs->ctx, qjs->map_ctor);
+    JS_FreeValue(qjs->ctx, qjs->set_ctor);
+    JS_FreeValue(qjs->ctx, qjs->typed_array_ctor);
     JS_FreeValue(qjs->ctx, qjs->main_func);
+    /* the handle is retired by now, wait for nativeCompleteJava calls that got past it */
+    pthread_mutex_lock(&async_post_mutex);
+    pthread_mutex_unlock(&async_post_mutex);
+    JNIEnv *env; // runtimes are freed on threads known to the JVM, see free_java_buffer
+    if ((*java_vm)->GetEnv(java_vm, (void **)&env, JNI_VERSION_1_6) == JNI_OK) {
+        if (qjs->host_class)
+            (*env)->DeleteGlobalRef(env, qjs->host_class);
+        drop_async_completions(env, qjs); // posted after their call returned
+    }
+    free(qjs->host_funcs);
+    free(qjs->resp_buf);
+    pthread_mutex_destroy(&qjs->async_mutex);
+    pthread_cond_destroy(&qjs->async_cond);
     JS_FreeContext(qjs->ctx);
     JS_FreeRuntime(rt);
-    (*env)->ReleaseByteArrayElements(env, jctx, (signed char *)qjs, 0);
-    dec_instance_count();
-    fflush(stdout);
+    if (qjs->arena)
+        free_arena(qjs->arena);
+    free(qjs);
+    record_latency(&stats->destroy_ns, get_time_ns() - start);
 }
 
-static force_inline JSValue newJSString(JSContext *ctx, JNIEnv *env, jstring jarg)
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeFreeQJSRuntime(
+        JNIEnv *env, jclass cls, jlong handle)
 {
-    char *carg = (char *)(*env)->GetStringUTFChars(env, jarg, NULL);
-    JSValue val = JS_NewStringLen(ctx, carg, (*env)->GetStringUTFLength(env, jarg));
-    (*env)->ReleaseStringUTFChars(env, jarg, carg);
-    return val;
+    QJSHandle *qjs = free_handle(handle);
+    if (!qjs)
+        return; // already freed, or will be freed by the thread using it
+    free_qjs_handle(qjs);
+    dec_instance_count();
 }
 
-typedef struct JavaHandle {
-    JNIEnv *env;
-    jobject thisObject;
-    jmethodID callJava;
-    jclass objectClass;
-    jmethodID objectToString;
-    jclass integerClass;
-    jmethodID integerConstr;
-    jclass doubleClass;
-    jmethodID doubleConstr;
-    jclass numberClass;
-    jmethodID numberDoubleValue;
-    jclass stringClass;
-    jclass objectArrayClass;
-} JavaHandle;
+/*
+ * Java string bridge. Java strings are UTF-16 and QuickJS takes and returns standard UTF-8
+ * through its API, so strings are transcoded here directly rather than through Get/NewStringUTF:
+ * that saves the JVM's intermediate copy, and its modified UTF-8 splits supplementary characters
+ * into surrogate pairs QuickJS doesn't join. ASCII runs, which make up most text including markup
+ * around Cyrillic, are narrowed and widened 16 characters at a time
+ */
+#define STRING_STACK_CHARS 256 // shorter Java strings are read into a stack buffer, longer ones in place
 
-static JSValue newJSArray(JSContext *ctx, JNIEnv *env, JavaHandle *javaCtx, jobjectArray jarr, int *depth)
+/* Number of leading ASCII chars in src, written narrowed to dst */
+static force_inline size_t narrow_ascii(uint8_t *dst, const jchar *src, size_t len)
 {
-    int len = jarr? (*env)->GetArrayLength(env, jarr) : 0;
-    JSValue ret = JS_NewArray(ctx);
-    for (int i = 0; i < len; i++) {
-        jobject jobj = (*env)->GetObjectArrayElement(env, jarr, i);
-        if (likely((*env)->IsInstanceOf(env, jobj, javaCtx->stringClass))) {
-            JS_SetPropertyUint32(ctx, ret, i, newJSString(ctx, env, (jstring)jobj));
-        }
-        else if ((*env)->IsInstanceOf(env, jobj, javaCtx->numberClass)) {
-            jdouble jdbl = (*env)->CallDoubleMethod(env, jobj, javaCtx->numberDoubleValue);
-            JS_SetPropertyUint32(ctx, ret, i, JS_NewFloat64(ctx, jdbl));
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16((short)0xff80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        __m128i high = _mm_and_si128(_mm_or_si128(a, b), mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xffff)
+            break;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+#else
+    for (; i + 4 <= len; i += 4) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        if (w & 0xff80ff80ff80ff80ULL)
+            break;
+        dst[i] = src[i];
+        dst[i + 1] = src[i + 1];
+        dst[i + 2] = src[i + 2];
+        dst[i + 3] = src[i + 3];
+    }
+#endif
+    for (; i < len && src[i] < 0x80; i++)
+        dst[i] = (uint8_t)src[i];
+    return i;
+}
+
+/* Number of leading ASCII bytes in src, written widened to dst */
+static force_inline size_t widen_ascii(jchar *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(v))
+            break;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(v, zero));
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        if (w & 0x8080808080808080ULL)
+            break;
+        for (int j = 0; j < 8; j++)
+            dst[i + j] = src[i + j];
+    }
+#endif
+    for (; i < len && src[i] < 0x80; i++)
+        dst[i] = src[i];
+    return i;
+}
+
+/* UTF-16 to UTF-8, dst must have room for 3 bytes per char. Lone surrogates are encoded
+   as 3 bytes, as QuickJS does */
+static size_t utf16_to_utf8(uint8_t *dst, const jchar *src, size_t len)
+{
+    uint8_t *p = dst;
+    size_t i = 0;
+    for (;;) {
+        size_t n = narrow_ascii(p, src + i, len - i);
+        p += n;
+        i += n;
+        if (i == len)
+            break;
+        uint32_t c = src[i++];
+        if (c < 0x800) {
+            *p++ = 0xc0 | (c >> 6);
+            *p++ = 0x80 | (c & 0x3f);
+        } else if (c >= 0xd800 && c < 0xdc00 && i < len && src[i] >= 0xdc00 && src[i] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (src[i++] - 0xdc00);
+            *p++ = 0xf0 | (c >> 18);
+            *p++ = 0x80 | ((c >> 12) & 0x3f);
+            *p++ = 0x80 | ((c >> 6) & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        } else {
+            *p++ = 0xe0 | (c >> 12);
+            *p++ = 0x80 | ((c >> 6) & 0x3f);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+    }
+    return p - dst;
+}
+
+/* UTF-8 as produced by QuickJS to UTF-16, dst must have room for len chars.
+   Malformed sequences become U+FFFD */
+static size_t utf8_to_utf16(jchar *dst, const uint8_t *src, size_t len)
+{
+    jchar *p = dst;
+    size_t i = 0;
+    for (;;) {
+        size_t n = widen_ascii(p, src + i, len - i);
+        p += n;
+        i += n;
+        if (i == len)
+            break;
+        uint32_t c = src[i++];
+        int extra = c >= 0xf0? 3 : c >= 0xe0? 2 : c >= 0xc0? 1 : -1;
+        if (unlikely(extra < 0 || len - i < (size_t)extra)) {
+            *p++ = 0xfffd;
+            continue;
+        }
+        c &= 0x3f >> extra;
+        for (int j = 0; j < extra; j++)
+            c = (c << 6) | (src[i++] & 0x3f);
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            *p++ = 0xd800 | (c >> 10);
+            *p++ = 0xdc00 | (c & 0x3ff);
+        } else {
+            *p++ = c;
+        }
+    }
+    return p - dst;
+}
+
+/* UTF-8 of jstr in buf if it fits (3 bytes per char), else in malloc'ed memory. Free the
+   result with release_string_utf8. NULL if out of memory */
+static char *get_string_utf8(JNIEnv *env, jstring jstr, char *buf, size_t buf_size, size_t *plen)
+{
+    jsize len = (*env)->GetStringLength(env, jstr);
+    char *dst = (size_t)len * 3 <= buf_size? buf : malloc((size_t)len * 3 + 1);
+    if (unlikely(!dst))
+        return NULL;
+    if (len <= STRING_STACK_CHARS) {
+        jchar chars[STRING_STACK_CHARS];
+        (*env)->GetStringRegion(env, jstr, 0, len, chars);
+        *plen = utf16_to_utf8((uint8_t *)dst, chars, len);
+        return dst;
+    }
+    const jchar *chars = (*env)->GetStringCritical(env, jstr, NULL);
+    if (unlikely(!chars)) {
+        if (dst != buf)
+            free(dst);
+        return NULL;
+    }
+    *plen = utf16_to_utf8((uint8_t *)dst, chars, len);
+    (*env)->ReleaseStringCritical(env, jstr, chars);
+    return dst;
+}
+
+static force_inline void release_string_utf8(char *str, char *buf)
+{
+    if (str != buf)
+        free(str);
+}
+
+static JSValue newJSString(JSContext *ctx, JNIEnv *env, jstring jarg)
+{
+    char buf[STRING_STACK_CHARS * 3];
+    size_t len;
+    char *str = get_string_utf8(env, jarg, buf, sizeof(buf), &len);
+    if (unlikely(!str))
+        return JS_ThrowOutOfMemory(ctx);
+    JSValue val = JS_NewStringLen(ctx, str, len);
+    release_string_utf8(str, buf);
+    return val;
+}
+
+/* Java string from UTF-8 returned by QuickJS */
+static jstring newJavaStringUTF8(JNIEnv *env, const char *str, size_t len)
+{
+    jchar buf[STRING_STACK_CHARS];
+    jchar *chars = len <= STRING_STACK_CHARS? buf : malloc(len * sizeof(jchar));
+    if (unlikely(!chars))
+        return NULL;
+    jstring ret = (*env)->NewString(env, chars, utf8_to_utf16(chars, (const uint8_t *)str, len));
+    if (chars != buf)
+        free(chars);
+    return ret;
+}
+
+/* Classes and method IDs used on every call, resolved once in JNI_OnLoad */
+typedef struct JavaRefs {
+    jclass connectorClass;
+    jmethodID callJava;
+    jmethodID callJavaString;
+    jmethodID callJavaNumber;
+    jmethodID callJavaInt;
+    jclass objectClass;
+    jmethodID objectToString;
+    jclass integerClass;
+    jmethodID integerConstr;
+    jclass doubleClass;
+    jmethodID doubleConstr;
+    jclass numberClass;
+    jmethodID numberDoubleValue;
+    jclass stringClass;
+    jclass objectArrayClass;
+    jclass mapClass;
+    jclass collectionClass;
+    jmethodID collectionToArray;
+    jmethodID collectionAdd;
+    jclass linkedHashMapClass;
+    jmethodID linkedHashMapConstr;
+    jmethodID mapPut;
+    jclass linkedHashSetClass;
+    jmethodID linkedHashSetConstr;
+    jmethodID mapEntries;
+    jclass byteBufferClass;
+    jclass byteArrayClass;
+    jmethodID bufferPosition;
+    jmethodID bufferLimitGet;
+    jmethodID remainingBytes;
+    jclass illegalStateExceptionClass;
+    jmethodID bufferLimit;
+    jmethodID writeResponse;
+    jmethodID startJavaAsync;
+    jmethodID logBatch;
+    jobject jsException; // QuickJSConnector.JS_EXCEPTION, returned when the call threw
+    jobject jsTimeout; // QuickJSConnector.JS_TIMEOUT, returned when the call ran out of time
+} JavaRefs;
+
+static JavaRefs jrefs;
+
+/* Per call state, set as JS context opaque for the duration of nativeCallQJS */
+typedef struct JavaHandle {
+    JNIEnv *env;
+    jobject thisObject;
+    QJSHandle *qjs;
+    jobject sink; // OutputStream or WritableByteChannel for response.write(), may be NULL
+    jlong handle;
+    int async;
+    int call_id; // async call sequence number, to ignore promises of earlier calls settling
+    int settled; // 1 if main function's promise was fulfilled, 2 if rejected
+    JSValue settled_value;
+} JavaHandle;
+
+static jclass find_global_class(JNIEnv *env, const char *name)
+{
+    jclass cls = (*env)->FindClass(env, name);
+    if (!cls) {
+        fprintf(stdout, "quickjs: class %s not found\n", name);
+        return NULL;
+    }
+    jclass ret = (jclass)(*env)->NewGlobalRef(env, cls);
+    (*env)->DeleteLocalRef(env, cls);
+    return ret;
+}
+
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved)
+{
+    JNIEnv *env;
+    if ((*vm)->GetEnv(vm, (void **)&env, JNI_VERSION_1_6) != JNI_OK)
+        return JNI_ERR;
+    if (!(jrefs.connectorClass = find_global_class(env, "org/scriptable/QuickJSConnector")) ||
+            !(jrefs.objectClass = find_global_class(env, "java/lang/Object")) ||
+            !(jrefs.integerClass = find_global_class(env, "java/lang/Integer")) ||
+            !(jrefs.doubleClass = find_global_class(env, "java/lang/Double")) ||
+            !(jrefs.numberClass = find_global_class(env, "java/lang/Number")) ||
+            !(jrefs.stringClass = find_global_class(env, "java/lang/String")) ||
+            !(jrefs.objectArrayClass = find_global_class(env, "[Ljava/lang/Object;")) ||
+            !(jrefs.mapClass = find_global_class(env, "java/util/Map")) ||
+            !(jrefs.collectionClass = find_global_class(env, "java/util/Collection")) ||
+            !(jrefs.linkedHashMapClass = find_global_class(env, "java/util/LinkedHashMap")) ||
+            !(jrefs.linkedHashSetClass = find_global_class(env, "java/util/LinkedHashSet")) ||
+            !(jrefs.byteBufferClass = find_global_class(env, "java/nio/ByteBuffer")) ||
+            !(jrefs.byteArrayClass = find_global_class(env, "[B")) ||
+            !(jrefs.illegalStateExceptionClass = find_global_class(env, "java/lang/IllegalStateException")))
+        return JNI_ERR;
+    jrefs.callJava = (*env)->GetMethodID(env, jrefs.connectorClass, "callJava",
+            "([Ljava/lang/Object;)[Ljava/lang/Object;");
+    if (!jrefs.callJava) {
+        fprintf(stdout, "quickjs: method Object[] callJava(Object[]) undefined\n");
+        return JNI_ERR;
+    }
+    jrefs.callJavaString = (*env)->GetMethodID(env, jrefs.connectorClass, "callJavaString",
+            "(Ljava/lang/String;)Ljava/lang/String;");
+    jrefs.callJavaNumber = (*env)->GetMethodID(env, jrefs.connectorClass, "callJavaNumber",
+            "(Ljava/lang/String;)D");
+    jrefs.callJavaInt = (*env)->GetMethodID(env, jrefs.connectorClass, "callJavaInt", "(II)I");
+    if (!jrefs.callJavaString || !jrefs.callJavaNumber || !jrefs.callJavaInt) {
+        fprintf(stdout, "quickjs: typed callJava methods undefined\n");
+        return JNI_ERR;
+    }
+    jrefs.objectToString = (*env)->GetMethodID(env, jrefs.objectClass, "toString", "()Ljava/lang/String;");
+    jrefs.integerConstr = (*env)->GetMethodID(env, jrefs.integerClass, "<init>", "(I)V");
+    jrefs.doubleConstr = (*env)->GetMethodID(env, jrefs.doubleClass, "<init>", "(D)V");
+    jrefs.numberDoubleValue = (*env)->GetMethodID(env, jrefs.numberClass, "doubleValue", "()D");
+    if (!jrefs.objectToString || !jrefs.integerConstr || !jrefs.doubleConstr || !jrefs.numberDoubleValue)
+        return JNI_ERR;
+    jrefs.collectionToArray = (*env)->GetMethodID(env, jrefs.collectionClass, "toArray", "()[Ljava/lang/Object;");
+    jrefs.collectionAdd = (*env)->GetMethodID(env, jrefs.collectionClass, "add", "(Ljava/lang/Object;)Z");
+    jrefs.mapPut = (*env)->GetMethodID(env, jrefs.mapClass, "put",
+            "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+    jrefs.linkedHashMapConstr = (*env)->GetMethodID(env, jrefs.linkedHashMapClass, "<init>", "()V");
+    jrefs.linkedHashSetConstr = (*env)->GetMethodID(env, jrefs.linkedHashSetClass, "<init>", "()V");
+    jrefs.mapEntries = (*env)->GetStaticMethodID(env, jrefs.connectorClass, "mapEntries",
+            "(Ljava/util/Map;)[Ljava/lang/Object;");
+    if (!jrefs.collectionToArray || !jrefs.collectionAdd || !jrefs.mapPut || !jrefs.linkedHashMapConstr ||
+            !jrefs.linkedHashSetConstr || !jrefs.mapEntries)
+        return JNI_ERR;
+    jclass bufferClass = (*env)->FindClass(env, "java/nio/Buffer");
+    if (!bufferClass)
+        return JNI_ERR;
+    jrefs.bufferLimit = (*env)->GetMethodID(env, bufferClass, "limit", "(I)Ljava/nio/Buffer;");
+    jrefs.bufferLimitGet = (*env)->GetMethodID(env, bufferClass, "limit", "()I");
+    jrefs.bufferPosition = (*env)->GetMethodID(env, bufferClass, "position", "()I");
+    (*env)->DeleteLocalRef(env, bufferClass);
+    jrefs.writeResponse = (*env)->GetStaticMethodID(env, jrefs.connectorClass, "writeResponse",
+            "(Ljava/lang/Object;Ljava/nio/ByteBuffer;Z)V");
+    if (!jrefs.writeResponse) {
+        fprintf(stdout, "quickjs: method static void writeResponse(Object, ByteBuffer, boolean) undefined\n");
+        return JNI_ERR;
+    }
+    jrefs.startJavaAsync = (*env)->GetStaticMethodID(env, jrefs.connectorClass, "startJavaAsync",
+            "(Lorg/scriptable/QuickJSConnector;[Ljava/lang/Object;JI)V");
+    if (!jrefs.startJavaAsync) {
+        fprintf(stdout, "quickjs: method static void startJavaAsync(QuickJSConnector, Object[], long, int) undefined\n");
+        return JNI_ERR;
+    }
+    jrefs.logBatch = (*env)->GetStaticMethodID(env, jrefs.connectorClass, "logBatch",
+            "(I[I[J[I[Ljava/lang/String;[Ljava/lang/String;)V");
+    if (!jrefs.logBatch) {
+        fprintf(stdout, "quickjs: method static void logBatch(int, int[], long[], int[], String[], String[]) undefined\n");
+        return JNI_ERR;
+    }
+    java_vm = vm;
+    jfieldID jsExceptionField = (*env)->GetStaticFieldID(env, jrefs.connectorClass,
+            "JS_EXCEPTION", "Ljava/lang/Object;");
+    jfieldID jsTimeoutField = (*env)->GetStaticFieldID(env, jrefs.connectorClass,
+            "JS_TIMEOUT", "Ljava/lang/Object;");
+    jrefs.remainingBytes = (*env)->GetStaticMethodID(env, jrefs.connectorClass, "remainingBytes",
+            "(Ljava/nio/ByteBuffer;)[B");
+    if (!jrefs.bufferLimit || !jrefs.bufferLimitGet || !jrefs.bufferPosition || !jrefs.remainingBytes ||
+            !jsExceptionField || !jsTimeoutField)
+        return JNI_ERR;
+    jobject jsException = (*env)->GetStaticObjectField(env, jrefs.connectorClass, jsExceptionField);
+    jrefs.jsException = (*env)->NewGlobalRef(env, jsException);
+    (*env)->DeleteLocalRef(env, jsException);
+    jobject jsTimeout = (*env)->GetStaticObjectField(env, jrefs.connectorClass, jsTimeoutField);
+    jrefs.jsTimeout = (*env)->NewGlobalRef(env, jsTimeout);
+    (*env)->DeleteLocalRef(env, jsTimeout);
+    return JNI_VERSION_1_6;
+}
+
+JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *vm, void *reserved)
+{
+    JNIEnv *env;
+    if ((*vm)->GetEnv(vm, (void **)&env, JNI_VERSION_1_6) != JNI_OK)
+        return;
+    jclass *classes[] = { &jrefs.connectorClass, &jrefs.objectClass, &jrefs.integerClass,
+        &jrefs.doubleClass, &jrefs.numberClass, &jrefs.stringClass, &jrefs.objectArrayClass,
+        &jrefs.mapClass, &jrefs.collectionClass, &jrefs.linkedHashMapClass, &jrefs.linkedHashSetClass,
+        &jrefs.byteBufferClass, &jrefs.byteArrayClass, &jrefs.illegalStateExceptionClass };
+    for (int i = 0; i < sizeof(classes)/sizeof(classes[0]); i++) {
+        if (*classes[i])
+            (*env)->DeleteGlobalRef(env, *classes[i]);
+        *classes[i] = NULL;
+    }
+    if (jrefs.jsException)
+        (*env)->DeleteGlobalRef(env, jrefs.jsException);
+    if (jrefs.jsTimeout)
+        (*env)->DeleteGlobalRef(env, jrefs.jsTimeout);
+    jrefs.jsException = jrefs.jsTimeout = NULL;
+}
+
+/*
+ * QuickJS measures stack depth from the stack pointer of the thread that created the runtime, and
+ * this version has no call to move that base. A shared runtime runs on whatever thread borrowed it,
+ * so its maximum size is set to the distance from the base to the current frame plus stack_size,
+ * in wrapping arithmetic: the check then fires about stack_size bytes below the caller's frame
+ */
+static force_inline void anchor_stack_limit(QJSHandle *qjs)
+{
+    if (qjs->stack_top)
+        JS_SetMaxStackSize(qjs->ctx, qjs->stack_top - (uintptr_t)__builtin_frame_address(0) + qjs->stack_size);
+}
+
+/* Acquire runtime for the current call, throw IllegalStateException if that's not possible */
+static QJSHandle *acquire_handle_or_throw(JNIEnv *env, jlong handle)
+{
+    int busy;
+    QJSHandle *qjs = acquire_handle(handle, &busy);
+    if (unlikely(!qjs))
+        (*env)->ThrowNew(env, jrefs.illegalStateExceptionClass, busy?
+                "quickjs runtime is in use by another thread" : "quickjs runtime has been released");
+    else
+        anchor_stack_limit(qjs);
+    return qjs;
+}
+
+/* Throw JS InternalError with the message of Java exception e */
+static void throw_java_error(JSContext *ctx, JNIEnv *env, jthrowable e)
+{
+    jstring msg = (jstring)(*env)->CallObjectMethod(env, e, jrefs.objectToString);
+    const char *str = msg && !(*env)->ExceptionCheck(env)? (*env)->GetStringUTFChars(env, msg, NULL) : NULL;
+    (*env)->ExceptionClear(env);
+    JS_ThrowInternalError(ctx, "%s", str? str : "Java exception");
+    if (str)
+        (*env)->ReleaseStringUTFChars(env, msg, str);
+    (*env)->DeleteLocalRef(env, msg);
+}
+
+/* If Java code called from JS threw, clear it and rethrow as JS InternalError, return -1 in that case */
+static int rethrow_java_exception(JSContext *ctx, JNIEnv *env)
+{
+    if (likely(!(*env)->ExceptionCheck(env)))
+        return 0;
+    jthrowable e = (*env)->ExceptionOccurred(env);
+    (*env)->ExceptionClear(env);
+    throw_java_error(ctx, env, e);
+    (*env)->DeleteLocalRef(env, e);
+    return -1;
+}
+
+static JSValue newJSArray(JSContext *ctx, JNIEnv *env, jobjectArray jarr, int *depth);
+static JSValue newJSObject(JSContext *ctx, JNIEnv *env, jobject jmap, int *depth);
+static JSValue newJSArrayBuffer(JSContext *ctx, JNIEnv *env, jobject jbuf);
+static jobject newJavaObject(JSContext *ctx, JNIEnv *env, JSValueConst val, int *depth);
+
+static JSValue newJSValue(JSContext *ctx, JNIEnv *env, jobject jobj, int *depth)
+{
+    JSValue ret = JS_UNDEFINED;
+    if (unlikely(!jobj))
+        ret = JS_NULL;
+    else if (likely((*env)->IsInstanceOf(env, jobj, jrefs.stringClass))) {
+        ret = newJSString(ctx, env, (jstring)jobj);
+    }
+    else if ((*env)->IsInstanceOf(env, jobj, jrefs.numberClass)) {
+        jdouble jdbl = (*env)->CallDoubleMethod(env, jobj, jrefs.numberDoubleValue);
+        ret = JS_NewFloat64(ctx, jdbl);
+    }
+    else if ((*env)->IsInstanceOf(env, jobj, jrefs.objectArrayClass)) {
+        if (unlikely(*depth > 100))
+            fprintf(stdout, "newJSArray: too many nested arrays, circular ref?\n");
+        else {
+            ++*depth;
+            ret = newJSArray(ctx, env, (jobjectArray)jobj, depth);
+            --*depth;
+        }
+    }
+    else if ((*env)->IsInstanceOf(env, jobj, jrefs.mapClass)) {
+        if (unlikely(*depth > 100))
+            fprintf(stdout, "newJSObject: too many nested maps, circular ref?\n");
+        else {
+            ++*depth;
+            ret = newJSObject(ctx, env, jobj, depth);
+            --*depth;
+        }
+    }
+    else if ((*env)->IsInstanceOf(env, jobj, jrefs.byteBufferClass) ||
+            (*env)->IsInstanceOf(env, jobj, jrefs.byteArrayClass)) {
+        ret = newJSArrayBuffer(ctx, env, jobj);
+    }
+    else if ((*env)->IsInstanceOf(env, jobj, jrefs.collectionClass)) { // List, Set...
+        if (unlikely(*depth > 100))
+            fprintf(stdout, "newJSArray: too many nested collections, circular ref?\n");
+        else {
+            jobjectArray jarr = (jobjectArray)(*env)->CallObjectMethod(env, jobj, jrefs.collectionToArray);
+            ++*depth;
+            ret = newJSArray(ctx, env, jarr, depth);
+            --*depth;
+            (*env)->DeleteLocalRef(env, jarr);
+        }
+    }
+    else {
+        jobject jstr = (*env)->CallObjectMethod(env, jobj, jrefs.objectToString);
+        ret = newJSString(ctx, env, (jstring)jstr);
+        (*env)->DeleteLocalRef(env, jstr);
+    }
+    return ret;
+}
+
+static JSValue newJSArray(JSContext *ctx, JNIEnv *env, jobjectArray jarr, int *depth)
+{
+    int len = jarr? (*env)->GetArrayLength(env, jarr) : 0;
+    JSValue ret = JS_NewArray(ctx);
+    for (int i = 0; i < len; i++) {
+        jobject jobj = (*env)->GetObjectArrayElement(env, jarr, i);
+        JS_SetPropertyUint32(ctx, ret, i, newJSValue(ctx, env, jobj, depth));
+        (*env)->DeleteLocalRef(env, jobj);
+    }
+    return ret;
+}
+
+/* Release the ByteBuffer behind an ArrayBuffer. Runtimes are only freed on threads known to the
+   JVM, from calls or finalizers, so GetEnv succeeds */
+static void free_java_buffer(JSRuntime *rt, void *opaque, void *ptr)
+{
+    JNIEnv *env;
+    if (java_vm && (*java_vm)->GetEnv(java_vm, (void **)&env, JNI_VERSION_1_6) == JNI_OK)
+        (*env)->DeleteGlobalRef(env, (jobject)opaque);
+}
+
+/* ArrayBuffer over the remaining bytes of a direct ByteBuffer, without copying. The buffer is
+   kept alive until the ArrayBuffer is collected. byte[] and heap buffers are copied once */
+static JSValue newJSArrayBuffer(JSContext *ctx, JNIEnv *env, jobject jbuf)
+{
+    uint8_t *p = NULL;
+    if ((*env)->IsInstanceOf(env, jbuf, jrefs.byteBufferClass) &&
+            (p = (*env)->GetDirectBufferAddress(env, jbuf))) {
+        jint pos = (*env)->CallIntMethod(env, jbuf, jrefs.bufferPosition);
+        jint lim = (*env)->CallIntMethod(env, jbuf, jrefs.bufferLimitGet);
+        jobject ref = (*env)->NewGlobalRef(env, jbuf);
+        if (unlikely(!ref))
+            return JS_ThrowOutOfMemory(ctx);
+        JSValue ret = JS_NewArrayBuffer(ctx, p + pos, lim - pos, free_java_buffer, ref, 0);
+        if (unlikely(JS_IsException(ret)))
+            (*env)->DeleteGlobalRef(env, ref);
+        return ret;
+    }
+    jbyteArray arr = (*env)->IsInstanceOf(env, jbuf, jrefs.byteArrayClass)? (jbyteArray)jbuf :
+        (jbyteArray)(*env)->CallStaticObjectMethod(env, jrefs.connectorClass, jrefs.remainingBytes, jbuf);
+    if (unlikely(!arr))
+        return JS_ThrowOutOfMemory(ctx);
+    jsize len = (*env)->GetArrayLength(env, arr);
+    void *bytes = (*env)->GetPrimitiveArrayCritical(env, arr, NULL);
+    JSValue ret = bytes? JS_NewArrayBufferCopy(ctx, bytes, len) : JS_ThrowOutOfMemory(ctx);
+    if (bytes)
+        (*env)->ReleasePrimitiveArrayCritical(env, arr, bytes, JNI_ABORT);
+    if (arr != jbuf)
+        (*env)->DeleteLocalRef(env, arr);
+    return ret;
+}
+
+/* Plain object with the entries of a java.util.Map, keys are converted to strings */
+static JSValue newJSObject(JSContext *ctx, JNIEnv *env, jobject jmap, int *depth)
+{
+    jobjectArray kv = (jobjectArray)(*env)->CallStaticObjectMethod(env, jrefs.connectorClass,
+            jrefs.mapEntries, jmap);
+    JSValue ret = JS_NewObject(ctx);
+    int len = kv? (*env)->GetArrayLength(env, kv) : 0;
+    for (int i = 0; i + 1 < len; i += 2) {
+        jobject jkey = (*env)->GetObjectArrayElement(env, kv, i);
+        if (jkey && !(*env)->IsInstanceOf(env, jkey, jrefs.stringClass)) {
+            jobject jstr = (*env)->CallObjectMethod(env, jkey, jrefs.objectToString);
+            (*env)->DeleteLocalRef(env, jkey);
+            jkey = jstr;
+        }
+        JSAtom atom;
+        if (jkey) {
+            char buf[STRING_STACK_CHARS * 3];
+            size_t key_len;
+            char *key = get_string_utf8(env, (jstring)jkey, buf, sizeof(buf), &key_len);
+            atom = key? JS_NewAtomLen(ctx, key, key_len) : JS_NewAtom(ctx, "");
+            release_string_utf8(key, buf);
+            (*env)->DeleteLocalRef(env, jkey);
+        } else {
+            atom = JS_NewAtom(ctx, "null");
+        }
+        jobject jval = (*env)->GetObjectArrayElement(env, kv, i + 1);
+        JS_DefinePropertyValue(ctx, ret, atom, newJSValue(ctx, env, jval, depth), JS_PROP_C_W_E);
+        JS_FreeAtom(ctx, atom);
+        (*env)->DeleteLocalRef(env, jval);
+    }
+    (*env)->DeleteLocalRef(env, kv);
+    return ret;
+}
+
+/*
+ * Tagged binary argument encoding written by QuickJSConnector.ArgBuffer, in native byte order:
+ * int32 argc followed by argc values, each a tag byte and its payload.
+ * Keep in sync with the tag constants in ArgBuffer.
+ */
+#define ARG_NULL   0
+#define ARG_FALSE  1
+#define ARG_TRUE   2
+#define ARG_INT    3 // int32
+#define ARG_DOUBLE 4 // float64
+#define ARG_STRING 5 // int32 byte length, UTF-8 bytes
+#define ARG_ARRAY  6 // int32 element count, elements
+#define ARG_BYTES  7 // int32 byte length, bytes, passed as an ArrayBuffer
+
+typedef struct ArgReader {
+    const uint8_t *p;
+    const uint8_t *end;
+} ArgReader;
+
+static force_inline int read_arg_int32(ArgReader *r, int32_t *v)
+{
+    if (unlikely(r->end - r->p < 4))
+        return -1;
+    memcpy(v, r->p, 4);
+    r->p += 4;
+    return 0;
+}
+
+static JSValue decodeJSValue(JSContext *ctx, ArgReader *r, int depth)
+{
+    int32_t i;
+    double d;
+    if (unlikely(r->p >= r->end))
+        goto truncated;
+    switch(*r->p++) {
+        case ARG_NULL:
+            return JS_NULL;
+        case ARG_FALSE:
+            return JS_FALSE;
+        case ARG_TRUE:
+            return JS_TRUE;
+        case ARG_INT:
+            if (read_arg_int32(r, &i) < 0)
+                goto truncated;
+            return JS_NewInt32(ctx, i);
+        case ARG_DOUBLE:
+            if (unlikely(r->end - r->p < 8))
+                goto truncated;
+            memcpy(&d, r->p, 8);
+            r->p += 8;
+            return JS_NewFloat64(ctx, d);
+        case ARG_STRING:
+            if (read_arg_int32(r, &i) < 0 || i < 0 || r->end - r->p < i)
+                goto truncated;
+            r->p += i;
+            return JS_NewStringLen(ctx, (const char *)r->p - i, i);
+        case ARG_BYTES:
+            if (read_arg_int32(r, &i) < 0 || i < 0 || r->end - r->p < i)
+                goto truncated;
+            r->p += i;
+            return JS_NewArrayBufferCopy(ctx, r->p - i, i);
+        case ARG_ARRAY: {
+            if (read_arg_int32(r, &i) < 0 || i < 0)
+                goto truncated;
+            if (unlikely(depth > 100))
+                return JS_ThrowRangeError(ctx, "argument arrays nested too deep");
+            JSValue ret = JS_NewArray(ctx);
+            for (int j = 0; j < i; j++) {
+                JSValue val = decodeJSValue(ctx, r, depth + 1);
+                if (JS_IsException(val)) {
+                    JS_FreeValue(ctx, ret);
+                    return val;
+                }
+                JS_SetPropertyUint32(ctx, ret, j, val);
+            }
+            return ret;
+        }
+        default:
+            return JS_ThrowTypeError(ctx, "invalid argument tag %d", r->p[-1]);
+    }
+truncated:
+    return JS_ThrowTypeError(ctx, "truncated argument buffer");
+}
+
+/*
+ * Get contents of an ArrayBuffer or typed array, holding a reference to the underlying ArrayBuffer
+ * in *hold. Return 1 on success, 0 if val is not binary data, -1 on exception (detached buffer)
+ */
+static int get_binary_data(JSContext *ctx, QJSHandle *qjs, JSValueConst val,
+        const uint8_t **pbuf, size_t *plen, JSValue *hold)
+{
+    if (!JS_IsObject(val))
+        return 0;
+    if (JS_IsInstanceOf(ctx, val, qjs->array_buffer_ctor) > 0) {
+        *pbuf = JS_GetArrayBuffer(ctx, plen, val);
+        if (unlikely(!*pbuf))
+            return -1;
+        *hold = JS_DupValue(ctx, val);
+        return 1;
+    }
+    if (JS_IsInstanceOf(ctx, val, qjs->typed_array_ctor) > 0) {
+        size_t offset, size;
+        JSValue ab = JS_GetTypedArrayBuffer(ctx, val, &offset, plen, NULL);
+        if (unlikely(JS_IsException(ab)))
+            return -1;
+        *pbuf = JS_GetArrayBuffer(ctx, &size, ab);
+        if (unlikely(!*pbuf)) {
+            JS_FreeValue(ctx, ab);
+            return -1;
+        }
+        *pbuf += offset;
+        *hold = ab;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Convert main function result. Arrays become Object[], objects Map (see newJavaObject).
+ * ArrayBuffer/typed array contents are returned as a ByteBuffer. With a direct buffer out, strings
+ * and objects as JSON are taken as UTF-8 bytes too; bytes are copied into out if they fit, in which case out's
+ * limit is set to their length and out is returned. Otherwise the ByteBuffer refers to JS owned
+ * memory, which remains valid until the next call on this runtime.
+ */
+static jobject newJavaResult(JSContext *ctx, JNIEnv *env, QJSHandle *qjs, JSValueConst result, jobject out)
+{
+    const uint8_t *buf;
+    size_t len;
+    int binary = get_binary_data(ctx, qjs, result, &buf, &len, &qjs->last_result);
+    if (unlikely(binary < 0))
+        return jrefs.jsException;
+    if (!binary && out && JS_IsObject(result) && !JS_IsArray(ctx, result) && !JS_IsFunction(ctx, result)) {
+        // objects are returned as JSON bytes
+        JSValue json = JS_JSONStringify(ctx, result, JS_UNDEFINED, JS_UNDEFINED);
+        if (unlikely(JS_IsException(json)))
+            return jrefs.jsException;
+        qjs->last_result = json;
+        buf = (const uint8_t *)JS_ToCStringLen(ctx, &len, json);
+        if (unlikely(!buf))
+            return jrefs.jsException;
+        qjs->last_cstr = (const char *)buf;
+    }
+    else if (!binary && out && !JS_IsNull(result) && !JS_IsUndefined(result) && !JS_IsArray(ctx, result)) {
+        buf = (const uint8_t *)JS_ToCStringLen(ctx, &len, result);
+        if (unlikely(!buf))
+            return jrefs.jsException;
+        qjs->last_cstr = (const char *)buf;
+    }
+    else if (!binary) {
+        int depth = 0;
+        if (JS_IsObject(result)) // keeps the memory of nested ArrayBuffers passed as views valid
+            qjs->last_result = JS_DupValue(ctx, result);
+        return newJavaObject(ctx, env, result, &depth);
+    }
+
+    if (out) {
+        uint8_t *out_buf = (*env)->GetDirectBufferAddress(env, out);
+        if (out_buf && len <= (*env)->GetDirectBufferCapacity(env, out)) {
+            memcpy(out_buf, buf, len);
+            free_last_result(qjs);
+            (*env)->DeleteLocalRef(env, (*env)->CallObjectMethod(env, out, jrefs.bufferLimit, (jint)len));
+            return out;
+        }
+    }
+    return (*env)->NewDirectByteBuffer(env, len? (void *)buf : (void *)"", len);
+}
+
+static int response_flush(JSContext *ctx, JavaHandle *javaCtx, int flush_sink);
+static JSValue await_main_result(JSContext *ctx, JavaHandle *javaCtx, JSValue result);
+
+/* Call main function with argv (freed here), return its converted result, JS_EXCEPTION, or
+   JS_TIMEOUT if it ran for more than timeout ms (0: no limit). In async mode, the result is
+   what the returned promise (if any) settles to. start is when the native call began,
+   before arguments were converted */
+static jobject call_main_func(JNIEnv *env, jobject thisObject, jlong handle, QJSHandle *qjs,
+        int argc, JSValue *argv, jobject out, jobject sink, int async, int timeout, int64_t start)
+{
+    JSContext *ctx = qjs->ctx;
+    ScriptStats *stats = qjs->stats;
+    jobject ret;
+    JavaHandle javaCtx = { env, thisObject, qjs, sink, handle, async, 0, 0, JS_UNDEFINED };
+
+    int64_t js_start = get_time_ns();
+    record_latency(&stats->args_ns, js_start - start);
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    qjs->timed_out = 0;
+    qjs->deadline = 0;
+    if (timeout > 0) {
+        pthread_once(&coarse_clock_once, start_coarse_clock);
+        qjs->deadline = js_start + (int64_t)timeout * 1000000;
+    }
+    JS_SetContextOpaque(ctx, &javaCtx);
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSValue result = JS_Call(ctx, qjs->main_func, global_obj, argc, argv);
+    if (async && likely(!JS_IsException(result)))
+        result = await_main_result(ctx, &javaCtx, result);
+    int64_t result_start = get_time_ns();
+    record_latency(&stats->js_ns, result_start - js_start);
+    if (unlikely(JS_IsException(result)) || (qjs->resp_len && response_flush(ctx, &javaCtx, 0) < 0))
+        ret = jrefs.jsException;
+    else
+        ret = newJavaResult(ctx, env, qjs, result, out);
+    qjs->resp_len = 0; // discard unflushed output of a failed call
+    qjs->deadline = 0;
+    if (unlikely(ret == jrefs.jsException)) {
+        if (qjs->timed_out) {
+            __atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
+            JS_FreeValue(ctx, JS_GetException(ctx)); // the runtime stays usable
+            ret = jrefs.jsTimeout;
+        } else {
+            __atomic_add_fetch(&stats->exceptions, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (int i = 0; i < argc; i++) {
+        JS_FreeValue(ctx, argv[i]);
+    }
+    JS_FreeValue(ctx, global_obj);
+    JS_FreeValue(ctx, result);
+    JS_SetContextOpaque(ctx, NULL);
+    int64_t end = get_time_ns();
+    record_latency(&stats->result_ns, end - result_start);
+    record_latency(&stats->call_ns, end - start);
+    return ret;
+}
+
+/* Main function arguments converted from the elements of jarr, NULL if out of memory */
+static JSValue *newJSArgv(JSContext *ctx, JNIEnv *env, jobjectArray jarr, int *pargc)
+{
+    int depth = 0;
+    int argc = jarr? (*env)->GetArrayLength(env, jarr) : 0;
+    JSValue *argv = (JSValue *)(js_malloc(ctx, (argc + 1) * sizeof(JSValue)));
+    if (unlikely(!argv))
+        return NULL;
+    for (int i = 0; i < argc; i++) {
+        jobject jobj = (*env)->GetObjectArrayElement(env, jarr, i);
+        argv[i] = newJSValue(ctx, env, jobj, &depth);
+        (*env)->DeleteLocalRef(env, jobj);
+    }
+    *pargc = argc;
+    return argv;
+}
+
+/* Main function arguments decoded from the argument list at r, NULL with a JS exception pending
+   if it is invalid */
+static JSValue *decodeJSArgv(JSContext *ctx, ArgReader *r, int *pargc)
+{
+    int32_t argc;
+    if (unlikely(read_arg_int32(r, &argc) < 0 || argc < 0 || argc > r->end - r->p)) {
+        JS_ThrowTypeError(ctx, "invalid argument buffer");
+        return NULL;
+    }
+    JSValue *argv = (JSValue *)(js_malloc(ctx, (argc + 1) * sizeof(JSValue)));
+    if (unlikely(!argv))
+        return NULL;
+    for (int i = 0; i < argc; i++) {
+        argv[i] = decodeJSValue(ctx, r, 0);
+        if (JS_IsException(argv[i])) {
+            for (int j = 0; j < i; j++)
+                JS_FreeValue(ctx, argv[j]);
+            js_free(ctx, argv);
+            return NULL;
+        }
+    }
+    *pargc = argc;
+    return argv;
+}
+
+/* ArgReader over the first len bytes of direct buffer args, -1 if they are not there */
+static int init_arg_reader(JNIEnv *env, ArgReader *r, jobject args, jint len)
+{
+    r->p = (const uint8_t *)(*env)->GetDirectBufferAddress(env, args);
+    r->end = r->p + len;
+    return r->p && len >= 0 && len <= (*env)->GetDirectBufferCapacity(env, args)? 0 : -1;
+}
+
+JNIEXPORT jobject JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJS(
+        JNIEnv *env, jobject thisObject, jlong handle, jobjectArray jarr, jobject out, jobject sink,
+        jboolean async, jint timeout)
+{
+    int64_t start = get_time_ns();
+    QJSHandle *qjs = acquire_handle_or_throw(env, handle);
+    if (unlikely(!qjs))
+        return NULL;
+    JSContext *ctx = qjs->ctx;
+    jobject ret = jrefs.jsException;
+    free_last_result(qjs);
+
+    int argc;
+    JSValue *argv = newJSArgv(ctx, env, jarr, &argc);
+    if (argv) {
+        ret = call_main_func(env, thisObject, handle, qjs, argc, argv, out, sink, async, timeout, start);
+        js_free(ctx, argv);
+    }
+    release_handle(handle);
+    return ret;
+}
+
+/* Same as nativeCallQJS, with arguments encoded by ArgBuffer in the first len bytes of direct buffer args */
+JNIEXPORT jobject JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJSArgs(
+        JNIEnv *env, jobject thisObject, jlong handle, jobject args, jint len, jobject out, jobject sink,
+        jboolean async, jint timeout)
+{
+    int64_t start = get_time_ns();
+    QJSHandle *qjs = acquire_handle_or_throw(env, handle);
+    if (unlikely(!qjs))
+        return NULL;
+    JSContext *ctx = qjs->ctx;
+    jobject ret = jrefs.jsException;
+    free_last_result(qjs);
+
+    ArgReader r;
+    int argc;
+    JSValue *argv;
+    if (unlikely(init_arg_reader(env, &r, args, len) < 0))
+        JS_ThrowTypeError(ctx, "invalid argument buffer");
+    else if ((argv = decodeJSArgv(ctx, &r, &argc))) {
+        ret = call_main_func(env, thisObject, handle, qjs, argc, argv, out, sink, async, timeout, start);
+        js_free(ctx, argv);
+    }
+    release_handle(handle);
+    return ret;
+}
+
+static jobjectArray newJavaObjectArray(JSContext *ctx, JNIEnv *env,
+        int argc, JSValueConst *argv, int *depth);
+
+/* LinkedHashMap with the own enumerable string keyed properties of obj */
+static jobject newJavaMap(JSContext *ctx, JNIEnv *env, JSValueConst obj, int *depth)
+{
+    JSPropertyEnum *tab;
+    uint32_t len;
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, obj, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return NULL;
+    }
+    jobject map = (*env)->NewObject(env, jrefs.linkedHashMapClass, jrefs.linkedHashMapConstr);
+    for (uint32_t i = 0; map && i < len; i++) {
+        JSValue val = JS_GetProperty(ctx, obj, tab[i].atom);
+        if (unlikely(JS_IsException(val))) { // throwing getter, leave the property out
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            continue;
+        }
+        const char *key = JS_AtomToCString(ctx, tab[i].atom);
+        jstring jkey = newJavaStringUTF8(env, key? key : "", key? strlen(key) : 0);
+        JS_FreeCString(ctx, key);
+        jobject jval = newJavaObject(ctx, env, val, depth);
+        JS_FreeValue(ctx, val);
+        (*env)->DeleteLocalRef(env, (*env)->CallObjectMethod(env, map, jrefs.mapPut, jkey, jval));
+        (*env)->DeleteLocalRef(env, jkey);
+        (*env)->DeleteLocalRef(env, jval);
+    }
+    for (uint32_t i = 0; i < len; i++)
+        JS_FreeAtom(ctx, tab[i].atom);
+    js_free(ctx, tab);
+    return map;
+}
+
+/* LinkedHashMap with the entries of a JS Map, or LinkedHashSet with the values of a JS Set */
+static jobject newJavaCollection(JSContext *ctx, JNIEnv *env, JSValueConst obj, int is_map, int *depth)
+{
+    jobject coll = is_map? (*env)->NewObject(env, jrefs.linkedHashMapClass, jrefs.linkedHashMapConstr)
+            : (*env)->NewObject(env, jrefs.linkedHashSetClass, jrefs.linkedHashSetConstr);
+    JSValue iter = JS_EXCEPTION, next = JS_EXCEPTION;
+    JSValue method = JS_GetPropertyStr(ctx, obj, is_map? "entries" : "values");
+    if (!JS_IsException(method))
+        iter = JS_Call(ctx, method, obj, 0, NULL);
+    if (!JS_IsException(iter))
+        next = JS_GetPropertyStr(ctx, iter, "next");
+    int failed = JS_IsException(next);
+    while (coll && !failed) {
+        JSValue res = JS_Call(ctx, next, iter, 0, NULL);
+        if (JS_IsException(res)) {
+            failed = 1;
+            break;
+        }
+        JSValue done = JS_GetPropertyStr(ctx, res, "done");
+        int is_done = JS_ToBool(ctx, done);
+        JS_FreeValue(ctx, done);
+        JSValue val = is_done? JS_UNDEFINED : JS_GetPropertyStr(ctx, res, "value");
+        JS_FreeValue(ctx, res);
+        if (is_done)
+            break;
+        if (is_map) {
+            JSValue k = JS_GetPropertyUint32(ctx, val, 0);
+            JSValue v = JS_GetPropertyUint32(ctx, val, 1);
+            jobject jk = newJavaObject(ctx, env, k, depth);
+            jobject jv = newJavaObject(ctx, env, v, depth);
+            (*env)->DeleteLocalRef(env, (*env)->CallObjectMethod(env, coll, jrefs.mapPut, jk, jv));
+            (*env)->DeleteLocalRef(env, jk);
+            (*env)->DeleteLocalRef(env, jv);
+            JS_FreeValue(ctx, k);
+            JS_FreeValue(ctx, v);
+        } else {
+            jobject jv = newJavaObject(ctx, env, val, depth);
+            (*env)->CallBooleanMethod(env, coll, jrefs.collectionAdd, jv);
+            (*env)->DeleteLocalRef(env, jv);
+        }
+        JS_FreeValue(ctx, val);
+    }
+    if (failed) // modified iterator methods, pass what was collected
+        JS_FreeValue(ctx, JS_GetException(ctx));
+    JS_FreeValue(ctx, next);
+    JS_FreeValue(ctx, iter);
+    JS_FreeValue(ctx, method);
+    return coll;
+}
+
+static jobject newJavaObject(JSContext *ctx, JNIEnv *env, JSValueConst val, int *depth)
+{
+    jobject jobj = NULL;
+    if (unlikely(JS_IsArray(ctx, val))) {
+        int len = 0;
+        JSValue jslen = JS_GetPropertyStr(ctx, val, "length");
+        JS_ToInt32(ctx, &len, jslen);
+        JS_FreeValue(ctx, jslen);
+        JSValue *jsa = (JSValue *)(js_malloc(ctx, (len + 1) * sizeof(JSValue)));
+        if (!jsa)
+            return NULL;
+        for (int j = 0; j < len; j++)
+            jsa[j] = JS_GetPropertyUint32(ctx, val, j);
+        if (unlikely(*depth > 100))
+            fprintf(stdout, "newJavaObjectArray: too many nested arrays, circular ref?\n");
+        else {
+            ++*depth;
+            jobj = newJavaObjectArray(ctx, env, len, jsa, depth);
+            --*depth;
+        }
+        for (int j = 0; j < len; j++)
+            JS_FreeValue(ctx, jsa[j]);
+        js_free(ctx, jsa);
+        return jobj;
+    }
+
+    int tag = JS_VALUE_GET_TAG(val);
+    const char *str;
+    size_t len;
+    switch(tag) {
+        case JS_TAG_INT:
+        case JS_TAG_BOOL:
+            jobj = (*env)->NewObjectA(env, jrefs.integerClass, jrefs.integerConstr,
+                    (jvalue *)&JS_VALUE_GET_INT(val));
+            break;
+        case JS_TAG_NULL:
+        case JS_TAG_UNDEFINED:
+            break;
+        case JS_TAG_FLOAT64:
+            jobj = (*env)->NewObjectA(env, jrefs.doubleClass, jrefs.doubleConstr,
+                    (jvalue *)&JS_VALUE_GET_FLOAT64(val));
+            break;
+        case JS_TAG_OBJECT:
+            if (!JS_IsFunction(ctx, val)) {
+                if (unlikely(*depth > 100)) {
+                    fprintf(stdout, "newJavaObject: too many nested objects, circular ref?\n");
+                    break;
+                }
+                JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+                QJSHandle *qjs = javaCtx? javaCtx->qjs : NULL;
+                const uint8_t *buf;
+                size_t len;
+                JSValue hold;
+                int binary = qjs? get_binary_data(ctx, qjs, val, &buf, &len, &hold) : 0;
+                if (binary > 0) { // a view of JS memory, val keeps it alive while the caller holds it
+                    jobj = (*env)->NewDirectByteBuffer(env, len? (void *)buf : (void *)"", len);
+                    JS_FreeValue(ctx, hold);
+                    break;
+                } else if (unlikely(binary < 0)) { // detached
+                    JS_FreeValue(ctx, JS_GetException(ctx));
+                    break;
+                }
+                ++*depth;
+                if (qjs && JS_IsInstanceOf(ctx, val, qjs->map_ctor) > 0)
+                    jobj = newJavaCollection(ctx, env, val, 1, depth);
+                else if (qjs && JS_IsInstanceOf(ctx, val, qjs->set_ctor) > 0)
+                    jobj = newJavaCollection(ctx, env, val, 0, depth);
+                else
+                    jobj = newJavaMap(ctx, env, val, depth);
+                --*depth;
+                break;
+            }
+            // fall through, functions are passed as their source
+        default:
+            str = JS_ToCStringLen(ctx, &len, val);
+            jobj = newJavaStringUTF8(env, str? str : "", str? len : 0);
+            if (str)
+                JS_FreeCString(ctx, str);
+    }
+    return jobj;
+}
+
+static jobjectArray newJavaObjectArray(JSContext *ctx, JNIEnv *env,
+        int argc, JSValueConst *argv, int *depth)
+{
+    jobjectArray ret = (*env)->NewObjectArray(env, argc, jrefs.objectClass, NULL);
+    for (int i = 0; i < argc; i++) {
+        jobject jobj = newJavaObject(ctx, env, argv[i], depth);
+        if (jobj) {
+            (*env)->SetObjectArrayElement(env, ret, i, jobj);
+            (*env)->DeleteLocalRef(env, jobj);
+        }
+    }
+    return ret;
+}
+
+/* Take the pending JS exception, return it and its stack if any as Object[], NULL if there is none */
+static jobjectArray newJavaException(JSContext *ctx, JNIEnv *env)
+{
+    JSValue exception_val = JS_GetException(ctx);
+    jobjectArray jarr = NULL;
+    int depth = 0;
+    if (!JS_IsNull(exception_val) && !JS_IsUndefined(exception_val)) {
+        JSValue stack = JS_GetPropertyStr(ctx, exception_val, "stack");
+        if (!JS_IsNull(stack) && !JS_IsUndefined(stack)) {
+            JSValue msgs[] = { exception_val, stack };
+            jarr = newJavaObjectArray(ctx, env, 2, msgs, &depth);
+        } else
+            jarr = newJavaObjectArray(ctx, env, 1, &exception_val, &depth);
+        JS_FreeValue(ctx, stack);
+    }
+    JS_FreeValue(ctx, exception_val);
+    return jarr;
+}
+
+JNIEXPORT jobjectArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetQJSException(
+        JNIEnv *env, jobject thisObject, jlong handle) {
+    QJSHandle *qjs = acquire_handle_or_throw(env, handle);
+    if (unlikely(!qjs))
+        return NULL;
+    jobjectArray jarr = newJavaException(qjs->ctx, env);
+    release_handle(handle);
+    return jarr;
+}
+
+/*
+ * Batch calls run the main function once per argument list within one native call, acquiring the
+ * runtime once. Failed items don't stop the batch: each item's result goes to results[i], or
+ * errors[i] gets JS_TIMEOUT or its exception as returned by nativeGetQJSException. The runtime
+ * memory results refer to is held by an array that is the batch's last result, so it stays valid
+ * until the next call like that of a single call's result. Return the number of failed items
+ */
+static int set_batch_result(JNIEnv *env, QJSHandle *qjs, jobjectArray results, jobjectArray errors,
+        jsize i, jobject ret, JSValueConst holds)
+{
+    if (!JS_IsUndefined(qjs->last_result)) {
+        JS_SetPropertyUint32(qjs->ctx, holds, i, qjs->last_result);
+        qjs->last_result = JS_UNDEFINED;
+    }
+    free_last_result(qjs);
+    if (ret == jrefs.jsTimeout) {
+        (*env)->SetObjectArrayElement(env, errors, i, ret);
+        return 1;
+    }
+    if (ret == jrefs.jsException) {
+        jobjectArray st = newJavaException(qjs->ctx, env);
+        (*env)->SetObjectArrayElement(env, errors, i, st? st : ret);
+        (*env)->DeleteLocalRef(env, st);
+        return 1;
+    }
+    (*env)->SetObjectArrayElement(env, results, i, ret);
+    (*env)->DeleteLocalRef(env, ret);
+    return 0;
+}
+
+JNIEXPORT jint JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJSBatch(
+        JNIEnv *env, jobject thisObject, jlong handle, jobjectArray argvs, jobjectArray results,
+        jobjectArray errors, jint timeout)
+{
+    QJSHandle *qjs = acquire_handle_or_throw(env, handle);
+    if (unlikely(!qjs))
+        return 0;
+    JSContext *ctx = qjs->ctx;
+    free_last_result(qjs);
+    JSValue holds = JS_NewArray(ctx);
+    jsize n = (*env)->GetArrayLength(env, argvs);
+    jint failed = 0;
+    for (jsize i = 0; i < n && likely(!(*env)->ExceptionCheck(env)); i++) {
+        int64_t start = get_time_ns();
+        jobjectArray jarr = (jobjectArray)(*env)->GetObjectArrayElement(env, argvs, i);
+        jobject ret = jrefs.jsException;
+        int argc;
+        JSValue *argv = newJSArgv(ctx, env, jarr, &argc);
+        if (argv) {
+            ret = call_main_func(env, thisObject, handle, qjs, argc, argv, NULL, NULL, 0, timeout, start);
+            js_free(ctx, argv);
+        }
+        (*env)->DeleteLocalRef(env, jarr);
+        failed += set_batch_result(env, qjs, results, errors, i, ret, holds);
+    }
+    qjs->last_result = holds;
+    release_handle(handle);
+    return failed;
+}
+
+/* Same as nativeCallQJSBatch, with count argument lists encoded one after the other by ArgBuffer */
+JNIEXPORT jint JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJSArgsBatch(
+        JNIEnv *env, jobject thisObject, jlong handle, jobject args, jint len, jint count,
+        jobjectArray results, jobjectArray errors, jint timeout)
+{
+    QJSHandle *qjs = acquire_handle_or_throw(env, handle);
+    if (unlikely(!qjs))
+        return 0;
+    JSContext *ctx = qjs->ctx;
+    free_last_result(qjs);
+    JSValue holds = JS_NewArray(ctx);
+    ArgReader r;
+    int invalid = init_arg_reader(env, &r, args, len) < 0;
+    jint failed = 0;
+    for (jint i = 0; i < count && likely(!(*env)->ExceptionCheck(env)); i++) {
+        int64_t start = get_time_ns();
+        jobject ret = jrefs.jsException;
+        int argc;
+        JSValue *argv;
+        if (unlikely(invalid))
+            JS_ThrowTypeError(ctx, "invalid argument buffer");
+        else if ((argv = decodeJSArgv(ctx, &r, &argc))) {
+            ret = call_main_func(env, thisObject, handle, qjs, argc, argv, NULL, NULL, 0, timeout, start);
+            js_free(ctx, argv);
+        } else
+            invalid = 1; // the next argument lists can't be found
+        failed += set_batch_result(env, qjs, results, errors, i, ret, holds);
+    }
+    qjs->last_result = holds;
+    release_handle(handle);
+    return failed;
+}
+
+static JSValue js_call_java(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    if (javaCtx == NULL) {
+        fprintf(stdout, "js_call_java: JS_GetContextOpaque is NULL");
+        return JS_UNDEFINED;
+    }
+    JNIEnv *env = javaCtx->env;
+    int64_t start = get_time_ns();
+    int depth = 0;
+    jobjectArray jargs = newJavaObjectArray(ctx, env, argc, argv, &depth);
+    jobjectArray jarr = (jobjectArray)(*env)->CallObjectMethod(env, javaCtx->thisObject, jrefs.callJava, jargs);
+    (*env)->DeleteLocalRef(env, jargs);
+    record_latency(&javaCtx->qjs->stats->java_ns, get_time_ns() - start);
+    if (unlikely(rethrow_java_exception(ctx, env) < 0))
+        return JS_EXCEPTION;
+    int error_reply = jarr && (*env)->GetArrayLength(env, jarr) == 2;
+    JSValue ret = newJSArray(ctx, env, jarr, &depth);
+    (*env)->DeleteLocalRef(env, jarr);
+    /* {"__error__", message} is thrown as an InternalError, see QuickJSConnector.callJava */
+    if (error_reply && !JS_IsException(ret)) {
+        JSValue val = JS_GetPropertyUint32(ctx, ret, 0);
+        const char *str = JS_IsString(val)? JS_ToCString(ctx, val) : NULL;
+        if (str && !strcmp(str, "__error__")) {
+            JSValue error = JS_GetPropertyUint32(ctx, ret, 1);
+            const char *cerror = JS_ToCString(ctx, error);
+            JS_FreeValue(ctx, ret);
+            ret = JS_ThrowInternalError(ctx, "%s", cerror? cerror : "");
+            JS_FreeCString(ctx, cerror);
+            JS_FreeValue(ctx, error);
+        }
+        JS_FreeCString(ctx, str);
+        JS_FreeValue(ctx, val);
+    }
+    return ret;
+}
+
+/*
+ * Typed callJava variants. Each maps to a QuickJSConnector method with a fixed primitive
+ * signature, so no Object[] is built on either side and numbers are never boxed
+ */
+static force_inline JavaHandle *get_call_handle(JSContext *ctx)
+{
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    if (unlikely(!javaCtx))
+        JS_ThrowTypeError(ctx, "callJava is only available in calls");
+    return javaCtx;
+}
+
+/* Java string for a JS value, NULL with a JS exception pending on failure */
+static jstring newJavaString(JSContext *ctx, JNIEnv *env, JSValueConst val)
+{
+    size_t len;
+    const char *str = JS_ToCStringLen(ctx, &len, val);
+    if (unlikely(!str))
+        return NULL;
+    jstring ret = newJavaStringUTF8(env, str, len);
+    JS_FreeCString(ctx, str);
+    if (unlikely(!ret))
+        rethrow_java_exception(ctx, env);
+    return ret;
+}
+
+/* callJavaString(str): String callJavaString(String), null is returned as null */
+static JSValue js_call_java_string(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = get_call_handle(ctx);
+    if (unlikely(!javaCtx))
+        return JS_EXCEPTION;
+    JNIEnv *env = javaCtx->env;
+    int64_t start = get_time_ns();
+    jstring jarg = newJavaString(ctx, env, argv[0]);
+    if (unlikely(!jarg))
+        return JS_EXCEPTION;
+    jstring jret = (jstring)(*env)->CallObjectMethod(env, javaCtx->thisObject, jrefs.callJavaString, jarg);
+    (*env)->DeleteLocalRef(env, jarg);
+    record_latency(&javaCtx->qjs->stats->java_ns, get_time_ns() - start);
+    if (unlikely(rethrow_java_exception(ctx, env) < 0))
+        return JS_EXCEPTION;
+    if (!jret)
+        return JS_NULL;
+    JSValue ret = newJSString(ctx, env, jret);
+    (*env)->DeleteLocalRef(env, jret);
+    return ret;
+}
+
+/* callJavaNumber(str): double callJavaNumber(String) */
+static JSValue js_call_java_number(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = get_call_handle(ctx);
+    if (unlikely(!javaCtx))
+        return JS_EXCEPTION;
+    JNIEnv *env = javaCtx->env;
+    int64_t start = get_time_ns();
+    jstring jarg = newJavaString(ctx, env, argv[0]);
+    if (unlikely(!jarg))
+        return JS_EXCEPTION;
+    jdouble ret = (*env)->CallDoubleMethod(env, javaCtx->thisObject, jrefs.callJavaNumber, jarg);
+    (*env)->DeleteLocalRef(env, jarg);
+    record_latency(&javaCtx->qjs->stats->java_ns, get_time_ns() - start);
+    if (unlikely(rethrow_java_exception(ctx, env) < 0))
+        return JS_EXCEPTION;
+    return JS_NewFloat64(ctx, ret);
+}
+
+/* callJavaInt(a, b): int callJavaInt(int, int) */
+static JSValue js_call_java_int(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = get_call_handle(ctx);
+    int32_t a, b;
+    if (unlikely(!javaCtx) || JS_ToInt32(ctx, &a, argv[0]) || JS_ToInt32(ctx, &b, argv[1]))
+        return JS_EXCEPTION;
+    JNIEnv *env = javaCtx->env;
+    int64_t start = get_time_ns();
+    jint ret = (*env)->CallIntMethod(env, javaCtx->thisObject, jrefs.callJavaInt, (jint)a, (jint)b);
+    record_latency(&javaCtx->qjs->stats->java_ns, get_time_ns() - start);
+    if (unlikely(rethrow_java_exception(ctx, env) < 0))
+        return JS_EXCEPTION;
+    return JS_NewInt32(ctx, ret);
+}
+
+/*
+ * Host functions. Each QuickJSConnector.HostFunction is a JS function of its own whose data is its
+ * index in qjs->host_funcs, where the method ID and argument types were resolved when the runtime
+ * was created. Calls convert the arguments straight to the method's parameters, with no Object[]
+ * built and no dispatch on a name in Java
+ */
+
+/* Type char of the JNI signature at *p, advanced past it. 0 if not supported */
+static char parse_host_type(const char **p)
+{
+    static const char string_sig[] = "Ljava/lang/String;";
+    const char *start = *p;
+    const char *end;
+    if (*start == 'V' || *start == 'Z' || *start == 'I' || *start == 'J' || *start == 'D') {
+        ++*p;
+        return *start;
+    }
+    if (*start != 'L' || !(end = strchr(start, ';')))
+        return 0;
+    *p = end + 1;
+    return *p - start == sizeof(string_sig) - 1 && !memcmp(start, string_sig, *p - start)? 'S' : 'L';
+}
+
+static JSValue js_host_call(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv, int magic, JSValue *func_data)
+{
+    JavaHandle *javaCtx = get_call_handle(ctx);
+    if (unlikely(!javaCtx))
+        return JS_EXCEPTION;
+    QJSHandle *qjs = javaCtx->qjs;
+    JNIEnv *env = javaCtx->env;
+    if (unlikely(!(*env)->IsInstanceOf(env, javaCtx->thisObject, qjs->host_class)))
+        return JS_ThrowTypeError(ctx, "host functions are only available to their connector class");
+    const HostFunc *f = &qjs->host_funcs[JS_VALUE_GET_INT(func_data[0])];
+    int64_t start = get_time_ns();
+    jvalue jargs[HOST_FUNC_MAX_ARGS];
+    int depth = 0;
+    int i;
+    jobject jret = NULL;
+    JSValue ret = JS_EXCEPTION;
+    for (i = 0; i < f->argc; i++) { // argv has at least argc values, missing ones are undefined
+        switch (f->arg_types[i]) {
+        case 'Z': {
+            int b = JS_ToBool(ctx, argv[i]);
+            if (unlikely(b < 0))
+                goto done;
+            jargs[i].z = (jboolean)b;
+            break;
         }
-        else if ((*env)->IsInstanceOf(env, jobj, javaCtx->objectArrayClass)) {
-            if (unlikely(*depth > 100))
-                fprintf(stdout, "newJSArray: too many nested arrays, circular ref?\n");
-            else {
-                ++*depth;
-                JS_SetPropertyUint32(ctx, ret, i, newJSArray(ctx, env, javaCtx, (jobjectArray)jobj, depth));
-            }
-            --*depth;
+        case 'I': {
+            int32_t v;
+            if (JS_ToInt32(ctx, &v, argv[i]))
+                goto done;
+            jargs[i].i = v;
+            break;
         }
-        else {
-            jobject jstr = (*env)->CallObjectMethod(env, jobj, javaCtx->objectToString);
-            JS_SetPropertyUint32(ctx, ret, i, newJSString(ctx, env, (jstring)jstr));
+        case 'J': {
+            int64_t v;
+            if (JS_ToInt64(ctx, &v, argv[i]))
+                goto done;
+            jargs[i].j = v;
+            break;
         }
+        case 'D':
+            if (JS_ToFloat64(ctx, &jargs[i].d, argv[i]))
+                goto done;
+            break;
+        case 'S':
+            if (JS_IsNull(argv[i]) || JS_IsUndefined(argv[i]))
+                jargs[i].l = NULL;
+            else if (unlikely(!(jargs[i].l = newJavaString(ctx, env, argv[i]))))
+                goto done;
+            break;
+        default:
+            jargs[i].l = newJavaObject(ctx, env, argv[i], &depth);
+        }
+    }
+
+    switch (f->ret_type) {
+    case 'V':
+        (*env)->CallVoidMethodA(env, javaCtx->thisObject, f->method, jargs);
+        ret = JS_UNDEFINED;
+        break;
+    case 'Z':
+        ret = JS_NewBool(ctx, (*env)->CallBooleanMethodA(env, javaCtx->thisObject, f->method, jargs));
+        break;
+    case 'I':
+        ret = JS_NewInt32(ctx, (*env)->CallIntMethodA(env, javaCtx->thisObject, f->method, jargs));
+        break;
+    case 'J':
+        ret = JS_NewInt64(ctx, (*env)->CallLongMethodA(env, javaCtx->thisObject, f->method, jargs));
+        break;
+    case 'D':
+        ret = JS_NewFloat64(ctx, (*env)->CallDoubleMethodA(env, javaCtx->thisObject, f->method, jargs));
+        break;
+    default:
+        jret = (*env)->CallObjectMethodA(env, javaCtx->thisObject, f->method, jargs);
+        ret = JS_UNDEFINED;
+    }
+    record_latency(&qjs->stats->java_ns, get_time_ns() - start);
+    if (unlikely(rethrow_java_exception(ctx, env) < 0))
+        ret = JS_EXCEPTION;
+    else if (jret)
+        ret = f->ret_type == 'S'? newJSString(ctx, env, (jstring)jret) : newJSValue(ctx, env, jret, &depth);
+    else if (f->ret_type == 'S' || f->ret_type == 'L')
+        ret = JS_NULL;
+    (*env)->DeleteLocalRef(env, jret);
+done:
+    while (i-- > 0) {
+        if (f->arg_types[i] == 'S' || f->arg_types[i] == 'L')
+            (*env)->DeleteLocalRef(env, jargs[i].l);
     }
     return ret;
 }
 
-static int init_java_ctx(JNIEnv *env, jobject thisObject, JavaHandle *javaCtx)
+/* Define the host functions of table (name, Method, JNI signature triples) as globals. Return
+   them to be kept with the runtime, NULL if there are none */
+static HostFunc *define_host_funcs(JSContext *ctx, JNIEnv *env, jobjectArray table)
 {
-    jclass cls = (*env)->GetObjectClass(env, thisObject);
-    jmethodID callJava = (*env)->GetMethodID(env, cls, "callJava",
-            "([Ljava/lang/Object;)[Ljava/lang/Object;");
-    if (!callJava) {
-        fprintf(stdout, "callQJS: method Object[] callJava(Object[]) undefined\n");
-        return -1;
+    jsize n = table? (*env)->GetArrayLength(env, table) / 3 : 0;
+    int count = 0;
+    if (n == 0)
+        return NULL;
+    HostFunc *funcs = malloc(n * sizeof(HostFunc));
+    if (unlikely(!funcs)) {
+        fprintf(stdout, "Error: cannot allocate host functions\n");
+        return NULL;
     }
-    javaCtx->env = env;
-    javaCtx->thisObject = thisObject;
-    javaCtx->callJava = callJava;
-    javaCtx->objectClass = (*env)->FindClass(env, "java/lang/Object");
-    javaCtx->objectToString = (*env)->GetMethodID(env, javaCtx->objectClass, "toString",
-            "()Ljava/lang/String;");
-    javaCtx->integerClass = (*env)->FindClass(env, "java/lang/Integer");
-    javaCtx->integerConstr = (*env)->GetMethodID(env, javaCtx->integerClass, "<init>", "(I)V");
-    javaCtx->doubleClass = (*env)->FindClass(env, "java/lang/Double");
-    javaCtx->doubleConstr = (*env)->GetMethodID(env, javaCtx->doubleClass, "<init>", "(D)V");
-    javaCtx->numberClass = (*env)->FindClass(env, "java/lang/Number");
-    javaCtx->numberDoubleValue = (*env)->GetMethodID(env, javaCtx->numberClass, "doubleValue", "()D");
-    javaCtx->stringClass = (*env)->FindClass(env, "java/lang/String");
-    javaCtx->objectArrayClass = (*env)->FindClass(env, "[Ljava/lang/Object;");
-    return 0;
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    for (jsize i = 0; i < n; i++) {
+        jstring jname = (jstring)(*env)->GetObjectArrayElement(env, table, i * 3);
+        jobject jmethod = (*env)->GetObjectArrayElement(env, table, i * 3 + 1);
+        jstring jsig = (jstring)(*env)->GetObjectArrayElement(env, table, i * 3 + 2);
+        const char *name = (*env)->GetStringUTFChars(env, jname, NULL);
+        const char *sig = (*env)->GetStringUTFChars(env, jsig, NULL);
+        HostFunc *f = &funcs[count];
+        f->method = (*env)->FromReflectedMethod(env, jmethod);
+        f->argc = 0;
+        const char *p = sig + 1; // past '('
+        while (*p && *p != ')' && f->argc < HOST_FUNC_MAX_ARGS && (f->arg_types[f->argc] = parse_host_type(&p)))
+            f->argc++;
+        f->ret_type = *p == ')'? (p++, parse_host_type(&p)) : 0;
+        if (f->method && f->ret_type) {
+            JSValue data = JS_NewInt32(ctx, count);
+            JS_DefinePropertyValueStr(ctx, global_obj, name,
+                    JS_NewCFunctionData(ctx, js_host_call, f->argc, 0, 1, &data), 0);
+            count++;
+        } else
+            fprintf(stdout, "quickjs: host function %s%s not supported\n", name, sig);
+        (*env)->ReleaseStringUTFChars(env, jsig, sig);
+        (*env)->ReleaseStringUTFChars(env, jname, name);
+        (*env)->DeleteLocalRef(env, jsig);
+        (*env)->DeleteLocalRef(env, jmethod);
+        (*env)->DeleteLocalRef(env, jname);
+    }
+    JS_FreeValue(ctx, global_obj);
+    if (count == 0) {
+        free(funcs);
+        return NULL;
+    }
+    return funcs;
 }
 
-JNIEXPORT jint JNICALL Java_org_scriptable_QuickJSConnector_nativeCallQJS(
-        JNIEnv *env, jobject thisObject, jbyteArray jctx, jobjectArray jarr)
+/* Hand buf to the response sink in Java, return -1 if that threw */
+static int response_write_java(JSContext *ctx, JavaHandle *javaCtx, const uint8_t *buf, size_t len,
+        int flush_sink)
 {
-    if (unlikely(!(*env)->GetArrayLength(env, jctx)))
-        return -1;
-    QJSHandle *qjs = (QJSHandle *)(*env)->GetByteArrayElements(env, jctx, NULL);
-    if (!qjs)
-        return -1;
-    JSContext *ctx = qjs->ctx;
-    int ret = 0;
-    JavaHandle javaCtx;
-    if (init_java_ctx(env, thisObject, &javaCtx) < 0)
-        return -1;
+    JNIEnv *env = javaCtx->env;
+    jobject chunk = (*env)->NewDirectByteBuffer(env, len? (void *)buf : (void *)"", len);
+    if (likely(chunk != NULL)) {
+        (*env)->CallStaticVoidMethod(env, jrefs.connectorClass, jrefs.writeResponse,
+                javaCtx->sink, chunk, (jboolean)flush_sink);
+        (*env)->DeleteLocalRef(env, chunk);
+    }
+    return rethrow_java_exception(ctx, env);
+}
 
-    JS_SetContextOpaque(ctx, &javaCtx);
-    JSValue global_obj = JS_GetGlobalObject(ctx);
+static int response_flush(JSContext *ctx, JavaHandle *javaCtx, int flush_sink)
+{
+    QJSHandle *qjs = javaCtx->qjs;
+    size_t len = qjs->resp_len;
+    qjs->resp_len = 0;
+    return response_write_java(ctx, javaCtx, qjs->resp_buf, len, flush_sink);
+}
 
-    int depth = 0;
-    int argc = (*env)->GetArrayLength(env, jarr);
-    JSValue jsa = newJSArray(ctx, env, &javaCtx, jarr, &depth);
-    JSValue *argv = (JSValue *)(js_malloc(ctx, argc * sizeof(JSValue)));
-    if (!argv)
-        return -1;
-    for (int i = 0; i < argc; i++)
-        argv[i] = JS_GetPropertyUint32(ctx, jsa, i);
-    JSValue result = JS_Call(ctx, qjs->main_func, global_obj, argc, argv);
-    if (unlikely(JS_IsException(result)))
-        ret = -1;
-    if (JS_VALUE_GET_TAG(result) == JS_TAG_INT)
-        ret = JS_VALUE_GET_INT(result);
+static JavaHandle *get_response_handle(JSContext *ctx)
+{
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    if (unlikely(!javaCtx || !javaCtx->sink)) {
+        JS_ThrowTypeError(ctx, "response is not available in this call");
+        return NULL;
+    }
+    return javaCtx;
+}
 
-    for (int i = 0; i < argc; i++) {
-        JS_FreeValue(ctx, argv[i]);
+/* Buffer output until there is a full chunk, larger writes go to Java without copying */
+static int response_append(JSContext *ctx, JavaHandle *javaCtx, const uint8_t *buf, size_t len)
+{
+    QJSHandle *qjs = javaCtx->qjs;
+    if (len > RESPONSE_CHUNK_SIZE - qjs->resp_len) {
+        if (qjs->resp_len && response_flush(ctx, javaCtx, 0) < 0)
+            return -1;
+        if (len >= RESPONSE_CHUNK_SIZE)
+            return response_write_java(ctx, javaCtx, buf, len, 0);
     }
-    JS_FreeValue(ctx, jsa);
-    js_free(ctx, argv);
-    JS_FreeValue(ctx, global_obj);
-    JS_FreeValue(ctx, result);
-    JS_SetContextOpaque(ctx, NULL);
-    (*env)->ReleaseByteArrayElements(env, jctx, (signed char *)qjs, 0);
-    fflush(stdout);
-    return ret;
+    if (unlikely(!qjs->resp_buf)) {
+        qjs->resp_buf = malloc(RESPONSE_CHUNK_SIZE);
+        if (!qjs->resp_buf) {
+            JS_ThrowOutOfMemory(ctx);
+            return -1;
+        }
+    }
+    memcpy(qjs->resp_buf + qjs->resp_len, buf, len);
+    qjs->resp_len += len;
+    return 0;
 }
 
-static jobjectArray newJavaObjectArray(JSContext *ctx, JNIEnv *env, JavaHandle *javaCtx,
-        int argc, JSValueConst *argv, int *depth)
+/* response.write(...data): strings are written as UTF-8, ArrayBuffers and typed arrays as is */
+static JSValue js_response_write(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
 {
-    jobjectArray ret = (*env)->NewObjectArray(env, argc, javaCtx->objectClass, NULL);
+    JavaHandle *javaCtx = get_response_handle(ctx);
+    if (unlikely(!javaCtx))
+        return JS_EXCEPTION;
     for (int i = 0; i < argc; i++) {
-        JSValueConst val = argv[i];
-        if (unlikely(JS_IsArray(ctx, val))) {
-            int len = 0;
-            JSValue jslen = JS_GetPropertyStr(ctx, val, "length");
-            JS_ToInt32(ctx, &len, jslen);
-            JS_FreeValue(ctx, jslen);
-            JSValue *jsa = (JSValue *)(js_malloc(ctx, len * sizeof(JSValue)));
-            if (!jsa)
-                return NULL;
-            for (int j = 0; j < len; j++)
-                jsa[j] = JS_GetPropertyUint32(ctx, val, j);
-            if (unlikely(*depth > 100))
-                fprintf(stdout, "newJavaObjectArray: too many nested arrays, circular ref?\n");
-            else {
-                ++*depth;
-                (*env)->SetObjectArrayElement(env, ret, i,
-                    newJavaObjectArray(ctx, env, javaCtx, len, jsa, depth));
-            }
-            --*depth;
-            for (int j = 0; j < len; j++)
-                JS_FreeValue(ctx, jsa[j]);
-            js_free(ctx, jsa);
+        const uint8_t *buf;
+        size_t len;
+        int ret;
+        JSValue hold = JS_UNDEFINED;
+        int binary = get_binary_data(ctx, javaCtx->qjs, argv[i], &buf, &len, &hold);
+        if (unlikely(binary < 0))
+            return JS_EXCEPTION;
+        if (binary) {
+            ret = response_append(ctx, javaCtx, buf, len);
+            JS_FreeValue(ctx, hold);
+        } else {
+            const char *str = JS_ToCStringLen(ctx, &len, argv[i]);
+            if (!str)
+                return JS_EXCEPTION;
+            ret = response_append(ctx, javaCtx, (const uint8_t *)str, len);
+            JS_FreeCString(ctx, str);
+        }
+        if (ret < 0)
+            return JS_EXCEPTION;
+    }
+    return JS_UNDEFINED;
+}
+
+/* response.flush(): pass buffered output to Java and flush the sink */
+static JSValue js_response_flush(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = get_response_handle(ctx);
+    if (unlikely(!javaCtx) || response_flush(ctx, javaCtx, 1) < 0)
+        return JS_EXCEPTION;
+    return JS_UNDEFINED;
+}
+
+/*
+ * Async calls. The main function's result is awaited by running promise jobs, setTimeout() timers
+ * and callJavaAsync() completions on the calling thread until it settles and no Java operation
+ * started by the call is outstanding, or the call's budget runs out (ASYNC_GRACE_NS after it
+ * settled without one). Timers and operations left over when the call returns are dropped:
+ * completions refer to the runtime by its handle and their ids are never reused, so late ones
+ * are discarded, and async_post_mutex keeps them from being posted to a freed runtime.
+ */
+
+static JSValue js_main_settled(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv, int magic, JSValue *func_data)
+{
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    int call_id = JS_VALUE_GET_INT(func_data[0]);
+    if (javaCtx && javaCtx->call_id == call_id && !javaCtx->settled) {
+        javaCtx->settled = magic;
+        javaCtx->settled_value = JS_DupValue(ctx, argv[0]);
+    }
+    return JS_UNDEFINED;
+}
+
+static void free_async_timers(JSContext *ctx, QJSHandle *qjs)
+{
+    while (qjs->timers) {
+        AsyncTimer *t = qjs->timers;
+        qjs->timers = t->next;
+        JS_FreeValue(ctx, t->func);
+        js_free(ctx, t);
+    }
+}
+
+/* Run expired timers, return the next deadline, 0 if there are no timers, or -1 on exception */
+static int64_t run_async_timers(JSContext *ctx, QJSHandle *qjs)
+{
+    for (;;) {
+        AsyncTimer **first = NULL;
+        for (AsyncTimer **pt = &qjs->timers; *pt; pt = &(*pt)->next) {
+            if (!first || (*pt)->deadline < (*first)->deadline)
+                first = pt;
         }
+        if (!first)
+            return 0;
+        AsyncTimer *t = *first;
+        if (t->deadline > get_time_ns())
+            return t->deadline;
+        *first = t->next;
+        JSValue ret = JS_Call(ctx, t->func, JS_UNDEFINED, 0, NULL);
+        JS_FreeValue(ctx, t->func);
+        js_free(ctx, t);
+        if (JS_IsException(ret))
+            return -1;
+        JS_FreeValue(ctx, ret);
+    }
+}
+
+/* Wait for Java completions until deadline (0: no deadline) and settle their promises,
+   or just drop them if discard is set. Return -1 on exception */
+static int run_async_completions(JSContext *ctx, JNIEnv *env, QJSHandle *qjs, int64_t deadline, int discard)
+{
+    pthread_mutex_lock(&qjs->async_mutex);
+    while (!qjs->completions) {
+        if (!deadline)
+            pthread_cond_wait(&qjs->async_cond, &qjs->async_mutex);
         else {
-            int tag = JS_VALUE_GET_TAG(val);
-            const char *str;
-            switch(tag) {
-                case JS_TAG_INT:
-                case JS_TAG_BOOL:
-                    (*env)->SetObjectArrayElement(env, ret, i,
-                        (*env)->NewObjectA(env, javaCtx->integerClass, javaCtx->integerConstr,
-                            (jvalue *)&JS_VALUE_GET_INT(val)));
-                    break;
-                case JS_TAG_NULL:
-                case JS_TAG_UNDEFINED:
-                    (*env)->SetObjectArrayElement(env, ret, i, NULL);
-                    break;
-                case JS_TAG_FLOAT64:
-                    (*env)->SetObjectArrayElement(env, ret, i,
-                        (*env)->NewObjectA(env, javaCtx->doubleClass, javaCtx->doubleConstr,
-                            (jvalue *)&JS_VALUE_GET_FLOAT64(val)));
-                    break;
-                default:
-                    str = JS_ToCString(ctx, val);
-                    if (unlikely(!str))
-                        str = "";
-                    (*env)->SetObjectArrayElement(env, ret, i, (*env)->NewStringUTF(env, str));
-                    JS_FreeCString(ctx, str);
+            struct timespec ts = { deadline / 1000000000, deadline % 1000000000 };
+            if (pthread_cond_timedwait(&qjs->async_cond, &qjs->async_mutex, &ts) == ETIMEDOUT)
+                break;
+        }
+    }
+    AsyncCompletion *list = NULL;
+    while (qjs->completions) { // reverse into completion order
+        AsyncCompletion *c = qjs->completions;
+        qjs->completions = c->next;
+        c->next = list;
+        list = c;
+    }
+    pthread_mutex_unlock(&qjs->async_mutex);
+
+    int ret = 0;
+    while (list) {
+        AsyncCompletion *c = list;
+        list = c->next;
+        AsyncOp **pop = &qjs->async_ops;
+        while (*pop && (*pop)->id != c->id)
+            pop = &(*pop)->next;
+        AsyncOp *op = *pop;
+        if (op) {
+            *pop = op->next;
+            qjs->async_pending--;
+            if (!discard && !ret) {
+                JSValue val;
+                if (c->error) {
+                    throw_java_error(ctx, env, c->error);
+                    val = JS_GetException(ctx);
+                } else {
+                    int depth = 0;
+                    val = newJSArray(ctx, env, c->result, &depth);
+                }
+                JSValue r = JS_Call(ctx, op->resolving_funcs[c->error? 1 : 0], JS_UNDEFINED, 1, &val);
+                if (JS_IsException(r))
+                    ret = -1;
+                JS_FreeValue(ctx, r);
+                JS_FreeValue(ctx, val);
             }
+            JS_FreeValue(ctx, op->resolving_funcs[0]);
+            JS_FreeValue(ctx, op->resolving_funcs[1]);
+            js_free(ctx, op);
         }
+        if (c->result)
+            (*env)->DeleteGlobalRef(env, c->result);
+        if (c->error)
+            (*env)->DeleteGlobalRef(env, c->error);
+        free(c);
     }
     return ret;
 }
 
-JNIEXPORT jobjectArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetQJSException(
-        JNIEnv *env, jobject thisObject, jbyteArray jctx) {
-    if (unlikely(!(*env)->GetArrayLength(env, jctx)))
+static void drop_async_completions(JNIEnv *env, QJSHandle *qjs)
+{
+    pthread_mutex_lock(&qjs->async_mutex);
+    AsyncCompletion *list = qjs->completions;
+    qjs->completions = NULL;
+    pthread_mutex_unlock(&qjs->async_mutex);
+    while (list) {
+        AsyncCompletion *c = list;
+        list = c->next;
+        if (c->result)
+            (*env)->DeleteGlobalRef(env, c->result);
+        if (c->error)
+            (*env)->DeleteGlobalRef(env, c->error);
+        free(c);
+    }
+}
+
+/* Forget the operations still outstanding when the call returns, their completions are dropped */
+static void abandon_async_ops(JSContext *ctx, JNIEnv *env, QJSHandle *qjs)
+{
+    while (qjs->async_ops) {
+        AsyncOp *op = qjs->async_ops;
+        qjs->async_ops = op->next;
+        JS_FreeValue(ctx, op->resolving_funcs[0]);
+        JS_FreeValue(ctx, op->resolving_funcs[1]);
+        js_free(ctx, op);
+    }
+    qjs->async_pending = 0;
+    drop_async_completions(env, qjs);
+}
+
+/* Await result (freed here) of an async main function, return the settled value or JS_EXCEPTION */
+static JSValue await_main_result(JSContext *ctx, JavaHandle *javaCtx, JSValue result)
+{
+    QJSHandle *qjs = javaCtx->qjs;
+    JSRuntime *rt = JS_GetRuntime(ctx);
+    int failed = 0;
+    int64_t give_up = 0; // without a budget, when to stop waiting for operations once settled
+
+    /* Promise.resolve(result).then(settled, settled) */
+    JSValue global_obj = JS_GetGlobalObject(ctx);
+    JSValue promise_ctor = JS_GetPropertyStr(ctx, global_obj, "Promise");
+    JSValue resolve = JS_GetPropertyStr(ctx, promise_ctor, "resolve");
+    JSValue promise = JS_Call(ctx, resolve, promise_ctor, 1, (JSValueConst *)&result);
+    JS_FreeValue(ctx, resolve);
+    JS_FreeValue(ctx, promise_ctor);
+    JS_FreeValue(ctx, global_obj);
+    JS_FreeValue(ctx, result);
+    if (JS_IsException(promise))
+        failed = 1;
+    else {
+        JSValue then = JS_GetPropertyStr(ctx, promise, "then");
+        JSValue call_id = JS_NewInt32(ctx, javaCtx->call_id = ++qjs->next_async_id);
+        JSValue handlers[2] = {
+            JS_NewCFunctionData(ctx, js_main_settled, 1, 1, 1, &call_id),
+            JS_NewCFunctionData(ctx, js_main_settled, 1, 2, 1, &call_id) };
+        JSValue ret = JS_Call(ctx, then, promise, 2, (JSValueConst *)handlers);
+        failed = JS_IsException(ret);
+        JS_FreeValue(ctx, ret);
+        JS_FreeValue(ctx, handlers[0]);
+        JS_FreeValue(ctx, handlers[1]);
+        JS_FreeValue(ctx, then);
+        JS_FreeValue(ctx, promise);
+    }
+
+    while (!failed) {
+        JSContext *ctx1;
+        int err;
+        while ((err = JS_ExecutePendingJob(rt, &ctx1)) > 0)
+            ;
+        if (err < 0) {
+            failed = 1;
+            break;
+        }
+        if (javaCtx->settled && !qjs->async_pending)
+            break;
+        int64_t next_timer = run_async_timers(ctx, qjs);
+        if (next_timer < 0) {
+            failed = 1;
+            break;
+        }
+        if (JS_IsJobPending(rt))
+            continue;
+        if (qjs->deadline) {
+            if (get_time_ns() >= qjs->deadline) {
+                qjs->timed_out = 1;
+                JS_ThrowInternalError(ctx, "interrupted");
+                failed = 1;
+                break;
+            }
+            if (!next_timer || next_timer > qjs->deadline)
+                next_timer = qjs->deadline; // wake up in time to give up
+        }
+        else if (javaCtx->settled) {
+            if (!give_up)
+                give_up = get_time_ns() + ASYNC_GRACE_NS;
+            else if (get_time_ns() >= give_up)
+                break; // the result stands, the operations are abandoned
+            if (!next_timer || next_timer > give_up)
+                next_timer = give_up;
+        }
+        if (qjs->async_pending)
+            failed = run_async_completions(ctx, javaCtx->env, qjs, next_timer, 0) < 0;
+        else if (next_timer) {
+            int64_t wait = next_timer - get_time_ns();
+            if (wait > 0)
+                nanosleep(&(struct timespec){ wait / 1000000000, wait % 1000000000 }, NULL);
+        }
+        else if (!javaCtx->settled) {
+            JS_ThrowInternalError(ctx, "main function's promise never settled");
+            failed = 1;
+        }
+    }
+    free_async_timers(ctx, qjs);
+    if (qjs->async_pending)
+        abandon_async_ops(ctx, javaCtx->env, qjs);
+
+    if (!failed && javaCtx->settled == 1)
+        return javaCtx->settled_value;
+    if (!failed && javaCtx->settled == 2)
+        return JS_Throw(ctx, javaCtx->settled_value);
+    JS_FreeValue(ctx, javaCtx->settled_value);
+    return JS_EXCEPTION;
+}
+
+/* callJavaAsync(...args): like callJava, returning a promise of its result. Only in async calls */
+static JSValue js_call_java_async(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    if (unlikely(!javaCtx || !javaCtx->async))
+        return JS_ThrowTypeError(ctx, "callJavaAsync is only available in async calls");
+    QJSHandle *qjs = javaCtx->qjs;
+    JNIEnv *env = javaCtx->env;
+    AsyncOp *op = js_malloc(ctx, sizeof(AsyncOp));
+    if (!op)
+        return JS_EXCEPTION;
+    JSValue promise = JS_NewPromiseCapability(ctx, op->resolving_funcs);
+    if (JS_IsException(promise)) {
+        js_free(ctx, op);
+        return promise;
+    }
+    op->id = ++qjs->next_async_id;
+    op->next = qjs->async_ops;
+    qjs->async_ops = op;
+    qjs->async_pending++;
+
+    int depth = 0;
+    jobjectArray jargs = newJavaObjectArray(ctx, env, argc, argv, &depth);
+    (*env)->CallStaticVoidMethod(env, jrefs.connectorClass, jrefs.startJavaAsync,
+            javaCtx->thisObject, jargs, javaCtx->handle, (jint)op->id);
+    (*env)->DeleteLocalRef(env, jargs);
+    if (unlikely(rethrow_java_exception(ctx, env) < 0)) { // nothing will complete this op
+        qjs->async_ops = op->next;
+        qjs->async_pending--;
+        JS_FreeValue(ctx, op->resolving_funcs[0]);
+        JS_FreeValue(ctx, op->resolving_funcs[1]);
+        js_free(ctx, op);
+        JS_FreeValue(ctx, promise);
+        return JS_EXCEPTION;
+    }
+    return promise;
+}
+
+/* Sum of JS_ComputeMemoryUsage over the given runtimes, skipping those in use, stale or released.
+   The first element is the number of runtimes measured, followed by MEMORY_USAGE_FIELDS */
+#define MEMORY_USAGE_FIELD_COUNT 20
+#define MEMORY_USAGE_FIELDS(s) s.malloc_size, s.malloc_count, s.memory_used_size, s.memory_used_count, \
+    s.atom_count, s.atom_size, s.str_count, s.str_size, s.obj_count, s.obj_size, s.prop_count, \
+    s.prop_size, s.shape_count, s.shape_size, s.js_func_count, s.js_func_size, s.js_func_code_size, \
+    s.array_count, s.binary_object_count, s.binary_object_size
+
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetMemoryUsage(
+        JNIEnv *env, jclass cls, jlongArray handles)
+{
+    jlong sum[1 + MEMORY_USAGE_FIELD_COUNT] = { 0 };
+    int n = (*env)->GetArrayLength(env, handles);
+    jlong *h = (*env)->GetLongArrayElements(env, handles, NULL);
+    if (!h)
         return NULL;
-    QJSHandle *qjs = (QJSHandle *)(*env)->GetByteArrayElements(env, jctx, NULL);
-    JSContext *ctx = qjs->ctx;
-    JavaHandle javaCtx;
-    if (init_java_ctx(env, thisObject, &javaCtx) < 0)
+    for (int i = 0; i < n; i++) {
+        int busy;
+        QJSHandle *qjs = acquire_handle_flags(h[i], &busy, 1);
+        if (!qjs)
+            continue;
+        JSMemoryUsage s;
+        JS_ComputeMemoryUsage(JS_GetRuntime(qjs->ctx), &s);
+        release_handle(h[i]);
+        int64_t fields[] = { MEMORY_USAGE_FIELDS(s) };
+        sum[0]++;
+        for (int j = 0; j < sizeof(fields)/sizeof(fields[0]); j++)
+            sum[j + 1] += fields[j];
+    }
+    (*env)->ReleaseLongArrayElements(env, handles, h, JNI_ABORT);
+    jlongArray ret = (*env)->NewLongArray(env, sizeof(sum)/sizeof(sum[0]));
+    if (ret)
+        (*env)->SetLongArrayRegion(env, ret, 0, sizeof(sum)/sizeof(sum[0]), sum);
+    return ret;
+}
+
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetScriptStats(
+        JNIEnv *env, jclass cls, jstring ctxKey)
+{
+    const char *key = (*env)->GetStringUTFChars(env, ctxKey, NULL);
+    ScriptStats *e = get_script_stats(key, 0);
+    (*env)->ReleaseStringUTFChars(env, ctxKey, key);
+    if (!e)
         return NULL;
-    JSValue exception_val = JS_GetException(ctx);
-    jobjectArray jarr = NULL;
-    int depth = 0;
-    if (!JS_IsNull(exception_val) && !JS_IsUndefined(exception_val)) {
-        JSValue stack = JS_GetPropertyStr(ctx, exception_val, "stack");
-        if (!JS_IsNull(stack) && !JS_IsUndefined(stack)) {
-            JSValue msgs[] = { exception_val, stack };
-            jarr = newJavaObjectArray(ctx, env, &javaCtx, 2, msgs, &depth);
-        } else
-            jarr = newJavaObjectArray(ctx, env, &javaCtx, 1, &exception_val, &depth);
-        JS_FreeValue(ctx, stack);
+    /* counters, then count, sum and buckets of each histogram in ScriptStats order.
+       Fields are read one by one, so a snapshot may be off by the calls in progress */
+    jlong stats[3 + SCRIPT_STATS_HISTOGRAMS * LATENCY_FIELD_COUNT];
+    stats[0] = __atomic_load_n(&e->calls, __ATOMIC_RELAXED);
+    stats[1] = __atomic_load_n(&e->timeouts, __ATOMIC_RELAXED);
+    stats[2] = __atomic_load_n(&e->exceptions, __ATOMIC_RELAXED);
+    LatencyHistogram *hists[SCRIPT_STATS_HISTOGRAMS] = { &e->call_ns, &e->js_ns, &e->args_ns,
+        &e->result_ns, &e->java_ns, &e->create_ns, &e->destroy_ns };
+    jlong *p = stats + 3;
+    for (int i = 0; i < SCRIPT_STATS_HISTOGRAMS; i++) {
+        *p++ = __atomic_load_n(&hists[i]->count, __ATOMIC_RELAXED);
+        *p++ = __atomic_load_n(&hists[i]->sum_ns, __ATOMIC_RELAXED);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            *p++ = __atomic_load_n(&hists[i]->buckets[b], __ATOMIC_RELAXED);
     }
-    JS_FreeValue(ctx, exception_val);
-    (*env)->ReleaseByteArrayElements(env, jctx, (signed char *)qjs, 0);
-    return jarr;
+    jlongArray ret = (*env)->NewLongArray(env, sizeof(stats)/sizeof(stats[0]));
+    if (ret)
+        (*env)->SetLongArrayRegion(env, ret, 0, sizeof(stats)/sizeof(stats[0]), stats);
+    return ret;
 }
 
-static JSValue js_call_java(JSContext *ctx, JSValueConst this_val,
+/* Post the result of a callJavaAsync() operation, called from any thread */
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeCompleteJava(
+        JNIEnv *env, jclass cls, jlong handle, jint id, jobjectArray result, jthrowable error)
+{
+    HandleSlot *slot = get_handle_slot(handle);
+    if (unlikely(!slot))
+        return;
+    AsyncCompletion *c = malloc(sizeof(AsyncCompletion));
+    if (unlikely(!c)) {
+        fprintf(stdout, "nativeCompleteJava: out of memory\n");
+        return;
+    }
+    c->id = id;
+    c->result = result? (*env)->NewGlobalRef(env, result) : NULL;
+    c->error = error? (*env)->NewGlobalRef(env, error) : NULL;
+    /* free_qjs_handle waits for this, so the runtime can't go away once the handle checked out */
+    pthread_mutex_lock(&async_post_mutex);
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    QJSHandle *qjs = HANDLE_GEN(state) == (uint32_t)(handle >> 32) && (state & HANDLE_BUSY)? slot->qjs : NULL;
+    if (likely(qjs != NULL)) { // otherwise the call gave up on its operations and returned
+        pthread_mutex_lock(&qjs->async_mutex);
+        c->next = qjs->completions;
+        qjs->completions = c;
+        pthread_cond_signal(&qjs->async_cond);
+        pthread_mutex_unlock(&qjs->async_mutex);
+    }
+    pthread_mutex_unlock(&async_post_mutex);
+    if (!qjs) {
+        if (c->result)
+            (*env)->DeleteGlobalRef(env, c->result);
+        if (c->error)
+            (*env)->DeleteGlobalRef(env, c->error);
+        free(c);
+    }
+}
+
+/* setTimeout(func, delay): run func after delay ms, within the current async call */
+static JSValue js_set_timeout(JSContext *ctx, JSValueConst this_val,
                         int argc, JSValueConst *argv)
 {
     JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
-    if (javaCtx == NULL) {
-        fprintf(stdout, "js_call_java: JS_GetContextOpaque is NULL");
+    if (unlikely(!javaCtx || !javaCtx->async))
+        return JS_ThrowTypeError(ctx, "setTimeout is only available in async calls");
+    QJSHandle *qjs = javaCtx->qjs;
+    int64_t delay = 0;
+    if (!JS_IsFunction(ctx, argv[0]))
+        return JS_ThrowTypeError(ctx, "not a function");
+    if (argc > 1 && JS_ToInt64(ctx, &delay, argv[1]))
+        return JS_EXCEPTION;
+    AsyncTimer *t = js_malloc(ctx, sizeof(AsyncTimer));
+    if (!t)
+        return JS_EXCEPTION;
+    t->id = ++qjs->next_async_id;
+    t->deadline = get_time_ns() + (delay > 0? delay : 0) * 1000000;
+    t->func = JS_DupValue(ctx, argv[0]);
+    t->next = qjs->timers;
+    qjs->timers = t;
+    return JS_NewInt32(ctx, t->id);
+}
+
+static JSValue js_clear_timeout(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv)
+{
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    int id;
+    if (!javaCtx || JS_ToInt32(ctx, &id, argv[0]))
         return JS_UNDEFINED;
+    for (AsyncTimer **pt = &javaCtx->qjs->timers; *pt; pt = &(*pt)->next) {
+        if ((*pt)->id == id) {
+            AsyncTimer *t = *pt;
+            *pt = t->next;
+            JS_FreeValue(ctx, t->func);
+            js_free(ctx, t);
+            break;
+        }
     }
-    JNIEnv *env = javaCtx->env;
-    int depth = 0;
-    jobjectArray jarr = newJavaObjectArray(ctx, env, javaCtx, argc, argv, &depth);
-    jarr = (jobjectArray)(*env)->CallObjectMethod(env, javaCtx->thisObject, javaCtx->callJava, jarr);
-    JSValue ret = newJSArray(ctx, env, javaCtx, jarr, &depth);
-    if (jarr && (*env)->GetArrayLength(env, jarr) == 2) { // did we get an exception back?
-        JSValue val = JS_GetPropertyUint32(ctx, ret, 0);
-        const char *str = JS_ToCString(ctx, val);
-        if (unlikely(!str))
-            str = "";
-        if (!strcmp(str, "__error__")) {
-            JSValue error = JS_GetPropertyUint32(ctx, ret, 1);
-            const char *cerror = JS_ToCString(ctx, error);
-            JS_FreeValue(ctx, ret);
-            ret = JS_ThrowInternalError(ctx, cerror);
-            JS_FreeCString(ctx, cerror);
-            JS_FreeValue(ctx, error);
+    return JS_UNDEFINED;
+}
+
+/*
+ * console.log/info/warn/error. Each thread appends records to its own ring buffer, with the
+ * thread as the only producer and the drainer as the only consumer, so logging takes no lock and
+ * makes no syscall on the call path. A background thread drains the rings in batches to stdout,
+ * a file or QuickJSConnector.logBatch. A record that doesn't fit in the ring is counted as dropped
+ * instead of waiting for the drainer
+ */
+#define LOG_PAD 0xffff // skip to the start of the ring
+#define LOG_RING_SIZE (64*1024) // power of two
+#define LOG_MAX_MESSAGE (LOG_RING_SIZE/4) // longer messages are truncated
+#define LOG_MAX_KEY 1024
+#define LOG_DRAIN_INTERVAL_NS 10000000
+#define LOG_BATCH 256
+
+#define LOG_SINK_STDOUT 0 // see QuickJSConnector.logToStdout/logToFile/setLogHandler
+#define LOG_SINK_FILE 1
+#define LOG_SINK_JAVA 2
+
+typedef struct LogRecord {
+    uint32_t size; // of the whole record, a multiple of 8
+    uint16_t level;
+    uint16_t key_len;
+    uint32_t msg_len;
+    uint32_t tid;
+    int64_t time_ns; // CLOCK_REALTIME
+    /* followed by script key and message */
+} LogRecord;
+
+typedef struct LogRing {
+    struct LogRing *next;
+    uint64_t head; // advanced by the owning thread
+    uint64_t tail; // advanced by the drainer
+    int64_t dropped;
+    int dead; // owning thread exited, free once drained
+    uint32_t tid;
+    uint8_t buf[LOG_RING_SIZE];
+} LogRing;
+
+static LogRing *log_rings; // pushed with CAS, unlinked by the drainer only
+static __thread LogRing *log_ring;
+static __thread char log_message[LOG_MAX_MESSAGE];
+static pthread_key_t log_ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int log_drainer_running;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER; // one drain at a time, guards the sink
+static int log_sink = LOG_SINK_STDOUT;
+static FILE *log_file;
+static int64_t log_records, log_dropped_freed; // updated atomically
+static const char *log_level_names[] = { "INFO", "WARN", "ERROR" };
+
+static void log_ring_exit(void *ring)
+{
+    __atomic_store_n(&((LogRing *)ring)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void drain_log(JNIEnv *env);
+
+static void *log_drainer(void *arg)
+{
+    JNIEnv *env = NULL;
+    for (;;) {
+        struct timespec ts = { 0, LOG_DRAIN_INTERVAL_NS };
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&log_drain_mutex);
+        if (log_sink == LOG_SINK_JAVA && !env && java_vm &&
+                (*java_vm)->AttachCurrentThreadAsDaemon(java_vm, (void **)&env, NULL) != JNI_OK)
+            env = NULL;
+        drain_log(env);
+        pthread_mutex_unlock(&log_drain_mutex);
+    }
+    return NULL;
+}
+
+static void start_log_drainer()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    if (pthread_key_create(&log_ring_key, log_ring_exit))
+        return;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    log_drainer_running = !pthread_create(&thread, &attr, log_drainer, NULL);
+    pthread_attr_destroy(&attr);
+    if (!log_drainer_running)
+        fprintf(stdout, "quickjs: cannot start log thread, console.log writes to stdout directly\n");
+}
+
+/* Start the drainer, which also flushes the diagnostics written to stdout */
+static void init_log()
+{
+    pthread_once(&log_once, start_log_drainer);
+}
+
+static LogRing *get_log_ring()
+{
+    LogRing *ring = log_ring;
+    if (likely(ring != NULL))
+        return ring;
+    init_log();
+    if (!log_drainer_running || !(ring = calloc(1, sizeof(LogRing))))
+        return NULL;
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    pthread_setspecific(log_ring_key, ring);
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    log_ring = ring;
+    return ring;
+}
+
+static void log_append(int level, const char *key, size_t key_len, const char *msg, size_t msg_len)
+{
+    LogRing *ring = get_log_ring();
+    if (unlikely(!ring)) {
+        fprintf(stdout, "%.*s\n", (int)msg_len, msg);
+        return;
+    }
+    if (key_len > LOG_MAX_KEY)
+        key_len = LOG_MAX_KEY;
+    uint32_t size = (sizeof(LogRecord) + key_len + msg_len + 7) & ~7;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t pos = head & (LOG_RING_SIZE - 1);
+    uint32_t pad = LOG_RING_SIZE - pos < size? LOG_RING_SIZE - pos : 0;
+    if (unlikely(LOG_RING_SIZE - (head - tail) < pad + size)) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    LogRecord *r = (LogRecord *)(ring->buf + pos);
+    if (pad) { // records are contiguous, wrap around
+        r->size = pad;
+        r->level = LOG_PAD;
+        r = (LogRecord *)ring->buf;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->size = size;
+    r->level = level;
+    r->key_len = key_len;
+    r->msg_len = msg_len;
+    r->tid = ring->tid;
+    r->time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memcpy(r + 1, key, key_len);
+    memcpy((char *)(r + 1) + key_len, msg, msg_len);
+    __atomic_store_n(&ring->head, head + pad + size, __ATOMIC_RELEASE);
+}
+
+static void write_log_record(FILE *f, const LogRecord *r)
+{
+    time_t sec = r->time_ns / 1000000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    const char *key = (const char *)(r + 1);
+    fprintf(f, "%04d-%02d-%02d %02d:%02d:%02d.%03d %s [%u] %.*s: %.*s\n", tm.tm_year + 1900,
+            tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (int)(r->time_ns / 1000000 % 1000), log_level_names[r->level], r->tid,
+            (int)r->key_len, key, (int)r->msg_len, key + r->key_len);
+}
+
+/* Pass up to LOG_BATCH records to QuickJSConnector.logBatch */
+static void log_batch_java(JNIEnv *env, const LogRecord **records, int count)
+{
+    if ((*env)->PushLocalFrame(env, 2 * count + 8) < 0) {
+        (*env)->ExceptionClear(env);
+        return;
+    }
+    jint levels[LOG_BATCH], tids[LOG_BATCH];
+    jlong times[LOG_BATCH];
+    jintArray jlevels = (*env)->NewIntArray(env, count);
+    jlongArray jtimes = (*env)->NewLongArray(env, count);
+    jintArray jtids = (*env)->NewIntArray(env, count);
+    jobjectArray scripts = (*env)->NewObjectArray(env, count, jrefs.stringClass, NULL);
+    jobjectArray messages = (*env)->NewObjectArray(env, count, jrefs.stringClass, NULL);
+    if (jlevels && jtimes && jtids && scripts && messages) {
+        for (int i = 0; i < count; i++) {
+            const LogRecord *r = records[i];
+            const char *key = (const char *)(r + 1);
+            levels[i] = r->level;
+            times[i] = r->time_ns / 1000000;
+            tids[i] = r->tid;
+            (*env)->SetObjectArrayElement(env, scripts, i, newJavaStringUTF8(env, key, r->key_len));
+            (*env)->SetObjectArrayElement(env, messages, i,
+                    newJavaStringUTF8(env, key + r->key_len, r->msg_len));
         }
-        JS_FreeCString(ctx, str);
-        JS_FreeValue(ctx, val);
+        (*env)->SetIntArrayRegion(env, jlevels, 0, count, levels);
+        (*env)->SetLongArrayRegion(env, jtimes, 0, count, times);
+        (*env)->SetIntArrayRegion(env, jtids, 0, count, tids);
+        (*env)->CallStaticVoidMethod(env, jrefs.connectorClass, jrefs.logBatch, count,
+                jlevels, jtimes, jtids, scripts, messages);
     }
-    return ret;
+    (*env)->ExceptionClear(env); // nobody to report it to
+    (*env)->PopLocalFrame(env, NULL);
 }
 
-static JSValue js_print(JSContext *ctx, JSValueConst this_val,
-                        int argc, JSValueConst *argv)
+/* Write out all records and free the rings of exited threads. Called with log_drain_mutex */
+static void drain_log(JNIEnv *env)
 {
-    int i;
-    const char *str;
+    const LogRecord *batch[LOG_BATCH];
+    FILE *f = log_sink == LOG_SINK_FILE && log_file? log_file : stdout;
+    int java = log_sink == LOG_SINK_JAVA && env;
+    LogRing *prev = NULL, *next;
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = next) {
+        next = ring->next;
+        int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        while (tail != head) {
+            int count = 0;
+            uint64_t end = tail;
+            while (end != head && count < LOG_BATCH) {
+                const LogRecord *r = (const LogRecord *)(ring->buf + (end & (LOG_RING_SIZE - 1)));
+                end += r->size;
+                if (r->level != LOG_PAD)
+                    batch[count++] = r;
+            }
+            if (java)
+                log_batch_java(env, batch, count);
+            else for (int i = 0; i < count; i++)
+                write_log_record(f, batch[i]);
+            __atomic_add_fetch(&log_records, count, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring->tail, end, __ATOMIC_RELEASE);
+            tail = end;
+        }
+        if (dead) { // the list head can only be unlinked if no ring was pushed since
+            LogRing *expected = ring;
+            if (prev)
+                prev->next = next;
+            else if (!__atomic_compare_exchange_n(&log_rings, &expected, next, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                prev = ring;
+                continue;
+            }
+            __atomic_add_fetch(&log_dropped_freed, ring->dropped, __ATOMIC_RELAXED);
+            free(ring);
+            continue;
+        }
+        prev = ring;
+    }
+    fflush(f);
+    if (f != stdout)
+        fflush(stdout); // other diagnostics still go to stdout
+}
 
-    for(i = 0; i < argc; i++) {
-        if (i != 0)
-            fputs(" ", stdout);
-        str = JS_ToCString(ctx, argv[i]);
+static JSValue js_print(JSContext *ctx, JSValueConst this_val,
+                        int argc, JSValueConst *argv, int level)
+{
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) {
+        size_t str_len;
+        const char *str = JS_ToCStringLen(ctx, &str_len, argv[i]);
         if (!str)
             return JS_EXCEPTION;
-        fputs(str, stdout);
+        if (i != 0 && len < LOG_MAX_MESSAGE)
+            log_message[len++] = ' ';
+        if (str_len > LOG_MAX_MESSAGE - len)
+            str_len = LOG_MAX_MESSAGE - len;
+        memcpy(log_message + len, str, str_len);
+        len += str_len;
         JS_FreeCString(ctx, str);
     }
-    fputs("\n", stdout);
+    JavaHandle *javaCtx = (JavaHandle *)JS_GetContextOpaque(ctx);
+    const char *key = javaCtx? javaCtx->qjs->stats->key : get_loading_root_module();
+    if (!key)
+        key = "";
+    log_append(level, key, strlen(key), log_message, len);
     return JS_UNDEFINED;
 }
 
-static int eval_module(JSContext *ctx, const char *filename)
+JNIEXPORT jboolean JNICALL Java_org_scriptable_QuickJSConnector_nativeSetLogSink(
+        JNIEnv *env, jclass cls, jint sink, jstring path)
 {
-    size_t buf_len;
-    uint8_t *buf = js_load_file(ctx, &buf_len, filename);
-    if (!buf) {
-        JS_ThrowInternalError(ctx, strerror(errno));
-        //perror(filename);
-        return -1;
+    FILE *f = NULL;
+    if (sink == LOG_SINK_FILE) {
+        const char *_path = (*env)->GetStringUTFChars(env, path, NULL);
+        f = fopen(_path, "a");
+        (*env)->ReleaseStringUTFChars(env, path, _path);
+        if (!f)
+            return JNI_FALSE;
     }
+    init_log();
+    pthread_mutex_lock(&log_drain_mutex);
+    drain_log(env); // pending records go to the old sink
+    if (log_file)
+        fclose(log_file);
+    log_file = f;
+    log_sink = sink;
+    pthread_mutex_unlock(&log_drain_mutex);
+    return JNI_TRUE;
+}
 
-    int ret = eval_buf(ctx, buf, buf_len, filename, JS_EVAL_TYPE_MODULE); // vs JS_EVAL_TYPE_GLOBAL
-    js_free(ctx, buf);
-    return ret;
+JNIEXPORT void JNICALL Java_org_scriptable_QuickJSConnector_nativeFlushLog(
+        JNIEnv *env, jclass cls)
+{
+    pthread_mutex_lock(&log_drain_mutex);
+    drain_log(env);
+    pthread_mutex_unlock(&log_drain_mutex);
 }
 
-static int eval_buf(JSContext *ctx, const void *buf, int buf_len,
-        const char *filename, int eval_flags)
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetLogStats(
+        JNIEnv *env, jclass cls)
 {
-    int ret = 0;
-    JSValue val;
+    jlong stats[3] = { __atomic_load_n(&log_records, __ATOMIC_RELAXED),
+        __atomic_load_n(&log_dropped_freed, __ATOMIC_RELAXED), 0 };
+    pthread_mutex_lock(&log_drain_mutex); // rings are only freed by drain_log
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        stats[1] += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        stats[2]++;
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
+    jlongArray ret = (*env)->NewLongArray(env, 3);
+    if (ret)
+        (*env)->SetLongArrayRegion(env, ret, 0, 3, stats);
+    return ret;
+}
 
-    if ((eval_flags & JS_EVAL_TYPE_MASK) == JS_EVAL_TYPE_MODULE) {
-        /* for the modules, we compile then run to be able to set
-           import.meta */
-        val = JS_Eval(ctx, buf, buf_len, filename,
-                      eval_flags | JS_EVAL_FLAG_COMPILE_ONLY);
-        if (!JS_IsException(val)) {
-            js_module_set_import_meta(ctx, val, 1, 1);
-            val = JS_EvalFunction(ctx, val);
+/* Modules of filename that changed on disk since its last runtime was created,
+   null if no runtime was created from it yet */
+JNIEXPORT jobjectArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetChangedModules(
+        JNIEnv *env, jclass cls, jstring filename)
+{
+    const char *_filename = (*env)->GetStringUTFChars(env, filename, NULL);
+    char *changed[256];
+    int count = get_changed_modules(_filename, changed, 256);
+    (*env)->ReleaseStringUTFChars(env, filename, _filename);
+    jobjectArray ret = NULL;
+    if (count >= 0 && (ret = (*env)->NewObjectArray(env, count, jrefs.stringClass, NULL))) {
+        for (int i = 0; i < count; i++) {
+            jstring path = (*env)->NewStringUTF(env, changed[i]);
+            (*env)->SetObjectArrayElement(env, ret, i, path);
+            (*env)->DeleteLocalRef(env, path);
         }
-    } else {
-        val = JS_Eval(ctx, buf, buf_len, filename, eval_flags);
     }
-    if (JS_IsException(val)) {
-        ret = -1;
-    }
-    JS_FreeValue(ctx, val);
+    for (int i = 0; i < count; i++)
+        free(changed[i]);
     return ret;
 }
 
+/* Compile the modules of filename into the bytecode cache, for runtimes of a reloaded script */
+JNIEXPORT jboolean JNICALL Java_org_scriptable_QuickJSConnector_nativeWarmModules(
+        JNIEnv *env, jclass cls, jstring filename)
+{
+    const char *_filename = (*env)->GetStringUTFChars(env, filename, NULL);
+    if (!_filename)
+        return JNI_FALSE;
+    int ret = warm_module_cache(_filename);
+    (*env)->ReleaseStringUTFChars(env, filename, _filename);
+    return ret < 0? JNI_FALSE : JNI_TRUE;
+}
 
+/* hits, misses, entries, bytes, nanoseconds of compilation saved by hits, snapshot hits and misses */
+JNIEXPORT jlongArray JNICALL Java_org_scriptable_QuickJSConnector_nativeGetBytecodeCacheStats(
+        JNIEnv *env, jclass cls)
+{
+    int64_t stats[BC_CACHE_STAT_COUNT];
+    get_bytecode_cache_stats(stats);
+    jlongArray ret = (*env)->NewLongArray(env, BC_CACHE_STAT_COUNT);
+    if (ret)
+        (*env)->SetLongArrayRegion(env, ret, 0, BC_CACHE_STAT_COUNT, (const jlong *)stats);
+    return ret;
+}
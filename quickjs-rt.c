@@ -0,0 +1,486 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "quickjs-rt.h"
+
+/*
+ * Process-wide cache of compiled module bytecode (JS_WriteObject output), shared by all runtimes.
+ * Entries are keyed by module path and are replaced once the file's mtime or size changes.
+ * An entry is reference counted so a runtime may read it while another thread replaces it.
+ */
+typedef struct BytecodeCacheEntry {
+    struct BytecodeCacheEntry *next;
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    uint8_t *buf;
+    size_t buf_len;
+    int64_t compile_ns; // time it took to load and compile the source
+    int ref_count;
+    int unlinked;
+} BytecodeCacheEntry;
+
+#define BC_CACHE_BUCKETS 256
+static pthread_mutex_t bc_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static BytecodeCacheEntry *bc_cache[BC_CACHE_BUCKETS];
+static int64_t bc_cache_entries, bc_cache_bytes; // guarded by bc_cache_mutex
+static int64_t bc_cache_hits, bc_cache_misses, bc_cache_saved_ns; // updated atomically
+
+static force_inline unsigned bc_cache_hash(const char *path)
+{
+    return hash_string(path) % BC_CACHE_BUCKETS;
+}
+
+static void bc_cache_free_entry(BytecodeCacheEntry *e)
+{
+    free(e->path);
+    free(e->buf);
+    free(e);
+}
+
+/* Return a referenced entry matching path and file stat, or NULL */
+static BytecodeCacheEntry *bc_cache_get(const char *path, const struct stat *st)
+{
+    BytecodeCacheEntry *e;
+    pthread_mutex_lock(&bc_cache_mutex);
+    for (e = bc_cache[bc_cache_hash(path)]; e; e = e->next) {
+        if (!strcmp(e->path, path)) {
+            if (e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+                    e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+                e->ref_count++;
+            else
+                e = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bc_cache_mutex);
+    return e;
+}
+
+static void bc_cache_release(BytecodeCacheEntry *e)
+{
+    pthread_mutex_lock(&bc_cache_mutex);
+    int free_it = !--e->ref_count && e->unlinked;
+    pthread_mutex_unlock(&bc_cache_mutex);
+    if (free_it)
+        bc_cache_free_entry(e);
+}
+
+/* Store bytecode for path, replacing any entry for an older version of the file */
+static void bc_cache_put(const char *path, const struct stat *st,
+        const uint8_t *buf, size_t buf_len, int64_t compile_ns)
+{
+    BytecodeCacheEntry *e = malloc(sizeof(BytecodeCacheEntry));
+    if (!e)
+        return;
+    e->path = strdup(path);
+    e->buf = malloc(buf_len);
+    if (!e->path || !e->buf) {
+        bc_cache_free_entry(e);
+        return;
+    }
+    memcpy(e->buf, buf, buf_len);
+    e->buf_len = buf_len;
+    e->mtime = st->st_mtim;
+    e->size = st->st_size;
+    e->compile_ns = compile_ns;
+    e->ref_count = 0;
+    e->unlinked = 0;
+
+    BytecodeCacheEntry *old = NULL;
+    pthread_mutex_lock(&bc_cache_mutex);
+    BytecodeCacheEntry **pe = &bc_cache[bc_cache_hash(path)];
+    for (; *pe; pe = &(*pe)->next) {
+        if (!strcmp((*pe)->path, path)) {
+            old = *pe;
+            *pe = old->next;
+            old->unlinked = 1;
+            bc_cache_entries--;
+            bc_cache_bytes -= old->buf_len;
+            if (old->ref_count)
+                old = NULL; // last reader will free it
+            break;
+        }
+    }
+    e->next = bc_cache[bc_cache_hash(path)];
+    bc_cache[bc_cache_hash(path)] = e;
+    bc_cache_entries++;
+    bc_cache_bytes += buf_len;
+    pthread_mutex_unlock(&bc_cache_mutex);
+    if (old)
+        bc_cache_free_entry(old);
+}
+
+static __thread const char *loading_root_module; // set while load_root_module evaluates it
+
+/*
+ * Module graphs. The files making up each root module, as of the last runtime created from it,
+ * so that changes can be found without recompiling anything. A new runtime only recompiles the
+ * changed files, the others come from the bytecode cache
+ */
+typedef struct ModuleFile {
+    struct ModuleFile *next;
+    char *path;
+    struct timespec mtime;
+    off_t size;
+} ModuleFile;
+
+typedef struct ModuleGraph {
+    struct ModuleGraph *next;
+    char *root;
+    ModuleFile *files;
+} ModuleGraph;
+
+static pthread_mutex_t module_graph_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ModuleGraph *module_graphs;
+static __thread ModuleFile *loading_module_files; // collected by compile_module
+static __thread int loading_module_files_lost; // some couldn't be recorded, out of memory
+
+static void free_module_files(ModuleFile *f)
+{
+    while (f) {
+        ModuleFile *next = f->next;
+        free(f->path);
+        free(f);
+        f = next;
+    }
+}
+
+static void add_loading_module(const char *path, const struct stat *st)
+{
+    ModuleFile *f;
+    if (!loading_root_module)
+        return;
+    if (!(f = malloc(sizeof(ModuleFile)))) {
+        loading_module_files_lost = 1;
+        return;
+    }
+    if (!(f->path = strdup(path))) {
+        free(f);
+        loading_module_files_lost = 1;
+        return;
+    }
+    f->mtime = st->st_mtim;
+    f->size = st->st_size;
+    f->next = loading_module_files;
+    loading_module_files = f;
+}
+
+/* Replace the graph of root with the files just loaded */
+static void set_module_graph(const char *root, ModuleFile *files)
+{
+    ModuleFile *old = NULL;
+    pthread_mutex_lock(&module_graph_mutex);
+    ModuleGraph *g;
+    for (g = module_graphs; g && strcmp(g->root, root); g = g->next)
+        ;
+    if (!g && (g = calloc(1, sizeof(ModuleGraph)))) {
+        if ((g->root = strdup(root))) {
+            g->next = module_graphs;
+            module_graphs = g;
+        } else {
+            free(g);
+            g = NULL;
+        }
+    }
+    if (g) {
+        old = g->files;
+        g->files = files;
+    } else {
+        old = files;
+    }
+    pthread_mutex_unlock(&module_graph_mutex);
+    free_module_files(old);
+}
+
+/* Time this thread spent in js_cached_module_loader while compiling the current module. Compiling
+   a module loads its imports, which must not count in the compile time it is cached with */
+static __thread int64_t import_ns;
+
+/* Compile module source or read it from the bytecode cache.
+   Returns the module object (not yet resolved if it came from cache) or JS_EXCEPTION */
+static JSValue compile_module(JSContext *ctx, const char *filename, int *from_cache)
+{
+    struct stat st;
+    *from_cache = 0;
+    if (stat(filename, &st) < 0) {
+        JS_ThrowReferenceError(ctx, "could not load module filename '%s': %s", filename, strerror(errno));
+        return JS_EXCEPTION;
+    }
+
+    add_loading_module(filename, &st);
+    int64_t start = get_time_ns();
+    BytecodeCacheEntry *e = bc_cache_get(filename, &st);
+    if (e) {
+        JSValue val = JS_ReadObject(ctx, e->buf, e->buf_len, JS_READ_OBJ_BYTECODE);
+        int64_t saved = e->compile_ns - (get_time_ns() - start);
+        bc_cache_release(e);
+        if (!JS_IsException(val)) {
+            __atomic_add_fetch(&bc_cache_hits, 1, __ATOMIC_RELAXED);
+            if (saved > 0)
+                __atomic_add_fetch(&bc_cache_saved_ns, saved, __ATOMIC_RELAXED);
+            *from_cache = 1;
+            return val;
+        }
+        JS_FreeValue(ctx, JS_GetException(ctx)); // stale or unreadable bytecode, recompile
+    }
+    __atomic_add_fetch(&bc_cache_misses, 1, __ATOMIC_RELAXED);
+
+    size_t buf_len;
+    uint8_t *buf = js_load_file(ctx, &buf_len, filename);
+    if (!buf) {
+        JS_ThrowReferenceError(ctx, "could not load module filename '%s': %s", filename, strerror(errno));
+        return JS_EXCEPTION;
+    }
+    int64_t outer_import_ns = import_ns;
+    import_ns = 0;
+    int64_t eval_start = get_time_ns();
+    JSValue val = JS_Eval(ctx, (char *)buf, buf_len, filename,
+                          JS_EVAL_TYPE_MODULE | JS_EVAL_FLAG_COMPILE_ONLY);
+    int64_t compile_ns = get_time_ns() - eval_start - import_ns; // this module's own compilation
+    import_ns = outer_import_ns; // the loader adds all of this module's load time for the importer
+    js_free(ctx, buf);
+    if (JS_IsException(val))
+        return val;
+    size_t bc_len;
+    uint8_t *bc = JS_WriteObject(ctx, &bc_len, val, JS_WRITE_OBJ_BYTECODE);
+    if (bc) {
+        bc_cache_put(filename, &st, bc, bc_len, compile_ns);
+        js_free(ctx, bc);
+    }
+    return val;
+}
+
+/*
+ * Startup snapshots. QuickJS cannot serialize a whole initialised heap, so startup data is
+ * snapshotted per value instead: snapshot(name, producer) runs producer() in the first runtime of
+ * a root module and stores the result as a JS_WriteObject image in the bytecode cache, keyed by the
+ * module path and name and invalidated when any file of its module graph changes. Later runtimes, on any thread, get a
+ * copy read back from the image. Only plain data can be stored (objects, arrays, strings, numbers,
+ * typed arrays...), shared sub-objects are copied as a tree. Module bytecode is already cached
+ * above, so a runtime whose setup goes through snapshot() skips both compilation and setup work.
+ */
+static int64_t snapshot_hits, snapshot_misses; // updated atomically
+
+static force_inline uint64_t fnv_mix(uint64_t h, uint64_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8)
+        h = (h ^ (v & 0xff)) * 1099511628211ULL;
+    return h;
+}
+
+/* Version of the module graph being loaded, as bytecode cache entries are matched: the latest
+   mtime of its files and, as size, a hash of their paths, sizes and mtimes. Imports are loaded
+   before any module code runs, so the graph is complete when snapshot() is called. Return 0 if
+   the graph wasn't fully recorded */
+static int module_graph_version(struct stat *st)
+{
+    uint64_t h = 14695981039346656037ULL;
+    memset(st, 0, sizeof(*st));
+    for (ModuleFile *f = loading_module_files; f; f = f->next) {
+        for (const char *p = f->path; *p; p++)
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        h = fnv_mix(fnv_mix(fnv_mix(h, f->size), f->mtime.tv_sec), f->mtime.tv_nsec);
+        if (f->mtime.tv_sec > st->st_mtim.tv_sec ||
+                (f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec > st->st_mtim.tv_nsec))
+            st->st_mtim = f->mtime;
+    }
+    st->st_size = (off_t)h;
+    return loading_module_files && !loading_module_files_lost;
+}
+
+JSValue js_snapshot(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv)
+{
+    const char *root = loading_root_module;
+    if (!root)
+        return JS_ThrowTypeError(ctx, "snapshot() is only available while the module is loaded");
+    if (!JS_IsFunction(ctx, argv[1]))
+        return JS_ThrowTypeError(ctx, "not a function");
+    const char *name = JS_ToCString(ctx, argv[0]);
+    if (!name)
+        return JS_EXCEPTION;
+    char *key = js_malloc(ctx, strlen(root) + strlen(name) + 11); // name is up to the script
+    if (key)
+        sprintf(key, "%s\nsnapshot:%s", root, name); // can't clash with a module path
+    JS_FreeCString(ctx, name);
+    if (!key)
+        return JS_EXCEPTION;
+
+    struct stat st;
+    int cacheable = module_graph_version(&st);
+    BytecodeCacheEntry *e = cacheable? bc_cache_get(key, &st) : NULL;
+    if (e) {
+        JSValue val = JS_ReadObject(ctx, e->buf, e->buf_len, 0);
+        bc_cache_release(e);
+        if (!JS_IsException(val)) {
+            __atomic_add_fetch(&snapshot_hits, 1, __ATOMIC_RELAXED);
+            js_free(ctx, key);
+            return val;
+        }
+        JS_FreeValue(ctx, JS_GetException(ctx));
+    }
+    __atomic_add_fetch(&snapshot_misses, 1, __ATOMIC_RELAXED);
+
+    int64_t start = get_time_ns();
+    JSValue val = JS_Call(ctx, argv[1], JS_UNDEFINED, 0, NULL);
+    if (JS_IsException(val) || !cacheable) {
+        js_free(ctx, key);
+        return val;
+    }
+    size_t len;
+    uint8_t *buf = JS_WriteObject(ctx, &len, val, 0);
+    if (!buf) { // functions, closures and other host state can't be snapshotted
+        js_free(ctx, key);
+        JS_FreeValue(ctx, val);
+        return JS_EXCEPTION;
+    }
+    bc_cache_put(key, &st, buf, len, get_time_ns() - start);
+    js_free(ctx, key);
+    js_free(ctx, buf);
+    return val;
+}
+
+static int eval_module(JSContext *ctx, const char *filename)
+{
+    int from_cache;
+    JSValue val = compile_module(ctx, filename, &from_cache);
+    if (JS_IsException(val))
+        return -1;
+    /* bytecode read from the cache does not have its imports loaded yet */
+    if (from_cache && JS_ResolveModule(ctx, val) < 0) {
+        JS_FreeValue(ctx, val);
+        return -1;
+    }
+    /* for the modules, we compile then run to be able to set import.meta */
+    js_module_set_import_meta(ctx, val, 1, 1);
+    val = JS_EvalFunction(ctx, val);
+    int ret = JS_IsException(val)? -1 : 0;
+    JS_FreeValue(ctx, val);
+    return ret;
+}
+
+JSModuleDef *js_cached_module_loader(JSContext *ctx, const char *module_name, void *opaque)
+{
+    size_t len = strlen(module_name);
+    if (len > 3 && !strcmp(module_name + len - 3, ".so"))
+        return js_module_loader(ctx, module_name, opaque);
+
+    int from_cache;
+    int64_t start = get_time_ns();
+    JSValue val = compile_module(ctx, module_name, &from_cache);
+    import_ns += get_time_ns() - start;
+    if (JS_IsException(val))
+        return NULL;
+    js_module_set_import_meta(ctx, val, 1, 0);
+    /* the module is already referenced, so we must free it */
+    JSModuleDef *m = JS_VALUE_GET_PTR(val);
+    JS_FreeValue(ctx, val);
+    return m;
+}
+
+/*
+ * The std and os modules allocate their class ids with JS_NewClassID when first imported, and
+ * that isn't thread safe: two runtimes loading at once can register different ids while the
+ * global keeps only one. Import them once in a scratch runtime so later loads find them set
+ */
+static pthread_once_t class_ids_once = PTHREAD_ONCE_INIT;
+
+static void init_class_ids(void)
+{
+    static const char source[] = "import 'std'; import 'os';";
+    JSRuntime *rt = JS_NewRuntime();
+    JSContext *ctx = rt? JS_NewContext(rt) : NULL;
+    if (ctx) {
+        js_init_module_std(ctx, "std");
+        js_init_module_os(ctx, "os");
+        JSValue val = JS_Eval(ctx, source, sizeof(source) - 1, "<init>", JS_EVAL_TYPE_MODULE);
+        if (JS_IsException(val))
+            fprintf(stdout, "Error: cannot initialize std/os modules\n");
+        JS_FreeValue(ctx, val);
+        JS_FreeContext(ctx);
+    }
+    if (rt)
+        JS_FreeRuntime(rt);
+}
+
+int load_root_module(JSContext *ctx, const char *filename)
+{
+    pthread_once(&class_ids_once, init_class_ids);
+    loading_root_module = filename;
+    loading_module_files = NULL;
+    loading_module_files_lost = 0;
+    int ret = eval_module(ctx, filename);
+    loading_root_module = NULL;
+    if (!ret)
+        set_module_graph(filename, loading_module_files);
+    else
+        free_module_files(loading_module_files);
+    loading_module_files = NULL;
+    return ret;
+}
+
+int warm_module_cache(const char *filename)
+{
+    JSRuntime *rt = JS_NewRuntime();
+    JSContext *ctx = rt? JS_NewContext(rt) : NULL;
+    int ret = -1;
+    if (ctx) {
+        JS_SetModuleLoaderFunc(rt, NULL, js_cached_module_loader, NULL);
+        js_init_module_std(ctx, "std");
+        js_init_module_os(ctx, "os");
+        int from_cache;
+        JSValue val = compile_module(ctx, filename, &from_cache);
+        if (!JS_IsException(val)) {
+            /* compiling resolves the imports, going through the cache, bytecode read from it doesn't */
+            ret = from_cache? JS_ResolveModule(ctx, val) : 0;
+            JS_FreeValue(ctx, val);
+        }
+        if (ret < 0)
+            JS_FreeValue(ctx, JS_GetException(ctx));
+        JS_FreeContext(ctx);
+    }
+    if (rt)
+        JS_FreeRuntime(rt);
+    return ret;
+}
+
+const char *get_loading_root_module(void)
+{
+    return loading_root_module;
+}
+
+int get_changed_modules(const char *root, char **changed, int max)
+{
+    int count = 0, known = 0;
+    pthread_mutex_lock(&module_graph_mutex); // held across stat calls, this is not a hot path
+    for (ModuleGraph *g = module_graphs; g; g = g->next) {
+        if (strcmp(g->root, root))
+            continue;
+        known = 1;
+        for (ModuleFile *f = g->files; f && count < max; f = f->next) {
+            struct stat st;
+            if ((stat(f->path, &st) < 0 || st.st_size != f->size || st.st_mtim.tv_sec != f->mtime.tv_sec ||
+                    st.st_mtim.tv_nsec != f->mtime.tv_nsec) && (changed[count] = strdup(f->path)))
+                count++;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&module_graph_mutex);
+    return known? count : -1;
+}
+
+void get_bytecode_cache_stats(int64_t *stats)
+{
+    stats[0] = __atomic_load_n(&bc_cache_hits, __ATOMIC_RELAXED);
+    stats[1] = __atomic_load_n(&bc_cache_misses, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&bc_cache_mutex);
+    stats[2] = bc_cache_entries;
+    stats[3] = bc_cache_bytes;
+    pthread_mutex_unlock(&bc_cache_mutex);
+    stats[4] = __atomic_load_n(&bc_cache_saved_ns, __ATOMIC_RELAXED);
+    stats[5] = __atomic_load_n(&snapshot_hits, __ATOMIC_RELAXED);
+    stats[6] = __atomic_load_n(&snapshot_misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+/*
+ * JS runtime setup shared by the JNI library and the qjsload driver: loading root modules and
+ * their imports through the process-wide bytecode cache, module graphs and snapshot()
+ */
+#ifndef QUICKJS_RT_H
+#define QUICKJS_RT_H
+
+#include <stdint.h>
+#include <time.h>
+#include "quickjs-libc.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define likely(x)          __builtin_expect(!!(x), 1)
+#define unlikely(x)        __builtin_expect(!!(x), 0)
+#define force_inline       inline __attribute__((always_inline))
+#else
+#define likely(x)     (x)
+#define unlikely(x)   (x)
+#define force_inline  inline
+#endif
+
+static inline int64_t get_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned hash_string(const char *s)
+{
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+/* Evaluate module filename and its imports, going through the bytecode cache, and record its
+   module graph if that succeeded. snapshot() works while it runs. Return -1 on exception */
+int load_root_module(JSContext *ctx, const char *filename);
+
+/* Compile module filename and its imports into the bytecode cache without evaluating them, in a
+   scratch runtime. Return -1 if that failed */
+int warm_module_cache(const char *filename);
+
+/* Root module being loaded by this thread, NULL if none */
+const char *get_loading_root_module(void);
+
+/* Same as js_module_loader, but goes through the bytecode cache for JS modules */
+JSModuleDef *js_cached_module_loader(JSContext *ctx, const char *module_name, void *opaque);
+
+/* snapshot(name, producer): producer's result, computed once per version of the root module */
+JSValue js_snapshot(JSContext *ctx, JSValueConst this_val, int argc, JSValueConst *argv);
+
+/* Store in changed up to max malloc'ed paths of the modules of root that changed on disk since
+   it was last loaded, return their count or -1 if it was never loaded */
+int get_changed_modules(const char *root, char **changed, int max);
+
+/* hits, misses, entries, bytes, nanoseconds of compilation saved by hits, snapshot hits and misses */
+#define BC_CACHE_STAT_COUNT 7
+void get_bytecode_cache_stats(int64_t *stats);
+
+#endif /* QUICKJS_RT_H */
@@ -0,0 +1,17 @@
+globalThis.handleRequest = async function(name) {
+    if (name === "never") {
+        callJavaAsync("never");
+        return "abandoned";
+    }
+    let a = await callJavaAsync("async", name);
+    await new Promise(function(resolve) { setTimeout(resolve, 10); });
+    let error;
+    try {
+        await callJavaAsync("fail");
+    } catch(e) {
+        error = e.message;
+    }
+    return a[0] + " " + error;
+}
+
+console.log("Hello from testAsync");
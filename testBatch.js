@@ -0,0 +1,9 @@
+let calls = 0;
+
+globalThis.handleRequest = function(n) {
+    if (n < 0)
+        throw new Error("negative " + n);
+    return ++calls * 100 + n;
+}
+
+console.log("Hello from testBatch");
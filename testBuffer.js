@@ -0,0 +1,10 @@
+globalThis.handleRequest = function(mode, shared, bytes) {
+    if (mode === "result")
+        return new Uint8Array([1, 2, 3, 4]);
+    let u = new Uint8Array(shared);
+    for (let i = 0; i < u.length; i++)
+        u[i] += 1;
+    return (bytes instanceof ArrayBuffer) + ":" + Array.from(new Uint8Array(bytes)).join();
+}
+
+console.log("Hello from testBuffer");
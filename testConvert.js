@@ -0,0 +1,15 @@
+globalThis.handleRequest = function(obj, list, set) {
+    let cyclic = { name: "cyclic" };
+    cyclic.self = cyclic;
+    return {
+        plain: { a: 1, b: "x", nested: { c: [1, 2] } },
+        map: new Map([["k", 1], ["n", { x: 2 }]]),
+        set: new Set(["a", "b", "a"]),
+        echo: obj,
+        keys: Object.keys(obj).join(),
+        list: Array.isArray(list) && Array.isArray(set)? [list, set] : null,
+        cyclic: cyclic
+    };
+}
+
+console.log("Hello from testConvert");
@@ -0,0 +1,11 @@
+globalThis.handleRequest = function(a, b, name) {
+    let error;
+    try {
+        fail("boom");
+    } catch(e) {
+        error = e.message;
+    }
+    return [add(a, b), greet(name), error];
+}
+
+console.log("Hello from testHost");
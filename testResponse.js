@@ -0,0 +1,9 @@
+globalThis.handleRequest = function(n) {
+    for (let i = 0; i < n; i++)
+        response.write("line " + i + "\n");
+    response.flush();
+    response.write("Саша\n");
+    return n;
+}
+
+console.log("Hello from testResponse");
@@ -0,0 +1,12 @@
+const table = snapshot("table", function() {
+    let squares = [];
+    for (let i = 0; i < 1000; i++)
+        squares.push(i * i);
+    return { name: "squares", squares: squares };
+});
+
+globalThis.handleRequest = function(i) {
+    return table.name + ":" + table.squares[i];
+}
+
+console.log("Hello from testSnapshot");
@@ -0,0 +1,5 @@
+globalThis.handleRequest = function(s) {
+    return s + "|" + s.length + "|" + Array.from(s).length;
+}
+
+console.log("Hello from testString");
@@ -0,0 +1,11 @@
+let calls = 0;
+
+globalThis.handleRequest = function(mode) {
+    if (mode === "loop")
+        for (;;);
+    if (mode === "never")
+        return callJavaAsync("never");
+    return ++calls;
+}
+
+console.log("Hello from testTimeout");